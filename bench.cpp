@@ -0,0 +1,1542 @@
+#include "bench.h"
+#include "buffer_pool.h"
+#include "capture.h"
+#include "config.h"
+#include "console.h"
+#include "host.h"
+#include "io_pool.h"
+#include "ktls.h"
+#include "message_log.h"
+#include "peer.h"
+#include "session_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace boost::asio;
+using ip::tcp;
+using std::string;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+
+// Settings for a benchmark run, filled from the command line
+struct BenchOptions {
+    vector<int> client_counts{ 10 };           // One scenario is run per client count
+    double rate = 100.0;                       // Messages per second sent by each client
+    double duration = 5.0;                     // Seconds of load per scenario
+    vector<std::size_t> sizes{ 32, 256, 1024 }; // Message body sizes, used round robin
+    int port = 8600;                           // Loopback port for the host
+    int handshakes = 50;                       // Connections used to compare full and resumed handshakes
+    int mesh_nodes = 5;                        // Nodes in the mesh scenario, 0 skips it
+    int rooms = 4;                             // Rooms in the rooms scenario, 0 skips it
+    WireFormat format = WireFormat::binary;    // Wire format offered by the clients
+    bool compress = true;                      // Offer compression for large messages
+    bool backpressure = true;                  // Run the stalled reader scenario for each slow consumer policy
+    bool ktls = true;                          // Run the bulk transfer scenario without and with kernel TLS
+    bool use_ktls = false;                     // Connections try kernel TLS, set per run by that scenario
+    uint64_t search_messages = 1000000;        // Messages logged and indexed in the search scenario, 0 skips it
+    vector<int> thread_counts{ 1 };            // One throughput scenario is run per IO thread count
+    string replay_file;                        // Capture to replay instead of the synthetic scenarios
+    double replay_speed = 1.0;                 // Multiple of the captured pace, 0 for as fast as the host allows
+    string output_file;                        // Optional JSON output path, stdout is always written
+};
+
+// Measurements gathered during one scenario
+struct BenchResult {
+    int clients = 0;
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t expected = 0;
+    uint64_t bytes_delivered = 0;
+    double elapsed = 0.0;
+    vector<double> handshake_ms;
+    vector<double> latency_us;
+    uint64_t compressed_messages = 0;
+    uint64_t compress_bytes_in = 0;
+    uint64_t compress_bytes_out = 0;
+    uint64_t compress_ns = 0;
+    uint64_t decompress_ns = 0;
+    uint64_t host_allocations = 0;  // Heap allocations on the host's IO thread in the second half of the load
+    uint64_t allocation_window_messages = 0; // Messages sent during that window
+};
+
+// Prints the benchmark usage
+static void print_usage() {
+    std::cerr << "Usage: EchoChat --bench [--clients N[,N...]] [--rate MSGS_PER_SEC] [--duration SECONDS]\n"
+        << "                       [--sizes BYTES[,BYTES...]] [--handshakes N] [--mesh NODES] [--rooms N] [--port PORT]\n"
+        << "                       [--format text|binary] [--compress on|off] [--backpressure on|off] [--threads N[,N...]]\n"
+        << "                       [--ktls on|off] [--search MESSAGES]\n"
+        << "                       [--output FILE]\n"
+        << "       EchoChat --bench --replay CAPTURE [--speed 1|N|max] [--port PORT] [--output FILE]\n";
+}
+
+// Parses a comma separated list of numbers
+template <typename T>
+static bool parse_list(const string& text, vector<T>& values) {
+    values.clear();
+    std::stringstream ss(text);
+    string item;
+    while (std::getline(ss, item, ',')) {
+        T value{};
+        auto result = std::from_chars(item.data(), item.data() + item.size(), value);
+        if (result.ec != std::errc() || value <= 0) return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+// Parses the benchmark options that follow --bench
+static bool parse_options(int argc, char* argv[], BenchOptions& options) {
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+
+        try {
+            if (arg == "--clients") {
+                if (!parse_list(value, options.client_counts)) return false;
+            }
+            else if (arg == "--sizes") {
+                if (!parse_list(value, options.sizes)) return false;
+            }
+            else if (arg == "--rate") {
+                options.rate = std::stod(value);
+            }
+            else if (arg == "--duration") {
+                options.duration = std::stod(value);
+            }
+            else if (arg == "--handshakes") {
+                options.handshakes = std::stoi(value);
+            }
+            else if (arg == "--mesh") {
+                options.mesh_nodes = std::stoi(value);
+            }
+            else if (arg == "--rooms") {
+                options.rooms = std::stoi(value);
+            }
+            else if (arg == "--port") {
+                options.port = std::stoi(value);
+            }
+            else if (arg == "--format") {
+                if (value != "text" && value != "binary") return false;
+                options.format = value == "text" ? WireFormat::text : WireFormat::binary;
+            }
+            else if (arg == "--compress") {
+                if (value != "on" && value != "off") return false;
+                options.compress = value == "on";
+            }
+            else if (arg == "--backpressure") {
+                if (value != "on" && value != "off") return false;
+                options.backpressure = value == "on";
+            }
+            else if (arg == "--ktls") {
+                if (value != "on" && value != "off") return false;
+                options.ktls = value == "on";
+            }
+            else if (arg == "--search") {
+                options.search_messages = std::stoull(value);
+            }
+            else if (arg == "--threads") {
+                if (!parse_list(value, options.thread_counts)) return false;
+            }
+            else if (arg == "--replay") {
+                options.replay_file = value;
+            }
+            else if (arg == "--speed") {
+                options.replay_speed = value == "max" ? 0.0 : std::stod(value);
+                if (options.replay_speed <= 0 && value != "max") return false;
+            }
+            else if (arg == "--output") {
+                options.output_file = value;
+            }
+            else {
+                return false;
+            }
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    return options.rate > 0 && options.duration > 0 && options.handshakes > 0 && options.mesh_nodes >= 0 && options.rooms >= 0;
+}
+
+// Writes an OpenSSL object to a PEM string through a memory BIO
+template <typename Writer>
+static string to_pem(Writer writer) {
+    BIO* bio = BIO_new(BIO_s_mem());
+    writer(bio);
+    char* data = nullptr;
+    long length = BIO_get_mem_data(bio, &data);
+    string pem(data, length);
+    BIO_free(bio);
+    return pem;
+}
+
+// Generates a throwaway self-signed P-256 certificate that both sides trust as their CA
+static SslCredentials generate_test_credentials() {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert = X509_new();
+    if (!key || !cert) {
+        throw std::runtime_error("Failed to generate benchmark certificate");
+    }
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("EchoChat benchmark"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    // Mark the certificate as a CA so it can verify itself
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, cert, cert, nullptr, nullptr, 0);
+    X509_EXTENSION* extension = X509V3_EXT_conf_nid(nullptr, &ctx, NID_basic_constraints, "critical,CA:TRUE");
+    X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+    X509_sign(cert, key, EVP_sha256());
+
+    SslCredentials credentials;
+    credentials.certificate_chain = to_pem([cert](BIO* bio) { PEM_write_bio_X509(bio, cert); });
+    credentials.private_key = to_pem([key](BIO* bio) { PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr); });
+    credentials.ca_certificate = credentials.certificate_chain;
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return credentials;
+}
+
+// Nanoseconds on the steady clock, embedded in each message to measure end-to-end latency
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Words used to pad message bodies, so compression sees something closer to chat than repeated bytes
+static const char* const PADDING_WORDS[] = {
+    "the", "connection", "error", "at", "line", "message", "server", "returned", "null", "value",
+    "please", "check", "logs", "timeout", "while", "reading", "config", "file", "retry", "failed",
+    "user", "session", "thread", "main", "std::string", "42", "0x7ffd", "INFO", "WARN", "ok",
+};
+
+// Builds a message body: "<sender> <send time ns> " padded to the requested size
+static string make_body(int sender, std::size_t size) {
+    string body = std::to_string(sender) + " " + std::to_string(now_ns()) + " ";
+    // Cheap pseudo-random word choice, different for every message
+    static thread_local uint32_t state = 12345;
+    const std::size_t word_count = sizeof(PADDING_WORDS) / sizeof(PADDING_WORDS[0]);
+    while (body.size() < size) {
+        state = state * 1664525u + 1013904223u;
+        body.append(PADDING_WORDS[(state >> 16) % word_count]).append(1, ' ');
+    }
+    body.resize(std::max(size, body.find(' ', body.find(' ') + 1) + 1));
+    return body;
+}
+
+// Reads the send time back out of a message body
+static bool parse_send_time(string_view body, int64_t& sent_ns) {
+    std::size_t first = body.find(' ');
+    if (first == string_view::npos) return false;
+    const char* begin = body.data() + first + 1;
+    auto result = std::from_chars(begin, body.data() + body.size(), sent_ns);
+    return result.ec == std::errc();
+}
+
+// Value at percentile p (0-1) of a sorted sample
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    std::size_t index = std::size_t(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, index > 0 ? index - 1 : 0)];
+}
+
+// Sends messages from every client at the configured rate using one timer tick per millisecond
+class LoadDriver {
+public:
+    LoadDriver(io_context& io, const vector<std::shared_ptr<Peer>>& clients, const BenchOptions& options, std::atomic<uint64_t>& sent)
+        : timer_(io), clients_(clients), options_(options), sent_(sent), sent_per_client_(clients.size(), 0) {}
+
+    // Starts sending and calls `done` on the IO thread once the duration has elapsed
+    void start(std::function<void()> done) {
+        done_ = std::move(done);
+        start_ = Clock::now();
+        tick();
+    }
+
+    // Sets the room each client sends to, clients without one send to the lobby
+    void set_rooms(vector<string> rooms) {
+        rooms_ = std::move(rooms);
+    }
+
+private:
+    void tick() {
+        double elapsed = std::chrono::duration<double>(Clock::now() - start_).count();
+        double until = std::min(elapsed, options_.duration);
+
+        // Token bucket per client: send whatever is due by now
+        for (std::size_t i = 0; i < clients_.size(); ++i) {
+            uint64_t due = uint64_t(until * options_.rate);
+            while (sent_per_client_[i] < due) {
+                std::size_t size = options_.sizes[next_size_++ % options_.sizes.size()];
+                clients_[i]->send_message(make_body(int(i), size), i < rooms_.size() ? string_view(rooms_[i]) : LOBBY);
+                ++sent_per_client_[i];
+                ++sent_;
+            }
+        }
+
+        if (elapsed >= options_.duration) {
+            done_();
+            return;
+        }
+        timer_.expires_after(std::chrono::milliseconds(1));
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec) tick();
+            });
+    }
+
+    steady_timer timer_;
+    const vector<std::shared_ptr<Peer>>& clients_;
+    const BenchOptions& options_;
+    std::atomic<uint64_t>& sent_;
+    vector<uint64_t> sent_per_client_;
+    vector<string> rooms_;
+    std::size_t next_size_ = 0;
+    Clock::time_point start_;
+    std::function<void()> done_;
+};
+
+// Connects `count` clients to the host on `port` and waits for their handshakes to finish. Clients are named
+// under `names`, client<i> where no name is given
+static vector<std::shared_ptr<Peer>> connect_clients(io_context& io, ssl::context& ssl_context, const BenchOptions& options,
+    int port, int count, SessionCache* session_cache, Peer::message_handler handler, const vector<string>& names = {}) {
+    // Handshakes completed so far, shared with the handlers since they outlive this call
+    struct Readiness {
+        std::mutex mutex;
+        std::condition_variable changed;
+        int connected = 0;
+    };
+    auto readiness = std::make_shared<Readiness>();
+
+    vector<std::shared_ptr<Peer>> clients;
+    for (int i = 0; i < count; ++i) {
+        string name = i < int(names.size()) ? names[i] : "client" + std::to_string(i);
+        auto client = std::make_shared<Peer>(io, ssl_context, name, Color::Blue);
+        client->set_preferred_format(options.format);
+        client->set_compression(options.compress);
+        client->set_ktls(options.use_ktls);
+        if (handler) {
+            client->set_message_handler(handler);
+        }
+        client->set_connect_handler([readiness](const std::shared_ptr<Peer>&) {
+            {
+                std::lock_guard<std::mutex> lock(readiness->mutex);
+                ++readiness->connected;
+            }
+            readiness->changed.notify_all();
+            });
+        // Every simulated client keeps its own session, as separate processes would
+        if (session_cache) {
+            client->set_session_cache(session_cache, "127.0.0.1:" + std::to_string(port) + "/" + std::to_string(i));
+        }
+        client->socket().lowest_layer().connect(tcp::endpoint(ip::make_address("127.0.0.1"), port));
+        client->start_handshake(ssl::stream_base::client);
+        clients.push_back(client);
+    }
+
+    std::unique_lock<std::mutex> lock(readiness->mutex);
+    readiness->changed.wait_for(lock, std::chrono::seconds(30), [&]() { return readiness->connected >= count; });
+    return clients;
+}
+
+// Shuts every client down on its IO thread
+static void close_clients(io_context& io, const vector<std::shared_ptr<Peer>>& clients) {
+    post(io, use_future([&clients]() {
+        for (const auto& client : clients) client->shutdown();
+        })).wait();
+}
+
+// Connects `count` clients, disconnects them and connects them again, the second round resuming the
+// sessions stored by the first, and reports both handshake times as JSON
+static string run_handshake_scenario(const BenchOptions& options, int count, const SslCredentials& credentials) {
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+    enable_session_resumption(host_ssl);
+    SessionCache session_cache;
+    session_cache.attach(client_ssl);
+
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.start();
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    vector<double> full_ms;
+    vector<double> resumed_ms;
+    int resumed = 0;
+    string tls_version;
+    for (int round = 0; round < 2; ++round) {
+        auto clients = connect_clients(client_io, client_ssl, options, options.port, count, &session_cache, nullptr);
+        for (const auto& client : clients) {
+            double ms = std::chrono::duration<double, std::milli>(client->handshake_time()).count();
+            (round == 0 ? full_ms : resumed_ms).push_back(ms);
+            if (round == 1 && client->session_resumed()) ++resumed;
+        }
+        if (!clients.empty()) {
+            tls_version = SSL_get_version(clients.front()->socket().native_handle());
+        }
+
+        // TLS 1.3 tickets arrive after the handshake, wait until every client has stored one
+        auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (round == 0 && session_cache.size() < std::size_t(count) && Clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        close_clients(client_io, clients);
+    }
+
+    host.shutdown();
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    std::sort(full_ms.begin(), full_ms.end());
+    std::sort(resumed_ms.begin(), resumed_ms.end());
+    std::ostringstream json;
+    json << "{\"scenario\":\"handshake\""
+        << ",\"connections\":" << count
+        << ",\"tls_version\":\"" << tls_version << "\""
+        << ",\"full_ms\":{\"p50\":" << percentile(full_ms, 0.50) << ",\"p99\":" << percentile(full_ms, 0.99) << "}"
+        << ",\"resumed_ms\":{\"p50\":" << percentile(resumed_ms, 0.50) << ",\"p99\":" << percentile(resumed_ms, 0.99) << "}"
+        << ",\"resumed\":" << resumed
+        << "}";
+    return json.str();
+}
+
+// Runs one host and `client_count` clients and measures broadcast throughput and latency
+static BenchResult run_scenario(const BenchOptions& options, int client_count, const SslCredentials& credentials) {
+    BenchResult result;
+    result.clients = client_count;
+
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.start();
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    // Counters updated on the client IO thread, the latency sample is only read after it stops
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    std::atomic<uint64_t> bytes_delivered(0);
+    vector<double> latency_us;
+
+    // Connect every client and wait for all handshakes
+    vector<std::shared_ptr<Peer>> clients = connect_clients(client_io, client_ssl, options, options.port, client_count, nullptr,
+        [&](const std::shared_ptr<Peer>&, const MessageView& message) {
+            int64_t sent_ns = 0;
+            if (parse_send_time(message.body, sent_ns)) {
+                latency_us.push_back((now_ns() - sent_ns) / 1000.0);
+            }
+            bytes_delivered += message.body.size();
+            ++delivered;
+            return true;
+        });
+    for (const auto& client : clients) {
+        result.handshake_ms.push_back(std::chrono::duration<double, std::milli>(client->handshake_time()).count());
+    }
+    // Give the wire format negotiation a moment to finish
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // Compression counters are process-wide, the scenario reports the change
+    Metrics& metrics = Metrics::global();
+    uint64_t compressed_before = metrics.compressed_messages;
+    uint64_t compress_in_before = metrics.compress_bytes_in;
+    uint64_t compress_out_before = metrics.compress_bytes_out;
+    uint64_t compress_ns_before = metrics.compress_ns;
+    uint64_t decompress_ns_before = metrics.decompress_ns;
+
+    // The host relays every message on its IO thread. Its heap allocations are counted over the second
+    // half of the load, once pools, queues and buffers have grown to their working size.
+    auto host_allocations = [&host_io]() { return post(host_io, use_future([]() { return thread_allocation_count(); })).get(); };
+
+    // Drive the load from the client IO thread
+    std::promise<void> load_done;
+    LoadDriver driver(client_io, clients, options, sent);
+    auto start = Clock::now();
+    post(client_io, [&]() { driver.start([&]() { load_done.set_value(); }); });
+    auto load_finished = load_done.get_future();
+    load_finished.wait_for(std::chrono::duration<double>(options.duration / 2));
+    uint64_t host_allocations_before = host_allocations();
+    uint64_t sent_before = sent;
+    load_finished.wait();
+
+    // Every message is relayed to every other client, wait for them to drain
+    result.sent = sent;
+    result.expected = result.sent * uint64_t(client_count > 0 ? client_count - 1 : 0);
+    auto drain_deadline = Clock::now() + std::chrono::seconds(10);
+    while (delivered < result.expected && Clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    result.elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    result.host_allocations = host_allocations() - host_allocations_before;
+    result.allocation_window_messages = result.sent - sent_before;
+    result.compressed_messages = metrics.compressed_messages - compressed_before;
+    result.compress_bytes_in = metrics.compress_bytes_in - compress_in_before;
+    result.compress_bytes_out = metrics.compress_bytes_out - compress_out_before;
+    result.compress_ns = metrics.compress_ns - compress_ns_before;
+    result.decompress_ns = metrics.decompress_ns - decompress_ns_before;
+
+    // Tear down, the clients on their IO thread
+    host.shutdown();
+    close_clients(client_io, clients);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    result.delivered = delivered;
+    result.bytes_delivered = bytes_delivered;
+    result.latency_us = std::move(latency_us);
+    return result;
+}
+
+// Formats a scenario result as a JSON object
+static string to_json(const BenchOptions& options, BenchResult& result) {
+    std::sort(result.handshake_ms.begin(), result.handshake_ms.end());
+    std::sort(result.latency_us.begin(), result.latency_us.end());
+
+    std::ostringstream json;
+    json << "{\"scenario\":\"broadcast\""
+        << ",\"clients\":" << result.clients
+        << ",\"format\":\"" << (options.format == WireFormat::binary ? "binary" : "text") << "\""
+        << ",\"compress\":" << (options.compress ? "true" : "false")
+        << ",\"rate_per_client\":" << options.rate
+        << ",\"duration_s\":" << options.duration
+        << ",\"sent\":" << result.sent
+        << ",\"delivered\":" << result.delivered
+        << ",\"expected\":" << result.expected
+        << ",\"elapsed_s\":" << result.elapsed
+        << ",\"messages_per_sec\":" << (result.elapsed > 0 ? result.delivered / result.elapsed : 0.0)
+        << ",\"bytes_per_sec\":" << (result.elapsed > 0 ? result.bytes_delivered / result.elapsed : 0.0)
+        << ",\"handshake_ms\":{\"p50\":" << percentile(result.handshake_ms, 0.50)
+        << ",\"p99\":" << percentile(result.handshake_ms, 0.99)
+        << ",\"max\":" << (result.handshake_ms.empty() ? 0.0 : result.handshake_ms.back()) << "}"
+        << ",\"latency_us\":{\"p50\":" << percentile(result.latency_us, 0.50)
+        << ",\"p99\":" << percentile(result.latency_us, 0.99)
+        << ",\"p999\":" << percentile(result.latency_us, 0.999)
+        << ",\"max\":" << (result.latency_us.empty() ? 0.0 : result.latency_us.back()) << "}"
+        << ",\"compression\":{\"messages\":" << result.compressed_messages
+        << ",\"ratio\":" << (result.compress_bytes_out > 0 ? double(result.compress_bytes_in) / double(result.compress_bytes_out) : 1.0)
+        << ",\"compress_us_per_message\":" << (result.compressed_messages > 0 ? result.compress_ns / 1000.0 / result.compressed_messages : 0.0)
+        << ",\"decompress_us_total\":" << result.decompress_ns / 1000.0
+        << ",\"cpu_ms\":" << (result.compress_ns + result.decompress_ns) / 1e6 << "}"
+        << ",\"host_allocations\":";
+    // Without the counting allocator there is nothing to report
+    if (ALLOCATIONS_COUNTED) {
+        json << result.host_allocations << ",\"host_allocations_per_message\":" << (result.allocation_window_messages > 0
+            ? double(result.host_allocations) / result.allocation_window_messages : 0.0);
+    } else {
+        json << "null,\"host_allocations_per_message\":null";
+    }
+    json << "}";
+    return json.str();
+}
+
+// Builds `nodes` mesh nodes on consecutive ports, each linked to the next two around a ring so every
+// message can arrive over more than one link, and attaches one client to each node. Every client sends
+// at the configured rate and the scenario reports delivery, duplicate suppression and fan-out latency.
+static string run_mesh_scenario(const BenchOptions& options, int nodes, const SslCredentials& credentials) {
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    vector<std::unique_ptr<Host>> hosts;
+    for (int i = 0; i < nodes; ++i) {
+        hosts.push_back(std::make_unique<Host>(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port + i),
+            "node" + std::to_string(i), Color::White));
+        hosts.back()->start();
+    }
+
+    // Ring plus chords, each unordered pair linked once
+    std::set<std::pair<int, int>> links;
+    for (int i = 0; i < nodes; ++i) {
+        for (int step = 1; step <= 2; ++step) {
+            int j = (i + step) % nodes;
+            if (i != j) links.insert({ std::min(i, j), std::max(i, j) });
+        }
+    }
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    // Wait for every link to finish both handshakes
+    uint64_t opened_before = Metrics::global().sessions_opened;
+    for (const auto& link : links) {
+        hosts[link.first]->connect_to(tcp::endpoint(ip::make_address("127.0.0.1"), options.port + link.second));
+    }
+    auto deadline = Clock::now() + std::chrono::seconds(30);
+    while (Metrics::global().sessions_opened - opened_before < 2 * links.size() && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // Every node should see each message once, delivered and fan-out times are measured at the clients.
+    // Only touched on the client IO thread and read after it stops.
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    uint64_t client_duplicates = 0;
+    vector<double> latency_us;
+    vector<double> fanout_us;
+    std::unordered_map<string, std::pair<int, double>> pending;  // Message key -> receivers so far, slowest latency
+    std::set<std::pair<const Peer*, string>> received;
+    Peer::message_handler handler = [&](const std::shared_ptr<Peer>& client, const MessageView& message) {
+        int64_t sent_ns = 0;
+        if (!parse_send_time(message.body, sent_ns)) return true;
+        string key(message.body.substr(0, message.body.find(' ', message.body.find(' ') + 1)));
+        if (!received.insert({ client.get(), key }).second) {
+            ++client_duplicates;
+            return true;
+        }
+        double us = (now_ns() - sent_ns) / 1000.0;
+        latency_us.push_back(us);
+        ++delivered;
+        auto& entry = pending[key];
+        entry.second = std::max(entry.second, us);
+        if (++entry.first == nodes - 1) {
+            fanout_us.push_back(entry.second);
+            pending.erase(key);
+        }
+        return true;
+        };
+
+    vector<std::shared_ptr<Peer>> clients;
+    for (int i = 0; i < nodes; ++i) {
+        auto client = connect_clients(client_io, client_ssl, options, options.port + i, 1, nullptr, handler);
+        clients.insert(clients.end(), client.begin(), client.end());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    uint64_t relayed_before = Metrics::global().mesh_messages;
+    uint64_t duplicates_before = Metrics::global().mesh_duplicates;
+    std::promise<void> load_done;
+    LoadDriver driver(client_io, clients, options, sent);
+    auto start = Clock::now();
+    post(client_io, [&]() { driver.start([&]() { load_done.set_value(); }); });
+    load_done.get_future().wait();
+
+    uint64_t expected = sent * uint64_t(nodes - 1);
+    deadline = Clock::now() + std::chrono::seconds(10);
+    while (delivered < expected && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t relayed = Metrics::global().mesh_messages - relayed_before;
+    uint64_t duplicates = Metrics::global().mesh_duplicates - duplicates_before;
+
+    for (auto& host : hosts) host->shutdown();
+    close_clients(client_io, clients);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    std::sort(latency_us.begin(), latency_us.end());
+    std::sort(fanout_us.begin(), fanout_us.end());
+    std::ostringstream json;
+    json << "{\"scenario\":\"mesh\""
+        << ",\"nodes\":" << nodes
+        << ",\"links\":" << links.size()
+        << ",\"sent\":" << sent
+        << ",\"delivered\":" << delivered
+        << ",\"expected\":" << expected
+        << ",\"client_duplicates\":" << client_duplicates
+        << ",\"elapsed_s\":" << elapsed
+        << ",\"relayed\":" << relayed
+        << ",\"duplicates_suppressed\":" << duplicates
+        << ",\"suppression_rate\":" << (relayed + duplicates > 0 ? double(duplicates) / double(relayed + duplicates) : 0.0)
+        << ",\"latency_us\":{\"p50\":" << percentile(latency_us, 0.50) << ",\"p99\":" << percentile(latency_us, 0.99) << "}"
+        << ",\"fanout_us\":{\"p50\":" << percentile(fanout_us, 0.50)
+        << ",\"p99\":" << percentile(fanout_us, 0.99)
+        << ",\"max\":" << (fanout_us.empty() ? 0.0 : fanout_us.back()) << "}"
+        << "}";
+    return json.str();
+}
+
+// Clients in the throughput scenario and the messages each keeps in flight
+const int THROUGHPUT_CLIENTS = 16;
+const int THROUGHPUT_WINDOW = 32;
+
+// Runs a host and THROUGHPUT_CLIENTS clients, each side on a pool of `threads` IO threads, and measures
+// how many messages the host can relay as a closed loop: every client keeps THROUGHPUT_WINDOW messages
+// in flight, and sends the next one when its neighbour, client (i + 1) % N, has received one of them.
+// The load therefore follows what the host sustains rather than a fixed rate, and extra threads only
+// help if the sessions spread over them really run in parallel.
+static string run_throughput_scenario(const BenchOptions& options, int threads, const SslCredentials& credentials) {
+    IoContextPool host_pool(threads);
+    IoContextPool client_pool(threads);
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    Host host(host_pool.primary(), host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.set_io_pool(&host_pool);
+    host.start();
+    host_pool.start();
+    client_pool.start();
+
+    // Each client's handler runs on that client's IO thread, so each latency sample has a single writer
+    std::atomic<bool> running(false);
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    vector<vector<double>> latency_us(THROUGHPUT_CLIENTS);
+    std::unordered_map<const Peer*, int> index;
+    vector<std::shared_ptr<Peer>> clients;
+    std::size_t size = options.sizes.front();
+    auto send_next = [&](int sender) {
+        clients[sender]->send_message(make_body(sender, size));
+        ++sent;
+    };
+
+    Peer::message_handler handler = [&](const std::shared_ptr<Peer>& client, const MessageView& message) {
+        int64_t sent_ns = 0;
+        int sender = 0;
+        auto result = std::from_chars(message.body.data(), message.body.data() + message.body.size(), sender);
+        if (result.ec != std::errc() || !parse_send_time(message.body, sent_ns) || !running) {
+            return true;
+        }
+        int receiver = index.at(client.get());
+        latency_us[receiver].push_back((now_ns() - sent_ns) / 1000.0);
+        ++delivered;
+        // The neighbour paces the sender, one message out for each one it sees
+        if (receiver == (sender + 1) % THROUGHPUT_CLIENTS) {
+            send_next(sender);
+        }
+        return true;
+        };
+    // Spread the clients over the client threads like the host spreads its sessions
+    for (int i = 0; i < THROUGHPUT_CLIENTS; ++i) {
+        auto client = connect_clients(client_pool.next(), client_ssl, options, options.port, 1, nullptr, handler);
+        index[client.front().get()] = i;
+        clients.insert(clients.end(), client.begin(), client.end());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    uint64_t relayed_before = Metrics::global().mesh_messages;
+    running = true;
+    auto start = Clock::now();
+    for (int i = 0; i < int(clients.size()); ++i) {
+        for (int j = 0; j < THROUGHPUT_WINDOW; ++j) {
+            send_next(i);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    running = false;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t delivered_total = delivered;
+    uint64_t relayed = Metrics::global().mesh_messages - relayed_before;
+
+    host.shutdown();
+    for (const auto& client : clients) {
+        post(client->get_executor(), use_future([client]() { client->shutdown(); })).wait();
+    }
+    host_pool.stop();
+    client_pool.stop();
+
+    vector<double> latency;
+    for (const auto& sample : latency_us) {
+        latency.insert(latency.end(), sample.begin(), sample.end());
+    }
+    std::sort(latency.begin(), latency.end());
+    std::ostringstream json;
+    json << "{\"scenario\":\"throughput\""
+        << ",\"threads\":" << threads
+        << ",\"cores\":" << std::thread::hardware_concurrency()
+        << ",\"clients\":" << THROUGHPUT_CLIENTS
+        << ",\"window\":" << THROUGHPUT_WINDOW
+        << ",\"size\":" << size
+        << ",\"elapsed_s\":" << elapsed
+        << ",\"sent\":" << sent
+        << ",\"delivered\":" << delivered_total
+        << ",\"relayed\":" << relayed
+        << ",\"messages_per_sec\":" << (elapsed > 0 ? delivered_total / elapsed : 0.0)
+        << ",\"relayed_per_sec\":" << (elapsed > 0 ? relayed / elapsed : 0.0)
+        << ",\"latency_us\":{\"p50\":" << percentile(latency, 0.50) << ",\"p99\":" << percentile(latency, 0.99) << "}"
+        << "}";
+    return json.str();
+}
+
+// Clients in the rooms scenario
+const int ROOM_CLIENTS = 32;
+
+// Attaches ROOM_CLIENTS clients to one host and spreads them over `rooms` rooms, client i joining room
+// i % rooms. Every client sends to its room at the configured rate, so each message should reach only
+// the other members of that room: the host's work per message follows the room's size rather than the
+// number of connections. Reports delivery, copies seen outside their room and latency.
+static string run_rooms_scenario(const BenchOptions& options, int rooms, const SslCredentials& credentials) {
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.start();
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    // Only touched on the client IO thread and read after it stops
+    vector<string> room_of(ROOM_CLIENTS);
+    vector<int> members(rooms, 0);
+    for (int i = 0; i < ROOM_CLIENTS; ++i) {
+        room_of[i] = "room" + std::to_string(i % rooms);
+        ++members[i % rooms];
+    }
+    std::unordered_map<const Peer*, int> index;
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    uint64_t outside_room = 0;
+    vector<double> latency_us;
+    vector<std::shared_ptr<Peer>> clients = connect_clients(client_io, client_ssl, options, options.port, ROOM_CLIENTS, nullptr,
+        [&](const std::shared_ptr<Peer>& client, const MessageView& message) {
+            int64_t sent_ns = 0;
+            if (!parse_send_time(message.body, sent_ns)) return true;
+            if (message.room != room_of[index.at(client.get())]) {
+                ++outside_room;
+            }
+            latency_us.push_back((now_ns() - sent_ns) / 1000.0);
+            ++delivered;
+            return true;
+        });
+    for (int i = 0; i < ROOM_CLIENTS; ++i) {
+        index[clients[i].get()] = i;
+        clients[i]->join_room(room_of[i]);
+    }
+    // Give the format negotiation and the joins a moment to reach the host
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::promise<void> load_done;
+    LoadDriver driver(client_io, clients, options, sent);
+    driver.set_rooms(room_of);
+    auto start = Clock::now();
+    post(client_io, [&]() { driver.start([&]() { load_done.set_value(); }); });
+    load_done.get_future().wait();
+
+    // Every client sends the same number of messages, each reaching the rest of its room
+    uint64_t per_client = sent / ROOM_CLIENTS;
+    uint64_t expected = 0;
+    for (int i = 0; i < ROOM_CLIENTS; ++i) {
+        expected += per_client * uint64_t(members[i % rooms] - 1);
+    }
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (delivered < expected && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    host.shutdown();
+    close_clients(client_io, clients);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    std::sort(latency_us.begin(), latency_us.end());
+    std::ostringstream json;
+    json << "{\"scenario\":\"rooms\""
+        << ",\"rooms\":" << rooms
+        << ",\"clients\":" << ROOM_CLIENTS
+        << ",\"sent\":" << sent
+        << ",\"delivered\":" << delivered
+        << ",\"expected\":" << expected
+        << ",\"outside_room\":" << outside_room
+        << ",\"deliveries_per_message\":" << (sent > 0 ? double(delivered) / double(sent) : 0.0)
+        << ",\"elapsed_s\":" << elapsed
+        << ",\"messages_per_sec\":" << (elapsed > 0 ? sent / elapsed : 0.0)
+        << ",\"latency_us\":{\"p50\":" << percentile(latency_us, 0.50) << ",\"p99\":" << percentile(latency_us, 0.99) << "}"
+        << "}";
+    return json.str();
+}
+
+// Size of each message in the bulk transfer scenario, several full TLS records
+const std::size_t KTLS_MESSAGE_SIZE = 64 * 1024;
+// Messages the sender keeps in flight there
+const int KTLS_WINDOW = 8;
+
+// User and system CPU time used by the whole process so far, in seconds
+static double process_cpu_seconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        return 0.0;
+    }
+    auto seconds = [](const FILETIME& time) {
+        return double((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+// Streams KTLS_MESSAGE_SIZE messages from one client through the host to another, KTLS_WINDOW at a
+// time, with every connection trying kernel TLS (`ktls`) or staying in OpenSSL. Sender, host and
+// receiver share the process, so its CPU time covers every encryption and decryption on the path.
+// Run once each way, the two results give the CPU cost per GB with and without the kernel's help.
+static string run_ktls_scenario(const BenchOptions& options, bool ktls, const SslCredentials& credentials) {
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+    if (ktls) {
+        enable_ktls(host_ssl);
+        enable_ktls(client_ssl);
+    }
+    // Compression would hide the cost of the records behind the cost of deflate
+    BenchOptions run_options = options;
+    run_options.compress = false;
+    run_options.use_ktls = ktls;
+    uint64_t ktls_send_before = Metrics::global().totals.ktls_send;
+    uint64_t ktls_receive_before = Metrics::global().totals.ktls_receive;
+    uint64_t fallbacks_before = Metrics::global().totals.ktls_fallbacks;
+
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.set_ktls(ktls);
+    host.start();
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    // Both clients run on the client IO thread, the receiver paces the sender one message per delivery
+    std::atomic<bool> running(false);
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    std::atomic<uint64_t> bytes(0);
+    string body = make_body(0, KTLS_MESSAGE_SIZE);
+    vector<std::shared_ptr<Peer>> clients = connect_clients(client_io, client_ssl, run_options, options.port, 2, nullptr,
+        [&](const std::shared_ptr<Peer>& client, const MessageView& message) {
+            if (!running || client == clients.front()) return true;
+            ++delivered;
+            bytes += message.body.size();
+            clients.front()->send_message(body);
+            ++sent;
+            return true;
+        });
+    // Give the format negotiation and the receive handover a moment to finish
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    double cpu_before = process_cpu_seconds();
+    auto start = Clock::now();
+    running = true;
+    post(client_io, [&]() {
+        for (int i = 0; i < KTLS_WINDOW; ++i) {
+            clients.front()->send_message(body);
+            ++sent;
+        }
+        });
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    running = false;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    double cpu = process_cpu_seconds() - cpu_before;
+    uint64_t bytes_total = bytes;
+
+    host.shutdown();
+    close_clients(client_io, clients);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    double gb = double(bytes_total) / 1e9;
+    std::ostringstream json;
+    json << "{\"scenario\":\"ktls\""
+        << ",\"mode\":\"" << (ktls ? "on" : "off") << "\""
+        << ",\"compiled\":" << (ktls_compiled() ? "true" : "false")
+        << ",\"ktls_send\":" << Metrics::global().totals.ktls_send - ktls_send_before
+        << ",\"ktls_receive\":" << Metrics::global().totals.ktls_receive - ktls_receive_before
+        << ",\"fallbacks\":" << Metrics::global().totals.ktls_fallbacks - fallbacks_before
+        << ",\"size\":" << KTLS_MESSAGE_SIZE
+        << ",\"sent\":" << sent
+        << ",\"delivered\":" << delivered
+        << ",\"bytes\":" << bytes_total
+        << ",\"elapsed_s\":" << elapsed
+        << ",\"gb_per_s\":" << (elapsed > 0 ? gb / elapsed : 0.0)
+        << ",\"cpu_s\":" << cpu
+        << ",\"cpu_s_per_gb\":" << (gb > 0 ? cpu / gb : 0.0)
+        << "}";
+    return json.str();
+}
+
+// Host-side watermarks used by the stalled reader scenario, small so they are reached quickly
+const std::size_t BACKPRESSURE_HIGH_WATERMARK = 256 * 1024;
+const std::size_t BACKPRESSURE_LOW_WATERMARK = 64 * 1024;
+// Load sent over the scenario's duration whatever its length, many times what a stalled reader's
+// socket buffers hold. Compression is off so the bytes reach the host's queue as sent.
+const int BACKPRESSURE_SENDERS = 3;
+const std::size_t BACKPRESSURE_FLOOD_BYTES = 32 * 1024 * 1024;
+const std::size_t BACKPRESSURE_MESSAGE_SIZE = 4096;
+
+// Attaches BACKPRESSURE_SENDERS clients and one client that never reads to a host using `policy`,
+// floods the host and samples how many bytes it has queued. `bounded` false lifts the watermarks to
+// show the growth the policies prevent.
+static string run_backpressure_scenario(const BenchOptions& options, const string& label, SlowConsumerPolicy policy, bool bounded,
+    const SslCredentials& credentials) {
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    BackpressureLimits limits;
+    limits.high_watermark = bounded ? BACKPRESSURE_HIGH_WATERMARK : std::numeric_limits<std::size_t>::max();
+    limits.low_watermark = BACKPRESSURE_LOW_WATERMARK;
+    limits.policy = policy;
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.set_backpressure(limits);
+    host.start();
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    BenchOptions load = options;
+    load.compress = false;
+    load.sizes = { BACKPRESSURE_MESSAGE_SIZE };
+    load.rate = double(BACKPRESSURE_FLOOD_BYTES) / double(BACKPRESSURE_SENDERS * BACKPRESSURE_MESSAGE_SIZE) / options.duration;
+
+    std::atomic<uint64_t> sent(0);
+    std::atomic<uint64_t> delivered(0);
+    vector<std::shared_ptr<Peer>> senders = connect_clients(client_io, client_ssl, load, options.port, BACKPRESSURE_SENDERS, nullptr,
+        [&delivered](const std::shared_ptr<Peer>&, const MessageView&) {
+            ++delivered;
+            return true;
+        });
+    vector<std::shared_ptr<Peer>> stalled = connect_clients(client_io, client_ssl, load, options.port, 1, nullptr, nullptr);
+    post(client_io, use_future([&stalled]() {
+        for (const auto& client : stalled) client->pause_reading();
+        })).wait();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // The host's sessions report their own counters, the clients' traffic never mixes in
+    Metrics& metrics = Metrics::global();
+    auto host_side = [&host](std::atomic<uint64_t> PeerStats::* counter) {
+        return host.session_total(counter);
+    };
+    uint64_t crossings_before = host_side(&PeerStats::watermark_crossings);
+    uint64_t dropped_before = host_side(&PeerStats::dropped_messages);
+    uint64_t disconnects_before = host_side(&PeerStats::slow_disconnects);
+    uint64_t pauses_before = metrics.input_pauses;
+
+    std::promise<void> load_done;
+    LoadDriver driver(client_io, senders, load, sent);
+    post(client_io, [&]() { driver.start([&]() { load_done.set_value(); }); });
+    auto load_finished = load_done.get_future();
+    uint64_t peak = 0;
+    while (load_finished.wait_for(std::chrono::milliseconds(1)) != std::future_status::ready) {
+        peak = std::max(peak, host_side(&PeerStats::queue_bytes));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    uint64_t remaining = host_side(&PeerStats::queue_bytes);
+    uint64_t crossings = host_side(&PeerStats::watermark_crossings) - crossings_before;
+    uint64_t dropped = host_side(&PeerStats::dropped_messages) - dropped_before;
+    uint64_t disconnects = host_side(&PeerStats::slow_disconnects) - disconnects_before;
+    uint64_t pauses = metrics.input_pauses - pauses_before;
+
+    host.shutdown();
+    close_clients(client_io, senders);
+    close_clients(client_io, stalled);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    std::ostringstream json;
+    json << "{\"scenario\":\"backpressure\""
+        << ",\"policy\":\"" << label << "\""
+        << ",\"high_watermark\":" << (bounded ? BACKPRESSURE_HIGH_WATERMARK : 0)
+        << ",\"low_watermark\":" << (bounded ? BACKPRESSURE_LOW_WATERMARK : 0)
+        << ",\"sent\":" << sent
+        << ",\"delivered_to_readers\":" << delivered
+        << ",\"host_queue_bytes_peak\":" << peak
+        << ",\"host_queue_bytes_end\":" << remaining
+        << ",\"watermark_crossings\":" << crossings
+        << ",\"dropped_messages\":" << dropped
+        << ",\"slow_disconnects\":" << disconnects
+        << ",\"input_pauses\":" << pauses
+        << "}";
+    return json.str();
+}
+
+// Size of the messages logged in the search scenario, and the gap between their timestamps
+const std::size_t SEARCH_MESSAGE_SIZE = 64;
+const int64_t SEARCH_MESSAGE_GAP_MS = 100;
+// Ticket numbers mentioned in the messages, the long tail of rare words a real chat has
+const uint32_t SEARCH_TICKETS = 50000;
+// Times each query is run, and hits asked for as /search does
+const int SEARCH_REPEATS = 20;
+const std::size_t SEARCH_HITS = 20;
+
+// Logs `messages` messages with timestamps SEARCH_MESSAGE_GAP_MS apart from `start_ms`, returns the seconds taken
+static double fill_search_log(MessageLog& log, uint64_t messages, int64_t start_ms) {
+    static const char* const senders[] = { "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi" };
+    const std::size_t word_count = sizeof(PADDING_WORDS) / sizeof(PADDING_WORDS[0]);
+    uint32_t state = 12345;
+    string body;
+    auto start = Clock::now();
+    for (uint64_t i = 0; i < messages; ++i) {
+        state = state * 1664525u + 1013904223u;
+        body = "#" + std::to_string((state >> 8) % SEARCH_TICKETS);
+        while (body.size() < SEARCH_MESSAGE_SIZE) {
+            state = state * 1664525u + 1013904223u;
+            body.append(1, ' ').append(PADDING_WORDS[(state >> 16) % word_count]);
+        }
+        log.append(start_ms + int64_t(i) * SEARCH_MESSAGE_GAP_MS, 1, senders[i % (sizeof(senders) / sizeof(senders[0]))], body);
+    }
+    log.flush();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Logs the same synthetic chat with and without the full-text index to show what indexing adds to an
+// append, then times queries over the index: common, rare and mixed words, with and without a time
+// range, and finally how long saving and loading the index take and how large its file is.
+static string run_search_scenario(const BenchOptions& options) {
+    std::filesystem::path root = std::filesystem::temp_directory_path() / ("echochat-bench-search-" + std::to_string(options.port));
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+    int64_t start_ms = MessageLog::now_ms() - int64_t(options.search_messages) * SEARCH_MESSAGE_GAP_MS;
+
+    double plain_seconds = 0.0;
+    {
+        MessageLog plain((root / "plain").string());
+        if (!plain.open()) {
+            throw std::runtime_error("could not open a message log in " + root.string());
+        }
+        plain_seconds = fill_search_log(plain, options.search_messages, start_ms);
+    }
+
+    auto log = std::make_unique<MessageLog>((root / "indexed").string());
+    log->enable_search();
+    if (!log->open()) {
+        throw std::runtime_error("could not open a message log in " + root.string());
+    }
+    double indexed_seconds = fill_search_log(*log, options.search_messages, start_ms);
+
+    // The last tenth of the chat, as /search since:<minutes> asks for
+    int64_t recent_ms = start_ms + int64_t(options.search_messages) * SEARCH_MESSAGE_GAP_MS * 9 / 10;
+    struct Query {
+        const char* name;
+        const char* words;
+        int64_t since_ms;
+    };
+    const Query queries[] = {
+        { "common", "timeout", 0 },
+        { "two_common", "connection error", 0 },
+        { "rare", "4242", 0 },
+        { "rare_and_common", "4242 timeout", 0 },
+        { "sender", "alice failed", 0 },
+        { "common_recent", "timeout", recent_ms },
+        { "missing", "nonexistent", 0 },
+    };
+
+    std::ostringstream json;
+    json << "{\"scenario\":\"search\""
+        << ",\"messages\":" << options.search_messages
+        << ",\"message_size\":" << SEARCH_MESSAGE_SIZE
+        << ",\"append_per_sec_plain\":" << (plain_seconds > 0 ? options.search_messages / plain_seconds : 0.0)
+        << ",\"append_per_sec_indexed\":" << (indexed_seconds > 0 ? options.search_messages / indexed_seconds : 0.0)
+        << ",\"index_us_per_message\":" << (options.search_messages > 0 ? (indexed_seconds - plain_seconds) * 1e6 / options.search_messages : 0.0)
+        << ",\"queries\":[";
+    for (std::size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+        vector<double> latency_us;
+        uint64_t matches = 0;
+        std::size_t hits = 0;
+        for (int i = 0; i < SEARCH_REPEATS; ++i) {
+            hits = 0;
+            auto start = Clock::now();
+            matches = log->search(queries[q].words, queries[q].since_ms, 0, SEARCH_HITS, [&hits](const LogRecord&) { ++hits; });
+            latency_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        std::sort(latency_us.begin(), latency_us.end());
+        json << (q > 0 ? "," : "") << "{\"query\":\"" << queries[q].name << "\""
+            << ",\"words\":\"" << queries[q].words << "\""
+            << ",\"time_range\":" << (queries[q].since_ms > 0 ? "true" : "false")
+            << ",\"matches\":" << matches
+            << ",\"hits\":" << hits
+            << ",\"latency_us\":{\"p50\":" << percentile(latency_us, 0.50) << ",\"max\":" << latency_us.back() << "}}";
+    }
+
+    // Closing saves the index, opening again loads it instead of indexing the log anew. Both times
+    // include the log's own work, which the plain log shows is small next to the index.
+    auto save_start = Clock::now();
+    log.reset();
+    double close_ms = std::chrono::duration<double, std::milli>(Clock::now() - save_start).count();
+    uint64_t index_bytes = std::filesystem::file_size(root / "indexed" / MessageLog::SEARCH_FILE, ec);
+    if (ec) index_bytes = 0;
+    auto open_start = Clock::now();
+    {
+        MessageLog reopened((root / "indexed").string());
+        reopened.enable_search();
+        reopened.open();
+    }
+    double open_ms = std::chrono::duration<double, std::milli>(Clock::now() - open_start).count();
+    std::filesystem::remove_all(root, ec);
+
+    json << "]"
+        << ",\"index_bytes\":" << index_bytes
+        << ",\"index_bytes_per_message\":" << (options.search_messages > 0 ? double(index_bytes) / options.search_messages : 0.0)
+        << ",\"close_ms\":" << close_ms
+        << ",\"open_ms\":" << open_ms
+        << "}";
+    return json.str();
+}
+
+// A captured message to send again: the client that sends it and when, relative to the first message
+struct ReplayEvent {
+    uint64_t time_ns = 0;
+    int sender = 0;
+    string body;
+};
+
+// Messages sent per step at max speed before other handlers get a turn
+const std::size_t REPLAY_BATCH = 256;
+
+// Sends captured messages from the clients standing in for their senders. With a speed the captured gaps
+// are kept, divided by the speed, and checked once per millisecond. At max speed messages go out back to
+// back, waiting only while a client is over its high watermark so the clients' queues stay bounded.
+class ReplayDriver {
+public:
+    ReplayDriver(io_context& io, const vector<std::shared_ptr<Peer>>& clients, const vector<ReplayEvent>& events, double speed,
+        vector<vector<int64_t>>& send_times)
+        : io_(io), timer_(io), clients_(clients), events_(events), speed_(speed), send_times_(send_times) {}
+
+    // Starts sending and calls `done` on the IO thread once every message has been sent
+    void start(std::function<void()> done) {
+        done_ = std::move(done);
+        start_ = Clock::now();
+        tick();
+    }
+
+    // Tracks the clients above their high watermark, IO thread only
+    void set_congested(bool congested) {
+        congested_ += congested ? 1 : -1;
+    }
+
+private:
+    void tick() {
+        double elapsed_ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count());
+        std::size_t batch = 0;
+        while (next_ < events_.size()) {
+            const ReplayEvent& event = events_[next_];
+            if (speed_ > 0 ? event.time_ns / speed_ > elapsed_ns : (congested_ > 0 || batch == REPLAY_BATCH)) {
+                break;
+            }
+            // The send time is taken first, the receivers match it by its position in the sender's stream
+            send_times_[event.sender].push_back(now_ns());
+            clients_[event.sender]->send_message(event.body);
+            ++next_;
+            ++batch;
+        }
+
+        if (next_ == events_.size()) {
+            done_();
+            return;
+        }
+        if (speed_ == 0 && congested_ == 0) {
+            post(io_, [this]() { tick(); });
+            return;
+        }
+        timer_.expires_after(std::chrono::milliseconds(1));
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec) tick();
+            });
+    }
+
+    io_context& io_;
+    steady_timer timer_;
+    const vector<std::shared_ptr<Peer>>& clients_;
+    const vector<ReplayEvent>& events_;
+    double speed_;
+    vector<vector<int64_t>>& send_times_;
+    std::size_t next_ = 0;
+    int congested_ = 0;
+    Clock::time_point start_;
+    std::function<void()> done_;
+};
+
+// Replays the chat messages a captured peer received through a fresh host: each captured sender, a
+// connection and name, becomes a client that sends its messages again, and one more client only
+// listens. Every message is therefore delivered to all clients but its sender, and the scenario reports
+// how fast the host relays the recorded traffic and with what latency. A capture from a host replays
+// its clients, one from a client replays the other members of the chat as the host relayed them.
+static string run_replay_scenario(const BenchOptions& options, const SslCredentials& credentials) {
+    vector<CaptureRecord> records;
+    string error;
+    if (!read_capture(options.replay_file, records, error) && records.empty()) {
+        throw std::runtime_error(error);
+    }
+
+    // One client per sender, names made unique as the receivers tell senders apart by name
+    vector<ReplayEvent> events;
+    vector<string> names;
+    std::map<std::pair<uint64_t, string>, int> sender_of;
+    std::map<string, int, std::less<>> index_of_name;
+    uint64_t first_ns = 0;
+    for (const CaptureRecord& record : records) {
+        if (record.kind != CaptureKind::inbound || (record.type != FrameType::chat && record.type != FrameType::gossip)) {
+            continue;
+        }
+        auto [it, added] = sender_of.try_emplace({ record.connection, record.name }, int(names.size()));
+        if (added) {
+            string name = record.name.empty() ? string("peer") : record.name;
+            for (int n = 2; index_of_name.count(name) > 0; ++n) {
+                name = (record.name.empty() ? string("peer") : record.name) + "#" + std::to_string(n);
+            }
+            index_of_name[name] = int(names.size());
+            names.push_back(name);
+        }
+        if (events.empty()) {
+            first_ns = record.time_ns;
+        }
+        events.push_back(ReplayEvent{ record.time_ns - first_ns, it->second, record.body });
+    }
+    if (events.empty()) {
+        throw std::runtime_error(options.replay_file + " holds no received messages to replay");
+    }
+    int senders = int(names.size());
+
+    io_context host_io;
+    io_context client_io;
+    ssl::context host_ssl(ssl::context::tls);
+    ssl::context client_ssl(ssl::context::tls);
+    configure_ssl_context(host_ssl, credentials);
+    configure_ssl_context(client_ssl, credentials);
+
+    // Slow readers hold the senders back instead of losing messages, so every delivery can be matched
+    BackpressureLimits limits;
+    limits.policy = SlowConsumerPolicy::pause_input;
+    Host host(host_io, host_ssl, tcp::endpoint(ip::make_address("127.0.0.1"), options.port), "bench-host", Color::White);
+    host.set_backpressure(limits);
+    host.start();
+
+    auto host_work = make_work_guard(host_io);
+    auto client_work = make_work_guard(client_io);
+    std::thread host_thread([&host_io]() { host_io.run(); });
+    std::thread client_thread([&client_io]() { client_io.run(); });
+
+    // Only touched on the client IO thread. A sender's messages reach each receiver in the order sent,
+    // so the n-th one a receiver sees from a sender is the sender's n-th send.
+    std::atomic<uint64_t> delivered(0);
+    std::atomic<uint64_t> bytes_delivered(0);
+    vector<vector<int64_t>> send_times(senders);
+    std::unordered_map<const Peer*, vector<uint64_t>> received;
+    vector<double> latency_us;
+    Peer::message_handler handler = [&](const std::shared_ptr<Peer>& client, const MessageView& message) {
+        auto sender = index_of_name.find(message.name);
+        if (sender == index_of_name.end()) return true;
+        auto& counts = received[client.get()];
+        counts.resize(senders);
+        uint64_t n = counts[sender->second]++;
+        if (n < send_times[sender->second].size()) {
+            latency_us.push_back((now_ns() - send_times[sender->second][n]) / 1000.0);
+        }
+        bytes_delivered += message.body.size();
+        ++delivered;
+        return true;
+        };
+
+    names.push_back("replay-listener");
+    vector<std::shared_ptr<Peer>> clients = connect_clients(client_io, client_ssl, options, options.port, senders + 1, nullptr, handler, names);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    ReplayDriver driver(client_io, clients, events, options.replay_speed, send_times);
+    post(client_io, use_future([&]() {
+        BackpressureLimits client_limits;
+        client_limits.policy = SlowConsumerPolicy::pause_input;
+        for (const auto& client : clients) {
+            client->set_backpressure(client_limits);
+            client->set_pressure_handler([&driver](const std::shared_ptr<Peer>&, bool congested) {
+                driver.set_congested(congested);
+                });
+        }
+        })).wait();
+
+    std::promise<void> replay_done;
+    auto start = Clock::now();
+    post(client_io, [&]() { driver.start([&]() { replay_done.set_value(); }); });
+    replay_done.get_future().wait();
+
+    uint64_t sent = events.size();
+    uint64_t expected = sent * uint64_t(senders);
+    auto drain_deadline = Clock::now() + std::chrono::seconds(10);
+    while (delivered < expected && Clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    host.shutdown();
+    close_clients(client_io, clients);
+    host_work.reset();
+    client_work.reset();
+    host_io.stop();
+    client_io.stop();
+    host_thread.join();
+    client_thread.join();
+
+    std::sort(latency_us.begin(), latency_us.end());
+    std::ostringstream json;
+    json << "{\"scenario\":\"replay\""
+        << ",\"records\":" << records.size()
+        << ",\"senders\":" << senders
+        << ",\"speed\":";
+    if (options.replay_speed > 0) json << options.replay_speed;
+    else json << "\"max\"";
+    json << ",\"capture_duration_s\":" << events.back().time_ns / 1e9
+        << ",\"sent\":" << sent
+        << ",\"delivered\":" << delivered
+        << ",\"expected\":" << expected
+        << ",\"elapsed_s\":" << elapsed
+        << ",\"messages_per_sec\":" << (elapsed > 0 ? sent / elapsed : 0.0)
+        << ",\"deliveries_per_sec\":" << (elapsed > 0 ? delivered / elapsed : 0.0)
+        << ",\"bytes_per_sec\":" << (elapsed > 0 ? bytes_delivered / elapsed : 0.0)
+        << ",\"latency_us\":{\"p50\":" << percentile(latency_us, 0.50)
+        << ",\"p99\":" << percentile(latency_us, 0.99)
+        << ",\"p999\":" << percentile(latency_us, 0.999)
+        << ",\"max\":" << (latency_us.empty() ? 0.0 : latency_us.back()) << "}"
+        << "}";
+    return json.str();
+}
+
+// Runs the headless loopback benchmark
+int run_benchmark(int argc, char* argv[]) {
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        // Keep the terminal quiet, the results are the only output
+        Console::instance().set_muted(true);
+        SslCredentials credentials = generate_test_credentials();
+
+        std::ostringstream report;
+        report << "{\"benchmark\":\"echochat\",\"runs\":[";
+        // A replay runs on its own, so its numbers can be compared across builds
+        if (!options.replay_file.empty()) {
+            report << run_replay_scenario(options, credentials);
+        }
+        else {
+            report << run_handshake_scenario(options, options.handshakes, credentials);
+            for (std::size_t i = 0; i < options.client_counts.size(); ++i) {
+                BenchResult result = run_scenario(options, options.client_counts[i], credentials);
+                report << "," << to_json(options, result);
+            }
+            for (int threads : options.thread_counts) {
+                report << "," << run_throughput_scenario(options, threads, credentials);
+            }
+            if (options.mesh_nodes > 0) {
+                report << "," << run_mesh_scenario(options, options.mesh_nodes, credentials);
+            }
+            if (options.rooms > 0) {
+                report << "," << run_rooms_scenario(options, options.rooms, credentials);
+            }
+            if (options.ktls) {
+                report << "," << run_ktls_scenario(options, false, credentials);
+                report << "," << run_ktls_scenario(options, true, credentials);
+            }
+            if (options.backpressure) {
+                report << "," << run_backpressure_scenario(options, "unbounded", SlowConsumerPolicy::drop_oldest, false, credentials);
+                report << "," << run_backpressure_scenario(options, "pause_input", SlowConsumerPolicy::pause_input, true, credentials);
+                report << "," << run_backpressure_scenario(options, "drop_oldest", SlowConsumerPolicy::drop_oldest, true, credentials);
+                report << "," << run_backpressure_scenario(options, "disconnect", SlowConsumerPolicy::disconnect, true, credentials);
+            }
+            if (options.search_messages > 0) {
+                report << "," << run_search_scenario(options);
+            }
+        }
+        report << "]}";
+
+        std::cout << report.str() << std::endl;
+        if (!options.output_file.empty()) {
+            std::ofstream out(options.output_file);
+            out << report.str() << "\n";
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
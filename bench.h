@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Runs the headless loopback benchmark (main.exe --bench [options]) and returns the exit code.
+// A host and the requested number of clients run in-process over 127.0.0.1 TLS with generated
+// certificates, and the results are written as JSON.
+int run_benchmark(int argc, char* argv[]);
+
+#endif // BENCH_H
@@ -0,0 +1,218 @@
+#include "buffer_pool.h"
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifdef ECHOCHAT_COUNT_ALLOCATIONS
+// Heap allocations made by this thread, plain thread-local so counting costs no synchronisation
+static thread_local uint64_t allocation_count = 0;
+
+// Allocates with malloc, or aligned_alloc when `alignment` is over the default, calling the new
+// handler until it succeeds
+static void* counted_allocate(std::size_t size, std::size_t alignment) {
+    ++allocation_count;
+    if (size == 0) {
+        size = 1;
+    }
+    while (true) {
+#ifdef _WIN32
+        void* pointer = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? _aligned_malloc(size, alignment) : std::malloc(size);
+#else
+        // aligned_alloc wants the size rounded up to a multiple of the alignment
+        void* pointer = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+            ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size);
+#endif
+        if (pointer) {
+            return pointer;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+// Frees memory from counted_allocate, Windows keeps over-aligned blocks in a separate heap
+static void counted_free(void* pointer, std::size_t alignment) noexcept {
+#ifdef _WIN32
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        _aligned_free(pointer);
+        return;
+    }
+#else
+    (void)alignment;
+#endif
+    std::free(pointer);
+}
+
+// Counts every heap allocation, the benchmark uses the count to check the hot path makes none. The
+// array and nothrow forms call these, the aligned forms are replaced as well so none goes uncounted.
+void* operator new(std::size_t size) {
+    return counted_allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+// Over-aligned form of the above
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return counted_allocate(size, std::size_t(alignment));
+}
+
+// Releases memory from the counting operator new
+void operator delete(void* pointer) noexcept {
+    counted_free(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+// Sized form of the above
+void operator delete(void* pointer, std::size_t) noexcept {
+    counted_free(pointer, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+// Releases memory from the over-aligned operator new
+void operator delete(void* pointer, std::align_val_t alignment) noexcept {
+    counted_free(pointer, std::size_t(alignment));
+}
+
+// Sized form of the above
+void operator delete(void* pointer, std::size_t, std::align_val_t alignment) noexcept {
+    counted_free(pointer, std::size_t(alignment));
+}
+
+// Heap allocations made by the calling thread
+uint64_t thread_allocation_count() {
+    return allocation_count;
+}
+#else
+// Interactive builds keep the standard allocator and count nothing
+uint64_t thread_allocation_count() {
+    return 0;
+}
+#endif
+
+// Free blocks held by one thread, handed back to the depots when the thread exits
+struct ThreadCache {
+    std::array<void*, BufferPool::SIZE_CLASSES.size()> heads{};
+    std::array<std::size_t, BufferPool::SIZE_CLASSES.size()> counts{};
+
+    ~ThreadCache();
+};
+
+static thread_local ThreadCache thread_cache;
+
+// Returns the cached blocks so other threads can use them
+ThreadCache::~ThreadCache() {
+    for (std::size_t index = 0; index < heads.size(); ++index) {
+        BufferPool::instance().drain(index, reinterpret_cast<BufferPool::FreeBlock*&>(heads[index]), counts[index], 0);
+    }
+}
+
+// The process-wide pool, never destroyed so blocks can be released during shutdown
+BufferPool& BufferPool::instance() {
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+// Index of the smallest class holding `bytes`, SIZE_CLASSES.size() if none does
+std::size_t BufferPool::size_class(std::size_t bytes) {
+    std::size_t index = 0;
+    while (index < SIZE_CLASSES.size() && SIZE_CLASSES[index] < bytes) {
+        ++index;
+    }
+    return index;
+}
+
+// Returns a block from this thread's cache, refilling it from the depot or a new slab when empty
+void* BufferPool::allocate(std::size_t bytes) {
+    std::size_t index = size_class(bytes);
+    if (index == SIZE_CLASSES.size()) {
+        return ::operator new(bytes);
+    }
+
+    FreeBlock*& head = reinterpret_cast<FreeBlock*&>(thread_cache.heads[index]);
+    std::size_t& count = thread_cache.counts[index];
+    if (!head) {
+        refill(index, head, count);
+    }
+    FreeBlock* block = head;
+    head = block->next;
+    --count;
+    return block;
+}
+
+// Puts a block back in this thread's cache, spilling half of it to the depot when full
+void BufferPool::deallocate(void* pointer, std::size_t bytes) {
+    std::size_t index = size_class(bytes);
+    if (index == SIZE_CLASSES.size()) {
+        ::operator delete(pointer);
+        return;
+    }
+
+    FreeBlock*& head = reinterpret_cast<FreeBlock*&>(thread_cache.heads[index]);
+    std::size_t& count = thread_cache.counts[index];
+    FreeBlock* block = static_cast<FreeBlock*>(pointer);
+    block->next = head;
+    head = block;
+    if (++count > THREAD_CACHE_BLOCKS) {
+        drain(index, head, count, THREAD_CACHE_BLOCKS / 2);
+    }
+}
+
+// Moves up to half a cache of blocks from the depot, carving a new slab if the depot is empty
+void BufferPool::refill(std::size_t index, FreeBlock*& head, std::size_t& count) {
+    {
+        std::lock_guard<std::mutex> lock(depots_[index].mutex);
+        FreeBlock*& depot = depots_[index].head;
+        while (depot && count < THREAD_CACHE_BLOCKS / 2) {
+            FreeBlock* block = depot;
+            depot = block->next;
+            block->next = head;
+            head = block;
+            ++count;
+        }
+    }
+    if (head) {
+        return;
+    }
+
+    // Slabs are never freed, blocks only move between caches and depots
+    const std::size_t block_size = SIZE_CLASSES[index];
+    char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+    slabs_.fetch_add(1, std::memory_order_relaxed);
+    for (std::size_t offset = 0; offset + block_size <= SLAB_SIZE; offset += block_size) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + offset);
+        block->next = head;
+        head = block;
+        ++count;
+    }
+}
+
+// Moves blocks from a thread cache to the depot until `keep` are left
+void BufferPool::drain(std::size_t index, FreeBlock*& head, std::size_t& count, std::size_t keep) {
+    std::lock_guard<std::mutex> lock(depots_[index].mutex);
+    FreeBlock*& depot = depots_[index].head;
+    while (head && count > keep) {
+        FreeBlock* block = head;
+        head = block->next;
+        block->next = depot;
+        depot = block;
+        --count;
+    }
+}
+
+// Returns the inline storage if it is free and large enough, otherwise a pool block
+void* HandlerMemory::allocate(std::size_t bytes) {
+    if (!in_use_ && bytes <= SIZE) {
+        in_use_ = true;
+        return storage_;
+    }
+    return BufferPool::instance().allocate(bytes);
+}
+
+// Marks the inline storage free again or returns the block to the pool
+void HandlerMemory::deallocate(void* pointer, std::size_t bytes) {
+    if (pointer == storage_) {
+        in_use_ = false;
+        return;
+    }
+    BufferPool::instance().deallocate(pointer, bytes);
+}
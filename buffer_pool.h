@@ -0,0 +1,188 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Recycled fixed-size blocks for the message hot path: outbound messages and their encoded frames,
+// receive buffers and handler memory. Blocks come in SIZE_CLASSES and are carved out of SLAB_SIZE
+// slabs that are never returned to the heap, so once the pool has warmed up a message costs no heap
+// allocation. Each thread keeps up to THREAD_CACHE_BLOCKS free blocks per class so the common case
+// takes no lock, the rest are shared through a locked depot. Requests larger than the biggest class
+// go to the heap. Thread-safe.
+class BufferPool {
+public:
+    static constexpr std::array<std::size_t, 11> SIZE_CLASSES{ 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536 };
+    static constexpr std::size_t SLAB_SIZE = 256 * 1024;
+    static constexpr std::size_t THREAD_CACHE_BLOCKS = 64;
+
+    // The process-wide pool
+    static BufferPool& instance();
+
+    // Returns a block of at least `bytes`, aligned for any type
+    void* allocate(std::size_t bytes);
+
+    // Returns a block to the pool, `bytes` must be the size it was allocated with
+    void deallocate(void* block, std::size_t bytes);
+
+    // Slabs taken from the heap so far
+    uint64_t slabs() const { return slabs_.load(std::memory_order_relaxed); }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    // Free blocks of one size class shared by every thread
+    struct Depot {
+        std::mutex mutex;
+        FreeBlock* head = nullptr;
+    };
+
+    BufferPool() = default;
+
+    static std::size_t size_class(std::size_t bytes); // Index of the smallest class holding `bytes`
+    void refill(std::size_t index, FreeBlock*& head, std::size_t& count); // Moves blocks to a thread cache
+    void drain(std::size_t index, FreeBlock*& head, std::size_t& count, std::size_t keep); // Returns cached blocks to the depot
+
+    friend struct ThreadCache;
+
+    std::array<Depot, SIZE_CLASSES.size()> depots_;
+    std::atomic<uint64_t> slabs_{ 0 };
+};
+
+// Standard allocator over BufferPool, for containers and allocate_shared on the hot path
+template <typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(BufferPool::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        BufferPool::instance().deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+// String whose storage comes from the pool, used for encoded frames
+using PooledString = std::basic_string<char, std::char_traits<char>, PoolAllocator<char>>;
+
+// Memory for the handler of one kind of asynchronous operation on a connection (its read or its
+// write), of which at most one is outstanding at a time. The handler is stored inline, so starting
+// the next operation reuses the same bytes. A second handler alive at once, or one larger than
+// SIZE, falls back to the pool.
+class HandlerMemory {
+public:
+    static constexpr std::size_t SIZE = 1024;
+
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    // Returns storage for a handler of `bytes`
+    void* allocate(std::size_t bytes);
+
+    // Releases storage returned by allocate
+    void deallocate(void* pointer, std::size_t bytes);
+
+private:
+    alignas(std::max_align_t) unsigned char storage_[SIZE];
+    bool in_use_ = false;
+};
+
+// Allocator Asio uses for a handler wrapped by make_pooled_handler
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept : memory_(&memory) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(memory_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        memory_->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept { return memory_ == other.memory_; }
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept { return memory_ != other.memory_; }
+
+private:
+    template <typename> friend class HandlerAllocator;
+    HandlerMemory* memory_;
+};
+
+// Completion handler carrying the allocator Asio should take its operation state from
+template <typename Handler, typename Allocator>
+class AllocatingHandler {
+public:
+    using allocator_type = Allocator;
+
+    AllocatingHandler(Handler handler, const Allocator& allocator) : handler_(std::move(handler)), allocator_(allocator) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_; }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    Handler handler_;
+    Allocator allocator_;
+};
+
+// Wraps `handler` so the operation it completes is allocated from `memory`, for a connection's reads and writes
+template <typename Handler>
+AllocatingHandler<std::decay_t<Handler>, HandlerAllocator<void>> make_pooled_handler(HandlerMemory& memory, Handler&& handler) {
+    return { std::forward<Handler>(handler), HandlerAllocator<void>(memory) };
+}
+
+// Wraps `handler` so the operation it completes is allocated from the pool, for posted work
+template <typename Handler>
+AllocatingHandler<std::decay_t<Handler>, PoolAllocator<void>> make_pooled_handler(Handler&& handler) {
+    return { std::forward<Handler>(handler), PoolAllocator<void>() };
+}
+
+// Built with ECHOCHAT_COUNT_ALLOCATIONS, buffer_pool.cpp replaces the global operator new and delete to
+// count heap allocations for the benchmarks. Other builds leave the standard allocator in place.
+#ifdef ECHOCHAT_COUNT_ALLOCATIONS
+constexpr bool ALLOCATIONS_COUNTED = true;
+#else
+constexpr bool ALLOCATIONS_COUNTED = false;
+#endif
+
+// Heap allocations made by the calling thread since it started, counted by the global operator new.
+// Always 0 unless ALLOCATIONS_COUNTED.
+uint64_t thread_allocation_count();
+
+#endif // BUFFER_POOL_H
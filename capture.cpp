@@ -0,0 +1,167 @@
+#include "capture.h"
+#include <cstring>
+
+// Identifies a capture file
+const char CAPTURE_MAGIC[4] = { 'E', 'C', 'A', 'P' };
+// Bytes buffered by the C runtime before records reach the operating system
+const std::size_t CAPTURE_BUFFER_SIZE = 256 * 1024;
+
+// Little-endian base 128 helpers for the file format
+static void put_varint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(uint8_t(value) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static bool get_varint(string_view data, std::size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+        uint8_t byte = uint8_t(data[offset++]);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Reads a varint length and that many bytes
+static bool get_bytes(string_view data, std::size_t& offset, string& out) {
+    uint64_t length = 0;
+    if (!get_varint(data, offset, length) || length > data.size() - offset) {
+        return false;
+    }
+    out.assign(data.data() + offset, std::size_t(length));
+    offset += std::size_t(length);
+    return true;
+}
+
+// Flushes and closes the file
+CaptureWriter::~CaptureWriter() {
+    if (file_) {
+        std::fclose(file_);
+    }
+}
+
+// Creates or truncates the capture file, record times count from here
+bool CaptureWriter::open(const string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) {
+        return false;
+    }
+    std::setvbuf(file_, nullptr, _IOFBF, CAPTURE_BUFFER_SIZE);
+    std::fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), file_);
+    std::fputc(VERSION, file_);
+    last_ = std::chrono::steady_clock::now();
+    return true;
+}
+
+// Hands out a number for a new connection
+uint64_t CaptureWriter::next_connection() {
+    return connections_.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// Encodes the kind, the time since the previous record and the connection
+void CaptureWriter::start_record(CaptureKind kind, uint64_t connection) {
+    auto now = std::chrono::steady_clock::now();
+    // Threads may take the lock out of clock order, their records then share a timestamp
+    uint64_t delta = now > last_ ? uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count()) : 0;
+    if (now > last_) {
+        last_ = now;
+    }
+    record_.clear();
+    record_.push_back(char(kind));
+    put_varint(record_, delta);
+    put_varint(record_, connection);
+}
+
+// Records where a connection comes from
+void CaptureWriter::record_open(uint64_t connection, string_view remote) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_) {
+        return;
+    }
+    start_record(CaptureKind::open, connection);
+    put_varint(record_, remote.size());
+    record_.append(remote);
+    std::fwrite(record_.data(), 1, record_.size(), file_);
+}
+
+// Records a frame received from or queued for a connection
+void CaptureWriter::record(CaptureKind kind, uint64_t connection, FrameType type, uint8_t colour_id, string_view name, string_view body) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_) {
+        return;
+    }
+    start_record(kind, connection);
+    record_.push_back(char(type));
+    record_.push_back(char(colour_id));
+    put_varint(record_, name.size());
+    record_.append(name);
+    put_varint(record_, body.size());
+    record_.append(body);
+    std::fwrite(record_.data(), 1, record_.size(), file_);
+}
+
+// Pushes buffered records to the operating system
+void CaptureWriter::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_) {
+        std::fflush(file_);
+    }
+}
+
+// Reads a whole capture file
+bool read_capture(const string& path, std::vector<CaptureRecord>& records, string& error) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "could not open capture file " + path;
+        return false;
+    }
+    string data;
+    char chunk[64 * 1024];
+    std::size_t length = 0;
+    while ((length = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, length);
+    }
+    std::fclose(file);
+
+    if (data.size() < sizeof(CAPTURE_MAGIC) + 1 || std::memcmp(data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        error = path + " is not a capture file";
+        return false;
+    }
+    if (uint8_t(data[sizeof(CAPTURE_MAGIC)]) != CaptureWriter::VERSION) {
+        error = path + " has an unsupported capture version";
+        return false;
+    }
+
+    std::size_t offset = sizeof(CAPTURE_MAGIC) + 1;
+    uint64_t time_ns = 0;
+    while (offset < data.size()) {
+        CaptureRecord record;
+        uint64_t delta = 0;
+        record.kind = CaptureKind(uint8_t(data[offset++]));
+        bool ok = get_varint(data, offset, delta) && get_varint(data, offset, record.connection);
+        if (ok && record.kind == CaptureKind::open) {
+            ok = get_bytes(data, offset, record.body);
+        }
+        else if (ok && (record.kind == CaptureKind::inbound || record.kind == CaptureKind::outbound) && offset + 2 <= data.size()) {
+            record.type = FrameType(uint8_t(data[offset++]));
+            record.colour_id = uint8_t(data[offset++]);
+            ok = get_bytes(data, offset, record.name) && get_bytes(data, offset, record.body);
+        }
+        else {
+            ok = false;
+        }
+        // A capture cut short by a crash ends in a partial record, everything before it is usable
+        if (!ok) {
+            error = path + " is damaged after " + std::to_string(records.size()) + " records";
+            return false;
+        }
+        time_ns += delta;
+        record.time_ns = time_ns;
+        records.push_back(std::move(record));
+    }
+    return true;
+}
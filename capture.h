@@ -0,0 +1,83 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "protocol.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::string;
+using std::string_view;
+
+// What a capture record describes
+enum class CaptureKind : uint8_t {
+    open = 1,     // A connection was first seen, the body holds its remote address
+    inbound = 2,  // A frame received from the connection, after decryption and inflation
+    outbound = 3, // A frame queued for the connection, before encoding
+};
+
+// A record read back from a capture file
+struct CaptureRecord {
+    CaptureKind kind = CaptureKind::inbound;
+    uint64_t time_ns = 0;      // Time since the capture started
+    uint64_t connection = 0;   // Connection the frame belongs to, numbered from 1 in the order seen
+    FrameType type = FrameType::chat;
+    uint8_t colour_id = 0;
+    string name;
+    string body;
+};
+
+// Records the chat traffic of every connection of a process to a compact binary file, so a real
+// session can be replayed against a later build to catch performance regressions. Frames are
+// recorded decrypted and decoded, as the peers saw them, with the time and the connection they
+// belong to. Peers on different IO threads share one writer, appends are serialised and buffered.
+//
+// File layout: "ECAP", u8 version, then records. Record layout: u8 kind, varint nanoseconds since
+// the previous record, varint connection. Open records follow with a varint length and the remote
+// address, frame records with u8 frame type, u8 colour id and the name and body, each as a varint
+// length and bytes. Varints are little-endian base 128.
+class CaptureWriter {
+public:
+    static constexpr uint8_t VERSION = 1;
+
+    CaptureWriter() = default;
+    ~CaptureWriter();
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    // Creates or truncates the capture file and writes its header
+    bool open(const string& path);
+
+    // Hands out a number for a new connection. Any thread.
+    uint64_t next_connection();
+
+    // Records that a connection was first seen and where it comes from. Any thread.
+    void record_open(uint64_t connection, string_view remote);
+
+    // Records a frame received from or queued for a connection. Any thread.
+    void record(CaptureKind kind, uint64_t connection, FrameType type, uint8_t colour_id, string_view name, string_view body);
+
+    // Pushes buffered records to the operating system
+    void flush();
+
+private:
+    void start_record(CaptureKind kind, uint64_t connection); // Encodes the common fields into record_, mutex held
+
+    std::mutex mutex_;                       // Records come from every IO thread
+    std::FILE* file_ = nullptr;
+    std::chrono::steady_clock::time_point last_;  // Time of the previous record
+    std::atomic<uint64_t> connections_{ 0 }; // Connection numbers handed out
+    string record_;                          // Reused encode buffer
+};
+
+// Reads a whole capture file into `records`, in the order they were written. Returns false with
+// `error` set if the file cannot be read or is not a capture, records before damage are kept.
+bool read_capture(const string& path, std::vector<CaptureRecord>& records, string& error);
+
+#endif // CAPTURE_H
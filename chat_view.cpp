@@ -0,0 +1,212 @@
+#include "chat_view.h"
+#include "protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <ftxui/component/component.hpp>
+#include <ftxui/component/event.hpp>
+#include <ftxui/component/mouse.hpp>
+#include <ftxui/component/screen_interactive.hpp>
+
+// Lines moved by one step of the mouse wheel
+const int64_t WHEEL_LINES = 3;
+
+// Reserves nothing, the ring grows as lines arrive
+Scrollback::Scrollback(std::size_t capacity)
+    : capacity_(std::max<std::size_t>(capacity, 1)) {}
+
+// Adds a line, overwriting the oldest once the ring is full
+void Scrollback::push(string_view name, uint8_t colour_id, string_view body, string_view room) {
+    ScrollbackLine* line = nullptr;
+    if (lines_.size() < capacity_) {
+        line = &lines_.emplace_back();
+    }
+    else {
+        line = &lines_[next_];
+        next_ = (next_ + 1) % capacity_;
+    }
+    line->room.assign(room);
+    line->name.assign(name);
+    line->body.assign(body);
+    line->colour_id = colour_id;
+}
+
+// Number of lines kept
+std::size_t Scrollback::size() const {
+    return lines_.size();
+}
+
+// Line `index` counting from the oldest kept, the oldest sits at next_ once the ring has wrapped
+const ScrollbackLine& Scrollback::at(std::size_t index) const {
+    return lines_[lines_.size() < capacity_ ? index : (next_ + index) % capacity_];
+}
+
+// Constructor to size the scrollback
+ChatView::ChatView(const ViewSettings& settings)
+    : settings_(settings), scrollback_(settings.scrollback) {
+    settings_.fps = std::max(settings_.fps, 1u);
+}
+
+// Asks for a redraw at the next frame
+void ChatView::mark_changed() {
+    changed_.store(true, std::memory_order_relaxed);
+}
+
+// Adds a chat message, a view scrolled back stays on the lines it shows
+void ChatView::add_message(string_view name, uint8_t colour_id, string_view body, string_view room) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        scrollback_.push(name, colour_id, body, room);
+        if (scroll_ > 0) {
+            ++scroll_;
+        }
+    }
+    mark_changed();
+}
+
+// Adds a status line
+void ChatView::add_line(string_view line) {
+    add_message(string_view(), 0, line);
+}
+
+// Sets the name shown before the input line
+void ChatView::set_prompt(string_view name, uint8_t colour_id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (prompt_name_ == name && prompt_colour_ == colour_id) {
+            return;
+        }
+        prompt_name_.assign(name);
+        prompt_colour_ = colour_id;
+    }
+    mark_changed();
+}
+
+// Scrolls back (positive) or forward, clamped when the next frame is built
+void ChatView::scroll_by(int64_t lines) {
+    scroll_ = lines < 0 && std::size_t(-lines) > scroll_ ? 0 : std::size_t(int64_t(scroll_) + lines);
+}
+
+// Builds the frame: the newest lines that fit above a status line and the input line
+ftxui::Element ChatView::render(int height) {
+    using namespace ftxui;
+    frames_.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t rows = std::size_t(std::max(height - 2, 1));
+    std::size_t size = scrollback_.size();
+    page_rows_ = rows;
+    scroll_ = std::min(scroll_, size > rows ? size - rows : 0);
+    std::size_t end = size - scroll_;
+    std::size_t begin = end > rows ? end - rows : 0;
+
+    // Only the visible window is turned into elements, the rest of the scrollback costs nothing here
+    Elements lines;
+    lines.reserve(end - begin + 1);
+    lines.push_back(filler());
+    for (std::size_t i = begin; i < end; ++i) {
+        const ScrollbackLine& line = scrollback_.at(i);
+        Elements parts;
+        if (!line.room.empty()) {
+            parts.push_back(text("[" + line.room + "] "));
+        }
+        if (!line.name.empty()) {
+            parts.push_back(text(line.name + ": ") | color(colour_from_id(line.colour_id)));
+        }
+        parts.push_back(text(line.body));
+        lines.push_back(hbox(std::move(parts)));
+    }
+
+    string status = scroll_ > 0
+        ? "-- " + std::to_string(scroll_) + " newer lines, End to follow --"
+        : "PgUp/PgDn or the mouse wheel to scroll, 'exit' to quit";
+    return vbox({
+        vbox(std::move(lines)) | yflex,
+        text(status) | dim,
+        hbox({ text(prompt_name_ + ": ") | color(colour_from_id(prompt_colour_)), text(input_) }),
+        });
+}
+
+// Frames rendered so far
+uint64_t ChatView::frames() const {
+    return frames_.load(std::memory_order_relaxed);
+}
+
+// Handles a key, mouse or wake-up event on the view thread
+bool ChatView::handle_event(const ftxui::Event& event) {
+    using ftxui::Event;
+    using ftxui::Mouse;
+    if (exit_requested_) {
+        exit_loop_();
+        return true;
+    }
+    if (event == Event::Custom) {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (event == Event::Return) {
+        string line = std::exchange(input_, string());
+        scroll_ = 0;
+        // Keep the typed line on screen the way a terminal echoes it
+        if (!line.empty()) {
+            scrollback_.push(prompt_name_, prompt_colour_, line, string_view());
+        }
+        lock.unlock();
+        on_line_(std::move(line));
+        return true;
+    }
+    if (event == Event::Backspace) {
+        // Remove a whole UTF-8 character, continuation bytes look like 10xxxxxx
+        while (!input_.empty() && (uint8_t(input_.back()) & 0xC0) == 0x80) {
+            input_.pop_back();
+        }
+        if (!input_.empty()) {
+            input_.pop_back();
+        }
+        return true;
+    }
+    if (event == Event::PageUp) scroll_by(int64_t(page_rows_) - 1);
+    else if (event == Event::PageDown) scroll_by(1 - int64_t(page_rows_));
+    else if (event == Event::ArrowUp) scroll_by(1);
+    else if (event == Event::ArrowDown) scroll_by(-1);
+    else if (event == Event::Home) scroll_ = scrollback_.size();
+    else if (event == Event::End) scroll_ = 0;
+    else if (event.is_mouse() && event.mouse().button == Mouse::WheelUp) scroll_by(WHEEL_LINES);
+    else if (event.is_mouse() && event.mouse().button == Mouse::WheelDown) scroll_by(-WHEEL_LINES);
+    else if (event.is_character()) input_.append(event.character());
+    else return false;
+    return true;
+}
+
+// Runs the screen loop. A ticker thread wakes the loop at most fps times a second, and only when
+// something changed, so how often messages arrive never decides how often the screen is drawn.
+void ChatView::run(std::function<void(string)> on_line) {
+    using namespace ftxui;
+    auto screen = ScreenInteractive::Fullscreen();
+    on_line_ = std::move(on_line);
+    exit_loop_ = screen.ExitLoopClosure();
+
+    auto component = CatchEvent(Renderer([this, &screen]() { return render(screen.dimy()); }),
+        [this](Event event) { return handle_event(event); });
+
+    std::atomic<bool> running(true);
+    std::thread ticker([this, &screen, &running]() {
+        auto period = std::chrono::microseconds(1000000 / settings_.fps);
+        while (running) {
+            std::this_thread::sleep_for(period);
+            if (changed_.exchange(false, std::memory_order_relaxed) || exit_requested_) {
+                screen.PostEvent(Event::Custom);
+            }
+        }
+        });
+    screen.Loop(component);
+    running = false;
+    ticker.join();
+}
+
+// Asks the view thread to end the loop, the ticker wakes it
+void ChatView::exit() {
+    exit_requested_ = true;
+}
@@ -0,0 +1,108 @@
+#ifndef CHAT_VIEW_H
+#define CHAT_VIEW_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ftxui/dom/elements.hpp>
+
+using std::string;
+using std::string_view;
+
+namespace ftxui {
+struct Event;
+}
+
+// How chat output is shown on a terminal
+struct ViewSettings {
+    bool fullscreen = true;          // Full-screen view when input is a terminal, otherwise printed lines
+    std::size_t scrollback = 10000;  // Lines kept for scrolling back, the oldest are dropped
+    unsigned fps = 30;               // Most redraws per second
+};
+
+// One line of the scrollback, its strings keep their capacity when the slot is reused
+struct ScrollbackLine {
+    string room;         // Room the message was sent to, empty for the lobby
+    string name;         // Sender, empty for status lines
+    string body;
+    uint8_t colour_id = 0;
+};
+
+// The latest lines, up to a fixed number. Slots are reused once it is full, so adding a line
+// allocates nothing unless it is longer than the one it replaces.
+class Scrollback {
+public:
+    explicit Scrollback(std::size_t capacity);
+
+    // Adds a line, dropping the oldest once full
+    void push(string_view name, uint8_t colour_id, string_view body, string_view room);
+
+    // Number of lines kept
+    std::size_t size() const;
+
+    // Line `index` counting from the oldest kept
+    const ScrollbackLine& at(std::size_t index) const;
+
+private:
+    std::vector<ScrollbackLine> lines_; // Grows to the capacity, then used as a ring
+    std::size_t capacity_;
+    std::size_t next_ = 0;              // Slot the next line goes to once the ring is full
+};
+
+// Full-screen chat view: a message pane over an input line. Messages from the IO threads are added to
+// the scrollback and only mark the view as changed, the screen is redrawn at most `fps` times a second
+// and a frame renders only the lines that fit in the pane. A flood of messages therefore costs a copy
+// into the ring per message plus a bounded amount of rendering, however fast they arrive.
+class ChatView {
+public:
+    explicit ChatView(const ViewSettings& settings);
+
+    ChatView(const ChatView&) = delete;
+    ChatView& operator=(const ChatView&) = delete;
+
+    // Adds a chat message or a status line to the scrollback. Any thread.
+    void add_message(string_view name, uint8_t colour_id, string_view body, string_view room = string_view());
+    void add_line(string_view line);
+
+    // Sets the name shown before the input line. Any thread.
+    void set_prompt(string_view name, uint8_t colour_id);
+
+    // Takes over the terminal and runs the view on the calling thread until exit() or Ctrl+C. Each line
+    // typed is passed to `on_line` on that thread.
+    void run(std::function<void(string)> on_line);
+
+    // Ends run(), even if it has not started yet. Any thread.
+    void exit();
+
+    // Builds the frame for a screen `height` rows tall, run() calls it for every redraw
+    ftxui::Element render(int height);
+
+    // Frames rendered so far
+    uint64_t frames() const;
+
+private:
+    bool handle_event(const ftxui::Event& event); // Editing, scrolling and the exit request, view thread only
+    void scroll_by(int64_t lines); // Scrolls back (positive) or forward, mutex held
+    void mark_changed(); // Asks for a redraw at the next frame
+
+    ViewSettings settings_;
+    std::mutex mutex_;                   // Guards everything a frame reads
+    Scrollback scrollback_;
+    std::size_t scroll_ = 0;             // Lines scrolled back from the newest
+    std::size_t page_rows_ = 1;          // Rows of the message pane in the last frame
+    string prompt_name_;
+    uint8_t prompt_colour_ = 0;
+    string input_;                       // Line being typed
+    std::function<void(string)> on_line_; // Receives typed lines, view thread only
+    std::function<void()> exit_loop_;    // Ends the screen loop, view thread only
+    std::atomic<bool> changed_{ false }; // Set by every change, cleared when a redraw is requested
+    std::atomic<bool> exit_requested_{ false };
+    std::atomic<uint64_t> frames_{ 0 };
+};
+
+#endif // CHAT_VIEW_H
@@ -0,0 +1,375 @@
+#include "client.h"
+#include "console.h"
+#include "metrics.h"
+#include <algorithm>
+#include <iterator>
+
+// Margin subtracted from the disconnect time when asking for missed history, covers clock skew
+const int64_t HISTORY_OVERLAP_MS = 5000;
+
+// Constructor to store the host to connect to and the user's name and colour
+Client::Client(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const string& host, const string& port,
+    const string& user_name, Color user_colour)
+    : io_(io), ssl_context_(ssl_context), resolver_(io), connect_timer_(io), retry_timer_(io), host_(host), port_(port),
+    name_(user_name), colour_(user_colour), random_(std::random_device()()) {}
+
+// Stores negotiated sessions so reconnects resume them
+void Client::set_session_cache(SessionCache* cache) {
+    session_cache_ = cache;
+}
+
+// Logs received and sent messages
+void Client::set_message_log(MessageLog* log) {
+    message_log_ = log;
+}
+
+// Records the traffic of every connection
+void Client::set_capture(CaptureWriter* capture) {
+    capture_ = capture;
+}
+
+// Keepalive timing for every connection
+void Client::set_heartbeat(const HeartbeatSettings& heartbeat) {
+    heartbeat_ = heartbeat;
+}
+
+// Kernel TLS for every connection
+void Client::set_ktls(bool enabled) {
+    ktls_ = enabled;
+}
+
+// Largest file accepted on every connection
+void Client::set_max_download(uint64_t bytes) {
+    max_download_ = bytes;
+}
+
+// History asked for after the first connection
+void Client::set_history_request(const string& spec) {
+    history_request_ = spec;
+}
+
+// Input is paused while the send queue is congested
+void Client::set_pressure_handler(std::function<void(bool)> handler) {
+    on_pressure_ = std::move(handler);
+}
+
+// Starts the first connection attempt on the IO thread
+void Client::start() {
+    boost::asio::post(io_, [this]() {
+        start_attempt();
+        });
+}
+
+// Creates a fresh peer, an SSL stream cannot be reused after it has failed, and starts resolving
+void Client::start_attempt() {
+    uint64_t attempt = ++attempt_;
+    peer_ = std::make_shared<Peer>(io_, ssl_context_, name_, colour_);
+    if (session_cache_) {
+        peer_->set_session_cache(session_cache_, host_ + ":" + port_);
+    }
+    peer_->set_message_log(message_log_);
+    if (capture_) {
+        peer_->set_capture(capture_);
+    }
+    peer_->set_heartbeat(heartbeat_);
+    peer_->set_ktls(ktls_);
+    peer_->set_max_download(max_download_);
+    peer_->set_keep_unsent(true);
+    peer_->set_connect_handler([this, attempt](const std::shared_ptr<Peer>&) {
+        handle_connected(attempt);
+        });
+    peer_->set_close_handler([this, attempt](const std::shared_ptr<Peer>&) {
+        handle_failure(attempt, "Connection lost.");
+        });
+    // Hold back input rather than dropping the user's own messages
+    BackpressureLimits limits;
+    limits.policy = SlowConsumerPolicy::pause_input;
+    peer_->set_backpressure(limits);
+    peer_->set_pressure_handler([this, attempt](const std::shared_ptr<Peer>&, bool congested) {
+        if (attempt == attempt_) {
+            set_congested(congested);
+        }
+        });
+
+    // One deadline covers resolving, connecting and the handshake
+    connect_timer_.expires_after(CONNECT_TIMEOUT);
+    connect_timer_.async_wait([this, attempt](boost::system::error_code ec) {
+        if (!ec) {
+            handle_failure(attempt, "Connection attempt timed out.");
+        }
+        });
+
+    Console::instance().print_line("Connecting to " + host_ + ":" + port_ + "...");
+    resolver_.async_resolve(host_, port_, [this, attempt](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+        if (attempt != attempt_) {
+            return;
+        }
+        if (ec) {
+            handle_failure(attempt, "Could not resolve " + host_ + ": " + ec.message());
+            return;
+        }
+
+        // Try each resolved address in turn
+        auto peer = peer_;
+        boost::asio::async_connect(peer->socket().lowest_layer(), endpoints, [this, attempt, peer](boost::system::error_code ec, const tcp::endpoint&) {
+            if (attempt != attempt_) {
+                return;
+            }
+            if (ec) {
+                handle_failure(attempt, "Could not connect: " + ec.message());
+                return;
+            }
+            peer->set_remote_label();
+            peer->start_handshake(boost::asio::ssl::stream_base::client);
+            });
+        });
+}
+
+// The handshake completed, deliver what was typed while disconnected and catch up on history
+void Client::handle_connected(uint64_t attempt) {
+    if (attempt != attempt_ || stopping_) {
+        return;
+    }
+    connect_timer_.cancel();
+    backoff_ = INITIAL_BACKOFF;
+
+    // Ask for the messages missed while the link was down, or the configured history the first time
+    if (ever_connected_) {
+        peer_->request_history("since=" + std::to_string(disconnected_at_ms_ - HISTORY_OVERLAP_MS));
+    }
+    else if (!history_request_.empty()) {
+        peer_->request_history(history_request_);
+    }
+    ever_connected_ = true;
+
+    // The host forgets a session's rooms when it closes
+    for (const string& room : rooms_) {
+        peer_->join_room(room);
+    }
+    if (!unsent_.empty() || !buffered_.empty()) {
+        Console::instance().print_line("Sending " + std::to_string(unsent_.size() + buffered_.size()) + " buffered message(s).");
+    }
+    // Messages the last connection lost were logged when first sent
+    for (auto& message : unsent_) {
+        peer_->deliver(std::move(message));
+    }
+    unsent_.clear();
+    while (!buffered_.empty()) {
+        peer_->send_message(buffered_.front().second, buffered_.front().first);
+        buffered_.pop_front();
+    }
+    set_connected(true);
+}
+
+// An attempt failed or an established link dropped, close it and try again later
+void Client::handle_failure(uint64_t attempt, const string& reason) {
+    if (attempt != attempt_ || stopping_) {
+        return;
+    }
+    // Invalidate every callback still pending for this attempt
+    ++attempt_;
+    connect_timer_.cancel();
+    resolver_.cancel();
+
+    if (is_connected()) {
+        disconnected_at_ms_ = MessageLog::now_ms();
+        set_connected(false);
+    }
+    Console::instance().print_line(reason);
+    close_peer();
+    // Deliveries already posted to the peer and the failing write complete first
+    boost::asio::post(io_, [this, peer = peer_]() {
+        keep_unsent(peer);
+        });
+    // The next connection starts with an empty queue, input is buffered meanwhile
+    set_congested(false);
+    schedule_reconnect();
+}
+
+// Passes a change in congestion to the pressure handler
+void Client::set_congested(bool congested) {
+    if (congested != congested_) {
+        congested_ = congested;
+        if (on_pressure_) {
+            on_pressure_(congested);
+        }
+    }
+}
+
+// Closes the current socket without the messages Peer::shutdown prints, it may never have connected
+void Client::close_peer() {
+    if (!peer_) {
+        return;
+    }
+    boost::system::error_code ec;
+    // Keep the session resumable for the next attempt
+    SSL_set_shutdown(peer_->socket().native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    peer_->socket().lowest_layer().close(ec);
+}
+
+// Keeps the messages a closed peer had queued but not written, they go out first on the next connection
+void Client::keep_unsent(const std::shared_ptr<Peer>& peer) {
+    auto unsent = peer->take_unsent_messages();
+    if (unsent.empty()) {
+        return;
+    }
+    Console::instance().print_line(std::to_string(unsent.size()) + " unsent message(s) will be sent after reconnecting.");
+    unsent_.insert(unsent_.end(), std::make_move_iterator(unsent.begin()), std::make_move_iterator(unsent.end()));
+}
+
+// Waits for the backoff, half fixed and half random so clients dropped together do not retry together
+void Client::schedule_reconnect() {
+    auto half = backoff_ / 2;
+    std::uniform_int_distribution<long long> jitter(0, half.count());
+    auto delay = half + std::chrono::milliseconds(jitter(random_));
+    backoff_ = std::min(backoff_ * 2, MAX_BACKOFF);
+
+    Console::instance().print_line("Reconnecting in " + std::to_string(delay.count()) + "ms.");
+    retry_timer_.expires_after(delay);
+    retry_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec && !stopping_) {
+            start_attempt();
+        }
+        });
+}
+
+// Updates the connection state and wakes anyone waiting for it
+void Client::set_connected(bool connected) {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        connected_ = connected;
+    }
+    state_changed_.notify_all();
+}
+
+// Blocks until connected or the timeout passes
+bool Client::wait_connected(std::chrono::steady_clock::duration timeout) {
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    return state_changed_.wait_for(lock, timeout, [this]() { return connected_; });
+}
+
+// True while a connection is up
+bool Client::is_connected() const {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return connected_;
+}
+
+// Sends a message now, or buffers it until the connection is back
+void Client::send_message(const string& message) {
+    send_messages(std::vector<string>{ message });
+}
+
+// Sends the messages now, or buffers as many as fit until the connection is back
+void Client::send_messages(std::vector<string> messages) {
+    boost::asio::post(io_, [this, messages = std::move(messages)]() {
+        if (peer_ && peer_->is_connected() && is_connected()) {
+            peer_->send_messages(messages, room_);
+            return;
+        }
+
+        std::size_t dropped = 0;
+        for (const string& message : messages) {
+            if (buffered_.size() < MAX_BUFFERED_MESSAGES) {
+                buffered_.emplace_back(room_, message);
+            }
+            else {
+                ++dropped;
+            }
+        }
+        if (dropped == 0) {
+            Console::instance().print_line(messages.size() == 1 ? "Not connected, message will be sent after reconnecting."
+                : "Not connected, messages will be sent after reconnecting.");
+        }
+        else {
+            Console::instance().print_line("Error: Not connected and " + std::to_string(MAX_BUFFERED_MESSAGES)
+                + " messages are already waiting, " + std::to_string(dropped) + " message(s) dropped.");
+        }
+        });
+}
+
+// Streams a file to the host
+void Client::send_file(const FileOffer& offer) {
+    boost::asio::post(io_, [this, offer]() {
+        if (peer_ && is_connected()) {
+            peer_->send_file(offer);
+        }
+        else {
+            Console::instance().print_line("Error: Not connected to peer yet.");
+        }
+        });
+}
+
+// Asks the host to replay part of its log
+void Client::request_history(const string& spec) {
+    boost::asio::post(io_, [this, spec]() {
+        if (peer_ && is_connected()) {
+            peer_->request_history(spec);
+        }
+        else {
+            Console::instance().print_line("Error: Not connected to peer yet.");
+        }
+        });
+}
+
+// Joins a room now, or once connected, and talks in it
+void Client::join_room(const string& room) {
+    boost::asio::post(io_, [this, room]() {
+        if (std::find(rooms_.begin(), rooms_.end(), room) == rooms_.end()) {
+            rooms_.push_back(room);
+            if (peer_ && is_connected()) {
+                peer_->join_room(room);
+            }
+        }
+        room_ = room;
+        Console::instance().print_line("Talking in [" + room + "].");
+        });
+}
+
+// Leaves a room and talks in the one joined before it
+void Client::leave_room(const string& room) {
+    boost::asio::post(io_, [this, room]() {
+        string leaving = room.empty() ? room_ : room;
+        auto it = std::find(rooms_.begin(), rooms_.end(), leaving);
+        if (leaving.empty() || it == rooms_.end()) {
+            Console::instance().print_line(leaving.empty() ? string("Error: The lobby cannot be left.") : "Error: Not in [" + leaving + "].");
+            return;
+        }
+        rooms_.erase(it);
+        if (peer_ && is_connected()) {
+            peer_->leave_room(leaving);
+        }
+        if (room_ == leaving) {
+            room_ = rooms_.empty() ? string() : rooms_.back();
+        }
+        Console::instance().print_line("Left [" + leaving + "], talking in " + (room_.empty() ? string("the lobby") : "[" + room_ + "]") + ".");
+        });
+}
+
+// Clears the line and displays a prompt with the user's name
+void Client::display_prompt() const {
+    Console::instance().print_prompt(name_, colour_to_id(colour_));
+}
+
+// Totals plus the current connection's counters, read on the IO thread where the peer is replaced
+string Client::stats_report() const {
+    return boost::asio::post(io_, boost::asio::use_future([this]() {
+        string report = Metrics::global().report();
+        if (peer_) {
+            report += "\n" + peer_->stats().report(host_ + ":" + port_);
+        }
+        return report;
+        })).get();
+}
+
+// Stops reconnecting and closes the connection
+void Client::shutdown() {
+    stopping_ = true;
+    ++attempt_;
+    connect_timer_.cancel();
+    retry_timer_.cancel();
+    resolver_.cancel();
+    if (peer_) {
+        peer_->shutdown();
+    }
+    set_connected(false);
+}
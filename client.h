@@ -0,0 +1,154 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "peer.h"
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/use_future.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <ftxui/screen/color.hpp>
+
+using boost::asio::ip::tcp;
+using std::string;
+using namespace ftxui;
+
+// Client side of the chat: connects to a host asynchronously and keeps the connection up. Each attempt
+// resolves the host name, connects and completes the SSL handshake within CONNECT_TIMEOUT. When an
+// attempt fails or the link drops, a new attempt is scheduled after a jittered exponential backoff.
+// Messages typed while disconnected are buffered (up to MAX_BUFFERED_MESSAGES) and sent in order once
+// the next connection is up, after the messages the dropped connection had queued but not written.
+// Messages the operating system had already accepted when the drop was noticed, at most a heartbeat
+// timeout's worth, cannot be told apart from delivered ones without acknowledgements and may be lost.
+// The user's own messages are never dropped for a slow host: once the send queue passes its high
+// watermark the pressure handler is told to hold back input until it drains.
+// Methods may be called from any thread unless noted.
+class Client {
+public:
+    // Limit for resolve, connect and handshake together
+    static constexpr std::chrono::seconds CONNECT_TIMEOUT{ 10 };
+    // Backoff before the first retry, doubled after each failure up to MAX_BACKOFF
+    static constexpr std::chrono::milliseconds INITIAL_BACKOFF{ 500 };
+    static constexpr std::chrono::milliseconds MAX_BACKOFF{ 30000 };
+    // Messages kept while disconnected, further messages are refused
+    static constexpr std::size_t MAX_BUFFERED_MESSAGES = 1000;
+
+    // Constructor to store the host to connect to and the user's name and colour
+    Client(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const string& host, const string& port,
+        const string& user_name, Color user_colour);
+
+    // Stores negotiated sessions so reconnects resume them, call before start()
+    void set_session_cache(SessionCache* cache);
+
+    // Logs received and sent messages, call before start()
+    void set_message_log(MessageLog* log);
+
+    // Records the traffic of every connection to `capture`, call before start()
+    void set_capture(CaptureWriter* capture);
+
+    // Sets the ping interval and the silence after which the connection is dropped and retried, call before start()
+    void set_heartbeat(const HeartbeatSettings& heartbeat);
+
+    // Hands record encryption to the kernel where it can, the SSL context must have had enable_ktls
+    // called on it. Call before start().
+    void set_ktls(bool enabled);
+
+    // Refuses files larger than `bytes` offered by the host, call before start()
+    void set_max_download(uint64_t bytes);
+
+    // History asked for after the first connection, later connections ask for what was missed while down
+    void set_history_request(const string& spec);
+
+    // Called on the IO thread when input should pause (true) or may resume (false), call before start()
+    void set_pressure_handler(std::function<void(bool congested)> handler);
+
+    // Starts the first connection attempt
+    void start();
+
+    // Blocks until connected or `timeout` passes, returns true if connected. Must not be called on the IO thread.
+    bool wait_connected(std::chrono::steady_clock::duration timeout);
+
+    // True while a connection is up
+    bool is_connected() const;
+
+    // Sends a message now, or buffers it until the connection is back
+    void send_message(const string& message);
+
+    // Sends several messages with one hand-off to the IO thread, used for piped input
+    void send_messages(std::vector<string> messages);
+
+    // Streams a file to the host, needs a connection
+    void send_file(const FileOffer& offer);
+
+    // Asks the host to replay part of its log, needs a connection
+    void request_history(const string& spec);
+
+    // Joins a room and sends later messages to it. Rooms are joined again after reconnecting.
+    void join_room(const string& room);
+
+    // Leaves a room, the current one if `room` is empty. Messages then go to the room joined before it,
+    // or the lobby.
+    void leave_room(const string& room);
+
+    // Clears the line and displays a prompt with the user's name
+    void display_prompt() const;
+
+    // Totals plus the current connection's counters, must not be called on the IO thread
+    string stats_report() const;
+
+    // Stops reconnecting and closes the connection, must run on the IO thread
+    void shutdown();
+
+private:
+    void start_attempt(); // Creates a new peer and starts resolving
+    void handle_connected(uint64_t attempt); // The handshake of `attempt` completed
+    void handle_failure(uint64_t attempt, const string& reason); // `attempt` failed or its link dropped
+    void close_peer(); // Closes the current attempt's socket
+    void keep_unsent(const std::shared_ptr<Peer>& peer); // Takes the messages a closed peer never wrote
+    void schedule_reconnect(); // Arms the backoff timer
+    void set_connected(bool connected); // Updates the state and wakes wait_connected
+    void set_congested(bool congested); // Tells the pressure handler about a change
+
+    boost::asio::io_context& io_;
+    boost::asio::ssl::context& ssl_context_;
+    tcp::resolver resolver_;
+    boost::asio::steady_timer connect_timer_;   // Attempt timeout
+    boost::asio::steady_timer retry_timer_;     // Backoff before the next attempt
+    string host_;
+    string port_;
+    string name_;
+    Color colour_;
+    SessionCache* session_cache_ = nullptr;
+    MessageLog* message_log_ = nullptr;
+    CaptureWriter* capture_ = nullptr;
+    HeartbeatSettings heartbeat_;
+    bool ktls_ = false;
+    uint64_t max_download_ = DEFAULT_MAX_DOWNLOAD;
+    string history_request_;                    // Sent after the first connection
+    std::shared_ptr<Peer> peer_;                // Current attempt or connection, IO thread only
+    uint64_t attempt_ = 0;                      // Incremented per attempt, stale callbacks are ignored
+    bool ever_connected_ = false;               // IO thread only
+    bool congested_ = false;                    // The current peer is above its high watermark, IO thread only
+    std::function<void(bool)> on_pressure_;     // Pauses and resumes input
+    bool stopping_ = false;                     // Set by shutdown, IO thread only
+    std::chrono::milliseconds backoff_ = INITIAL_BACKOFF;
+    int64_t disconnected_at_ms_ = 0;            // Wall clock time the last connection dropped
+    std::vector<std::shared_ptr<const OutboundMessage>> unsent_; // Logged but never written, IO thread only
+    std::deque<std::pair<string, string>> buffered_; // Room and text of messages typed while disconnected, IO thread only
+    std::vector<string> rooms_;                 // Rooms joined, oldest first, IO thread only
+    string room_;                               // Room messages are sent to, empty for the lobby, IO thread only
+    std::mt19937 random_;                       // Backoff jitter
+    mutable std::mutex state_mutex_;
+    std::condition_variable state_changed_;
+    bool connected_ = false;                    // Guarded by state_mutex_
+};
+
+#endif // CLIENT_H
@@ -0,0 +1,146 @@
+#include "compression.h"
+#include "metrics.h"
+#include <chrono>
+#include <zlib.h>
+
+// Preset dictionary shared by every peer. Deflate looks back into it for matches, so text common in
+// pasted logs and stack traces compresses well even in the first kilobyte of a message. The most
+// frequent strings sit at the end where the match distances are shortest.
+static const char DICTIONARY[] =
+    "Traceback (most recent call last):\n  File \"\", line , in \n"
+    "Exception in thread \"main\" java.lang.NullPointerException\n\tat java.base/"
+    "terminate called after throwing an instance of 'std::runtime_error'\n  what():  "
+    "Segmentation fault (core dumped)\nAssertion failed: "
+    "#include <iostream>\n#include <string>\nint main(int argc, char* argv[]) {\n    return 0;\n}\n"
+    "std::string std::vector std::shared_ptr std::unique_ptr const auto& nullptr "
+    "function return if (else { } for (while (true) null undefined "
+    "https://www. http://localhost:8080/ .com/ .html .json .cpp .h "
+    "DEBUG INFO WARN WARNING ERROR FATAL error: warning: note: failed to could not "
+    "2024-01-01T00:00:00.000Z 00:00:00 [INFO] [ERROR] [WARN] [DEBUG] "
+    "the and that this with have from they will would there their what about which when "
+    "you your just like know think please thanks thank yes no okay ok lol "
+    "the message connection server client error ";
+
+// Bytes used to store the original body length in front of the deflate stream
+const std::size_t LENGTH_PREFIX_SIZE = 4;
+
+// Deflate and inflate streams kept per thread, initialising a stream allocates and clears a few
+// hundred kilobytes so resetting an existing one is much cheaper per message
+class ZlibStreams {
+public:
+    ZlibStreams() {
+        // Raw deflate (negative window bits), the frame already carries the length and TLS protects the data
+        deflate_ok_ = deflateInit2(&deflate_, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        inflate_ok_ = inflateInit2(&inflate_, -15) == Z_OK;
+    }
+
+    ~ZlibStreams() {
+        if (deflate_ok_) deflateEnd(&deflate_);
+        if (inflate_ok_) inflateEnd(&inflate_);
+    }
+
+    ZlibStreams(const ZlibStreams&) = delete;
+    ZlibStreams& operator=(const ZlibStreams&) = delete;
+
+    // Returns the deflate stream reset and primed with the dictionary, null if zlib failed to initialise
+    z_stream* deflater() {
+        if (!deflate_ok_ || deflateReset(&deflate_) != Z_OK) return nullptr;
+        deflateSetDictionary(&deflate_, reinterpret_cast<const Bytef*>(DICTIONARY), sizeof(DICTIONARY) - 1);
+        return &deflate_;
+    }
+
+    // Returns the inflate stream reset and primed with the dictionary, raw inflate has no header to ask for it
+    z_stream* inflater() {
+        if (!inflate_ok_ || inflateReset(&inflate_) != Z_OK) return nullptr;
+        inflateSetDictionary(&inflate_, reinterpret_cast<const Bytef*>(DICTIONARY), sizeof(DICTIONARY) - 1);
+        return &inflate_;
+    }
+
+private:
+    z_stream deflate_{};
+    z_stream inflate_{};
+    bool deflate_ok_ = false;
+    bool inflate_ok_ = false;
+};
+
+// Streams for the calling thread
+static ZlibStreams& zlib_streams() {
+    static thread_local ZlibStreams streams;
+    return streams;
+}
+
+// Elapsed steady clock nanoseconds since `start`
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Compresses a body with the preset dictionary, returns false if it is too small or does not shrink
+bool compress_body(string_view body, string& out) {
+    if (body.size() < COMPRESSION_THRESHOLD) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    z_stream* stream = zlib_streams().deflater();
+    if (!stream) {
+        return false;
+    }
+
+    std::size_t offset = out.size();
+    out.resize(offset + LENGTH_PREFIX_SIZE + deflateBound(stream, uLong(body.size())));
+    uint32_t length = uint32_t(body.size());
+    for (std::size_t i = 0; i < LENGTH_PREFIX_SIZE; ++i) {
+        out[offset + i] = char(length >> (8 * (LENGTH_PREFIX_SIZE - 1 - i)));
+    }
+
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+    stream->avail_in = uInt(body.size());
+    stream->next_out = reinterpret_cast<Bytef*>(&out[offset + LENGTH_PREFIX_SIZE]);
+    stream->avail_out = uInt(out.size() - offset - LENGTH_PREFIX_SIZE);
+    int result = deflate(stream, Z_FINISH);
+    std::size_t compressed = LENGTH_PREFIX_SIZE + stream->total_out;
+
+    if (result != Z_STREAM_END || compressed >= body.size()) {
+        out.resize(offset);
+        return false;
+    }
+    out.resize(offset + compressed);
+
+    Metrics& metrics = Metrics::global();
+    PeerStats::add(metrics.compressed_messages, 1);
+    PeerStats::add(metrics.compress_bytes_in, body.size());
+    PeerStats::add(metrics.compress_bytes_out, compressed);
+    PeerStats::add(metrics.compress_ns, elapsed_ns(start));
+    return true;
+}
+
+// Inflates a compressed body, refusing anything that claims to be larger than `max_size`
+bool decompress_body(string_view data, string& out, std::size_t max_size) {
+    if (data.size() < LENGTH_PREFIX_SIZE) {
+        return false;
+    }
+    uint32_t length = 0;
+    for (std::size_t i = 0; i < LENGTH_PREFIX_SIZE; ++i) {
+        length = (length << 8) | uint8_t(data[i]);
+    }
+    if (length > max_size) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    z_stream* stream = zlib_streams().inflater();
+    if (!stream) {
+        return false;
+    }
+
+    out.resize(length);
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + LENGTH_PREFIX_SIZE));
+    stream->avail_in = uInt(data.size() - LENGTH_PREFIX_SIZE);
+    stream->next_out = reinterpret_cast<Bytef*>(out.data());
+    stream->avail_out = uInt(length);
+    int result = inflate(stream, Z_FINISH);
+    bool ok = result == Z_STREAM_END && stream->total_out == length;
+
+    PeerStats::add(Metrics::global().decompress_ns, elapsed_ns(start));
+    return ok;
+}
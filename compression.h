@@ -0,0 +1,26 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+using std::string;
+using std::string_view;
+
+// Bodies shorter than this are never compressed, a chat line gains nothing and would pay the CPU cost
+const std::size_t COMPRESSION_THRESHOLD = 512;
+
+// Control line announcing that a peer can inflate compressed frames. The dictionary version is part of
+// the line so peers with a different preset dictionary never try to read each other's frames.
+const string_view COMPRESS_LINE = "#compress deflate dict=1";
+
+// Compresses a message body with raw deflate at the fastest level, primed with the preset chat
+// dictionary. Writes u32 big-endian original length followed by the deflate stream to `out`.
+// Returns false if the body is below the threshold or would not get smaller.
+bool compress_body(string_view body, string& out);
+
+// Reverses compress_body into `out`, returns false if the data is corrupt or would inflate past `max_size`
+bool decompress_body(string_view data, string& out, std::size_t max_size);
+
+#endif // COMPRESSION_H
@@ -1,12 +1,26 @@
 #include "config.h"
+#include <openssl/rand.h>
 
-// Configures the SSL context with the necessary certificate, key, and CA files
-void configure_ssl_context(boost::asio::ssl::context& ssl_context) {
-    // Set SSL options to disable outdated protocols not considered secure,
+// Sessions are cached by the host for this long and up to this many at once
+const long SESSION_TIMEOUT_SECONDS = 2 * 60 * 60;
+const long SESSION_CACHE_SIZE = 4096;
+// Context id that resumed sessions must match, required when peers are verified
+const unsigned char SESSION_ID_CONTEXT[] = "EchoChat";
+
+// Sets the SSL options shared by both ways of loading credentials
+static void apply_ssl_options(boost::asio::ssl::context& ssl_context) {
+    // Set SSL options to disable outdated protocols not considered secure, leaving TLS 1.2 and 1.3,
 	// default_workarounds option: Applies various bug workarounds
     ssl_context.set_options(boost::asio::ssl::context::default_workarounds |
         boost::asio::ssl::context::no_sslv2 |
-        boost::asio::ssl::context::no_sslv3);
+        boost::asio::ssl::context::no_sslv3 |
+        boost::asio::ssl::context::no_tlsv1 |
+        boost::asio::ssl::context::no_tlsv1_1);
+}
+
+// Configures the SSL context with the necessary certificate, key, and CA files
+void configure_ssl_context(boost::asio::ssl::context& ssl_context) {
+    apply_ssl_options(ssl_context);
 
     // Load the host certificate chain
     ssl_context.use_certificate_chain_file(CERTIFICATE_FILE);
@@ -17,3 +31,33 @@ void configure_ssl_context(boost::asio::ssl::context& ssl_context) {
     // Set SSL verification mode to require peer verification
     ssl_context.set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
 }
+
+// Configures the SSL context from PEM data held in memory
+void configure_ssl_context(boost::asio::ssl::context& ssl_context, const SslCredentials& credentials) {
+    apply_ssl_options(ssl_context);
+
+    // Load the certificate chain, private key and certificate authority from memory
+    ssl_context.use_certificate_chain(boost::asio::buffer(credentials.certificate_chain));
+    ssl_context.use_private_key(boost::asio::buffer(credentials.private_key), boost::asio::ssl::context::pem);
+    ssl_context.add_certificate_authority(boost::asio::buffer(credentials.ca_certificate));
+    // Set SSL verification mode to require peer verification
+    ssl_context.set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
+}
+
+// Enables the host-side session cache (TLS 1.2 session ids) and session tickets (TLS 1.2 and 1.3)
+void enable_session_resumption(boost::asio::ssl::context& ssl_context) {
+    SSL_CTX* ctx = ssl_context.native_handle();
+
+    // Cache sessions on the host and bind them to this application
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT_SECONDS);
+
+    // Fresh random ticket keys for this host process: name, HMAC secret and AES key, 16 bytes each
+    unsigned char ticket_keys[48];
+    if (RAND_bytes(ticket_keys, sizeof(ticket_keys)) == 1) {
+        SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys));
+    }
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+}
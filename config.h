@@ -9,7 +9,20 @@ const std::string CERTIFICATE_FILE = "D:\\openssl-3.4.0\\certificate.crt";
 const std::string PRIVATE_KEY_FILE = "D:\\openssl-3.4.0\\peer.key";
 const std::string CA_FILE = "D:\\openssl-3.4.0\\ca.crt";
 
+// PEM encoded certificate chain, private key and CA certificate held in memory
+struct SslCredentials {
+    std::string certificate_chain;
+    std::string private_key;
+    std::string ca_certificate;
+};
+
 // Function to configure SSL context with necessary certificate and key files
 void configure_ssl_context(boost::asio::ssl::context& ssl_context);
 
+// Configures the SSL context from in-memory credentials, used by the benchmark with generated certs
+void configure_ssl_context(boost::asio::ssl::context& ssl_context, const SslCredentials& credentials);
+
+// Enables the host-side session cache and session tickets so returning peers can resume
+void enable_session_resumption(boost::asio::ssl::context& ssl_context);
+
 #endif // CONFIG_H
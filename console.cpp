@@ -0,0 +1,170 @@
+#include "console.h"
+#include "chat_view.h"
+#include "protocol.h"
+#include <cstdio>
+#include <ftxui/dom/elements.hpp>
+#include <ftxui/screen/screen.hpp>
+
+// Escape sequence that clears the current line and returns the cursor to its start
+static const string_view CLEAR_LINE = "\33[2K\r";
+
+// Renders the text in colour on a one line screen
+string render_in_colour(string_view text, uint8_t colour_id) {
+    ftxui::Screen screen(int(text.size()), 1);
+    auto element = ftxui::text(string(text)) | ftxui::color(colour_from_id(colour_id));
+    Render(screen, element);
+    return screen.ToString();
+}
+
+// Appends `name` followed by `suffix` rendered in colour, rendering only on a cache miss
+void PrefixCache::append(string& out, string_view name, string_view suffix, uint8_t colour_id) {
+    key_.assign(1, char(colour_id));
+    key_.append(name).append(1, '\0').append(suffix);
+
+    auto it = entries_.find(key_);
+    if (it == entries_.end()) {
+        // Keep memory bounded, names seen again are simply rendered again
+        if (entries_.size() >= MAX_ENTRIES) {
+            entries_.clear();
+        }
+
+        string plain;
+        plain.reserve(name.size() + suffix.size());
+        plain.append(name).append(suffix);
+        it = entries_.emplace(key_, render_in_colour(plain, colour_id)).first;
+    }
+    out.append(it->second);
+}
+
+// Number of cached renderings
+std::size_t PrefixCache::size() const {
+    return entries_.size();
+}
+
+// Appends a chat message, the name and colon are coloured and the text is not
+void format_message(string& out, PrefixCache& prefixes, string_view name, uint8_t colour_id, string_view body,
+    string_view room) {
+    if (!room.empty()) {
+        out.append(1, '[').append(room).append("] ");
+    }
+    if (!name.empty()) {
+        prefixes.append(out, name, ":", colour_id);
+        out.append(1, ' ');
+    }
+    out.append(body).append(1, '\n');
+}
+
+// Appends the prompt, clearing whatever is on the line
+void format_prompt(string& out, PrefixCache& prefixes, string_view name, uint8_t colour_id) {
+    out.append(CLEAR_LINE);
+    prefixes.append(out, name, "", colour_id);
+    out.append(": ");
+}
+
+// Returns the process-wide console
+Console& Console::instance() {
+    static Console console;
+    return console;
+}
+
+// Clears the prompt before the first line written after it
+void Console::begin_line() {
+    if (prompt_visible_) {
+        buffer_.append(CLEAR_LINE);
+        prompt_visible_ = false;
+    }
+}
+
+// Buffers a chat message
+void Console::write_message(string_view name, uint8_t colour_id, string_view body, string_view room) {
+    if (muted_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (view_) {
+        view_->add_message(name, colour_id, body, room);
+        return;
+    }
+    begin_line();
+    format_message(buffer_, prefixes_, name, colour_id, body, room);
+
+    if (buffer_.size() >= FLUSH_THRESHOLD) {
+        flush_locked();
+    }
+}
+
+// Buffers a plain line
+void Console::write_line(string_view line) {
+    if (muted_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (view_) {
+        view_->add_line(line);
+        return;
+    }
+    begin_line();
+    buffer_.append(line).append(1, '\n');
+
+    if (buffer_.size() >= FLUSH_THRESHOLD) {
+        flush_locked();
+    }
+}
+
+// Writes a plain line and flushes
+void Console::print_line(string_view line) {
+    if (muted_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (view_) {
+        view_->add_line(line);
+        return;
+    }
+    begin_line();
+    buffer_.append(line).append(1, '\n');
+    flush_locked();
+}
+
+// Redraws the prompt and flushes everything buffered in one write
+void Console::print_prompt(string_view name, uint8_t colour_id) {
+    if (muted_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (view_) {
+        view_->set_prompt(name, colour_id);
+        return;
+    }
+    if (prompt_enabled_) {
+        format_prompt(buffer_, prefixes_, name, colour_id);
+        prompt_visible_ = true;
+    }
+    flush_locked();
+}
+
+// Writes out everything buffered
+void Console::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_locked();
+}
+
+// Discards all output while muted
+void Console::set_muted(bool muted) {
+    muted_ = muted;
+}
+
+// Turns the prompt on or off
+void Console::set_prompt_enabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prompt_enabled_ = enabled;
+}
+
+// Switches output to the view or back to stdout, whatever is buffered is written first
+void Console::set_view(ChatView* view) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_locked();
+    prompt_visible_ = false;
+    view_ = view;
+}
+
+// Writes the buffer to stdout, mutex must be held
+void Console::flush_locked() {
+    if (!buffer_.empty()) {
+        std::fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+        buffer_.clear();
+    }
+    std::fflush(stdout);
+}
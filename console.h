@@ -0,0 +1,94 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using std::string;
+using std::string_view;
+
+class ChatView;
+
+// Renders `text` in colour with FTXUI, returning the escape sequences and text to print
+string render_in_colour(string_view text, uint8_t colour_id);
+
+// Bounded cache of names rendered in colour by FTXUI, keyed by (name, colour id)
+class PrefixCache {
+public:
+    // Upper bound on cached entries, the cache is emptied when it fills up
+    static constexpr std::size_t MAX_ENTRIES = 1024;
+
+    // Appends `name` followed by `suffix` rendered in colour to `out`, rendering only on a cache miss
+    void append(string& out, string_view name, string_view suffix, uint8_t colour_id);
+
+    // Number of cached renderings
+    std::size_t size() const;
+
+private:
+    std::unordered_map<string, string> entries_; // Key is the colour id byte, the name, a NUL and the suffix
+    string key_;                                 // Reused lookup key to avoid an allocation per call
+};
+
+// Appends a chat message as it is printed, the room in brackets unless it is the lobby, the name and
+// colon in colour, followed by a newline
+void format_message(string& out, PrefixCache& prefixes, string_view name, uint8_t colour_id, string_view body,
+    string_view room = string_view());
+
+// Appends the prompt for `name`, clearing the line first
+void format_prompt(string& out, PrefixCache& prefixes, string_view name, uint8_t colour_id);
+
+// Single buffered writer for everything printed while chatting. Messages are appended to a buffer
+// and written with one flush when the prompt is redrawn, so a burst of messages costs one flush.
+class Console {
+public:
+    // Buffered output larger than this is flushed even if no prompt is drawn
+    static constexpr std::size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    // Returns the process-wide console
+    static Console& instance();
+
+    // Buffers a chat message with the name rendered in colour, tagged with its room unless it is the lobby
+    void write_message(string_view name, uint8_t colour_id, string_view body, string_view room = string_view());
+
+    // Buffers a plain line
+    void write_line(string_view line);
+
+    // Writes a plain line and flushes, used for status and error messages
+    void print_line(string_view line);
+
+    // Redraws the prompt for the given name and flushes everything buffered
+    void print_prompt(string_view name, uint8_t colour_id);
+
+    // Writes out everything buffered
+    void flush();
+
+    // Discards all output while muted, used by the headless benchmark
+    void set_muted(bool muted);
+
+    // Without a prompt print_prompt only flushes, used when input is piped rather than typed
+    void set_prompt_enabled(bool enabled);
+
+    // Sends everything to the full-screen view instead of stdout while `view` is set, null to go back
+    void set_view(ChatView* view);
+
+private:
+    Console() = default;
+
+    void begin_line(); // Clears the prompt before the first line written after it
+    void flush_locked(); // Writes the buffer to stdout, mutex must be held
+
+    std::mutex mutex_;             // Serialises the IO thread and the input thread
+    string buffer_;                // Pending output
+    PrefixCache prefixes_;         // Rendered coloured names
+    bool prompt_visible_ = false;  // True while the last thing on screen is the prompt
+    bool prompt_enabled_ = true;   // False when input is piped
+    std::atomic<bool> muted_{ false }; // Drops output without formatting it
+    ChatView* view_ = nullptr;     // Full-screen view taking the output, null to print it
+};
+
+#endif // CONSOLE_H
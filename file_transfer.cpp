@@ -0,0 +1,469 @@
+#include "file_transfer.h"
+#include "console.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Block size used when hashing a whole file
+const std::size_t HASH_BLOCK_SIZE = 64 * 1024;
+// Shortest gap between two progress lines for the same transfer
+const std::chrono::seconds PROGRESS_INTERVAL(1);
+// Bytes in front of the data in a chunk body: u32 id, u64 offset
+const std::size_t CHUNK_HEADER_SIZE = 4 + 8;
+
+// Partial files being written by any session. Every session has its own FileTransfers, so without this
+// two transfers of the same file would append to one .part file from different IO threads.
+static std::mutex part_paths_mutex;
+static std::set<string> part_paths_in_use;
+
+// Claims `path` for one transfer, false if another transfer is writing it
+static bool reserve_part_path(const string& path) {
+    std::lock_guard<std::mutex> lock(part_paths_mutex);
+    return part_paths_in_use.insert(path).second;
+}
+
+// Lets another transfer use `path` again
+static void release_part_path(const string& path) {
+    std::lock_guard<std::mutex> lock(part_paths_mutex);
+    part_paths_in_use.erase(path);
+}
+
+// Lower-case hex of a digest
+static string to_hex(const unsigned char* data, unsigned int length) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(length * 2);
+    for (unsigned int i = 0; i < length; ++i) {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0xf]);
+    }
+    return hex;
+}
+
+// Feeds up to `length` bytes of a stream into a digest in fixed-size blocks, returns the bytes read
+static uint64_t hash_stream(std::istream& in, EVP_MD_CTX* hash, uint64_t length) {
+    std::vector<char> block(HASH_BLOCK_SIZE);
+    uint64_t total = 0;
+    while (total < length && in) {
+        in.read(block.data(), std::streamsize(std::min<uint64_t>(block.size(), length - total)));
+        std::streamsize count = in.gcount();
+        if (count <= 0) break;
+        EVP_DigestUpdate(hash, block.data(), std::size_t(count));
+        total += uint64_t(count);
+    }
+    return total;
+}
+
+// Finishes a digest and returns it as hex
+static string finish_hash(EVP_MD_CTX* hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_DigestFinal_ex(hash, digest, &length);
+    return to_hex(digest, length);
+}
+
+// Parses "<id> <number>" from a control frame body
+static bool parse_id_and_number(string_view body, uint32_t& id, uint64_t& number) {
+    std::size_t space = body.find(' ');
+    if (space == string_view::npos) return false;
+    auto first = std::from_chars(body.data(), body.data() + space, id);
+    auto second = std::from_chars(body.data() + space + 1, body.data() + body.size(), number);
+    return first.ec == std::errc() && second.ec == std::errc();
+}
+
+// Human readable byte count
+static string format_bytes(double bytes) {
+    const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        ++unit;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+    return text;
+}
+
+// Hashes a file for sending
+bool prepare_file_offer(const string& path, FileOffer& offer, string& error) {
+    std::error_code ec;
+    if (!fs::is_regular_file(path, ec)) {
+        error = "Not a file: " + path;
+        return false;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "Could not open " + path;
+        return false;
+    }
+
+    offer.path = path;
+    offer.name = fs::path(path).filename().string();
+    offer.size = fs::file_size(path, ec);
+
+    EVP_MD_CTX* hash = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(hash, EVP_sha256(), nullptr);
+    uint64_t hashed = hash_stream(file, hash, offer.size);
+    offer.sha256 = finish_hash(hash);
+    EVP_MD_CTX_free(hash);
+
+    if (hashed != offer.size) {
+        error = "Could not read " + path;
+        return false;
+    }
+    return true;
+}
+
+// Constructor to set how control frames are sent
+FileTransfers::FileTransfers(frame_sender send)
+    : send_(std::move(send)) {}
+
+// Frees any digests still running
+FileTransfers::~FileTransfers() {
+    close();
+}
+
+// Sets the largest file an offer may announce
+void FileTransfers::set_max_incoming_size(uint64_t bytes) {
+    max_incoming_size_ = bytes;
+}
+
+// Queues a control frame
+void FileTransfers::send_control(FrameType type, const string& body, string_view name) {
+    send_(OutboundMessage::create(type, 0, name, body));
+}
+
+// Prints a progress line at most once per PROGRESS_INTERVAL unless forced
+void FileTransfers::print_progress(const char* verb, const string& name, uint64_t done, uint64_t size, Progress& progress, bool force) {
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - progress.printed < PROGRESS_INTERVAL) {
+        return;
+    }
+    progress.printed = now;
+
+    double seconds = std::chrono::duration<double>(now - progress.started).count();
+    std::ostringstream line;
+    line << verb << " " << name << ": " << (size > 0 ? done * 100 / size : 100) << "% of " << format_bytes(double(size));
+    if (seconds > 0) {
+        line << " at " << format_bytes(done / seconds) << "/s";
+    }
+    Console::instance().print_line(line.str());
+}
+
+// Offers a prepared file to the remote peer
+void FileTransfers::offer(const FileOffer& offer) {
+    uint32_t id = next_id_++;
+    Outgoing& outgoing = outgoing_[id];
+    outgoing.offer = offer;
+    send_control(FrameType::file_offer, std::to_string(id) + " " + std::to_string(offer.size) + " " + offer.sha256, offer.name);
+    Console::instance().print_line("Offering " + offer.name + " (" + format_bytes(double(offer.size)) + ")");
+}
+
+// Dispatches a received file_* frame
+void FileTransfers::handle(const MessageView& message) {
+    switch (message.type) {
+    case FrameType::file_offer: handle_offer(message); break;
+    case FrameType::file_accept: handle_accept(message.body); break;
+    case FrameType::file_chunk: handle_chunk(message.body); break;
+    case FrameType::file_ack: handle_ack(message.body); break;
+    case FrameType::file_end: handle_end(message.body); break;
+    case FrameType::file_cancel: handle_cancel(message.body); break;
+    default: break;
+    }
+}
+
+// Starts receiving an offered file, resuming from a matching .part file if there is one
+void FileTransfers::handle_offer(const MessageView& message) {
+    std::istringstream fields{ string(message.body) };
+    uint32_t id = 0;
+    uint64_t size = 0;
+    string sha256;
+    fields >> id >> size >> sha256;
+
+    // Only the final path component is used so a sender cannot write outside the download directory
+    string name = fs::path(string(message.name)).filename().string();
+    if (!fields || sha256.size() != 64 || name.empty() || name == "." || name == "..") {
+        send_control(FrameType::file_end, std::to_string(id) + " failed: bad offer");
+        return;
+    }
+    // The sender numbers its transfers, an id still in use means it is confused. Replacing the transfer
+    // would leak its digest and stream, so it is dropped and the sender told.
+    if (incoming_.count(id) > 0) {
+        fail_incoming(id, "offer id already in use");
+        return;
+    }
+    if (size > max_incoming_size_) {
+        Console::instance().print_line("Refused " + name + " (" + format_bytes(double(size)) + "), the limit is " + format_bytes(double(max_incoming_size_)));
+        send_control(FrameType::file_end, std::to_string(id) + " failed: file is larger than the receiver accepts");
+        return;
+    }
+
+    // The digest prefix keeps partial files of different content apart. The path is reserved before the
+    // file is looked at, so only one transfer at a time resumes or writes it.
+    string part_path = (fs::path(DOWNLOAD_DIRECTORY) / (name + "." + sha256.substr(0, 12) + ".part")).string();
+    if (!reserve_part_path(part_path)) {
+        Console::instance().print_line("Refused " + name + ", it is already being received");
+        send_control(FrameType::file_end, std::to_string(id) + " failed: the file is already being received");
+        return;
+    }
+
+    std::error_code ec;
+    fs::create_directories(DOWNLOAD_DIRECTORY, ec);
+    Incoming& incoming = incoming_[id];
+    incoming.name = name;
+    incoming.size = size;
+    incoming.sha256 = sha256;
+    incoming.part_path = std::move(part_path);
+    incoming.hash = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(incoming.hash, EVP_sha256(), nullptr);
+
+    // Resume after whatever an earlier attempt wrote, rehashing it so the final check covers the whole file
+    uint64_t existing = fs::exists(incoming.part_path, ec) ? fs::file_size(incoming.part_path, ec) : 0;
+    if (ec || existing > size) {
+        existing = 0;
+    }
+    if (existing > 0) {
+        std::ifstream part(incoming.part_path, std::ios::binary);
+        existing = hash_stream(part, incoming.hash, existing);
+        fs::resize_file(incoming.part_path, existing, ec);
+    }
+    incoming.file.open(incoming.part_path, std::ios::binary | (existing > 0 ? std::ios::app : std::ios::trunc));
+    if (!incoming.file) {
+        fail_incoming(id, "could not write " + incoming.part_path);
+        return;
+    }
+    incoming.received = existing;
+    incoming.acked = existing;
+
+    Console::instance().print_line("Receiving " + name + " (" + format_bytes(double(size)) + ")"
+        + (existing > 0 ? ", resuming at " + format_bytes(double(existing)) : string()));
+    send_control(FrameType::file_accept, std::to_string(id) + " " + std::to_string(existing));
+    if (existing == size) {
+        finish_incoming(id);
+    }
+}
+
+// Starts streaming an accepted file from the offset the receiver asked for
+void FileTransfers::handle_accept(string_view body) {
+    uint32_t id = 0;
+    uint64_t offset = 0;
+    auto it = parse_id_and_number(body, id, offset) ? outgoing_.find(id) : outgoing_.end();
+    if (it == outgoing_.end()) {
+        return;
+    }
+
+    Outgoing& outgoing = it->second;
+    outgoing.file.open(outgoing.offer.path, std::ios::binary);
+    outgoing.file.seekg(std::streamoff(offset));
+    if (!outgoing.file || offset > outgoing.offer.size) {
+        Console::instance().print_line("Could not read " + outgoing.offer.path);
+        send_control(FrameType::file_cancel, std::to_string(id) + " failed: sender could not read the file");
+        outgoing_.erase(it);
+        return;
+    }
+    outgoing.sent = offset;
+    outgoing.acked = offset;
+    outgoing.started = true;
+    outgoing.progress = Progress();
+}
+
+// Writes a received chunk, acknowledging every ACK_INTERVAL bytes
+void FileTransfers::handle_chunk(string_view body) {
+    if (body.size() < CHUNK_HEADER_SIZE) {
+        return;
+    }
+    uint32_t id = 0;
+    uint64_t offset = 0;
+    for (std::size_t i = 0; i < 4; ++i) id = (id << 8) | uint8_t(body[i]);
+    for (std::size_t i = 4; i < CHUNK_HEADER_SIZE; ++i) offset = (offset << 8) | uint8_t(body[i]);
+    string_view data = body.substr(CHUNK_HEADER_SIZE);
+
+    auto it = incoming_.find(id);
+    if (it == incoming_.end()) {
+        return;
+    }
+    Incoming& incoming = it->second;
+    // Chunks arrive in order over TLS, anything else means the sender is confused
+    if (offset != incoming.received || incoming.received + data.size() > incoming.size) {
+        fail_incoming(id, "unexpected chunk");
+        return;
+    }
+
+    incoming.file.write(data.data(), std::streamsize(data.size()));
+    if (!incoming.file) {
+        fail_incoming(id, "could not write " + incoming.part_path);
+        return;
+    }
+    EVP_DigestUpdate(incoming.hash, data.data(), data.size());
+    incoming.received += data.size();
+
+    if (incoming.received == incoming.size) {
+        finish_incoming(id);
+    }
+    else if (incoming.received - incoming.acked >= ACK_INTERVAL) {
+        incoming.acked = incoming.received;
+        send_control(FrameType::file_ack, std::to_string(id) + " " + std::to_string(incoming.received));
+        print_progress("Receiving", incoming.name, incoming.received, incoming.size, incoming.progress, false);
+    }
+}
+
+// Opens the sender's window up to the acknowledged offset
+void FileTransfers::handle_ack(string_view body) {
+    uint32_t id = 0;
+    uint64_t offset = 0;
+    auto it = parse_id_and_number(body, id, offset) ? outgoing_.find(id) : outgoing_.end();
+    if (it == outgoing_.end() || offset > it->second.sent) {
+        return;
+    }
+    it->second.acked = offset;
+    print_progress("Sending", it->second.offer.name, offset, it->second.offer.size, it->second.progress, false);
+}
+
+// Reports the receiver's outcome for a file this side sent
+void FileTransfers::handle_end(string_view body) {
+    std::size_t space = body.find(' ');
+    uint32_t id = 0;
+    std::from_chars(body.data(), body.data() + std::min(space, body.size()), id);
+    string_view status = space == string_view::npos ? string_view() : body.substr(space + 1);
+
+    auto it = outgoing_.find(id);
+    if (it == outgoing_.end()) {
+        return;
+    }
+    if (status == "ok") {
+        print_progress("Sent", it->second.offer.name, it->second.offer.size, it->second.offer.size, it->second.progress, true);
+    }
+    else {
+        Console::instance().print_line("Sending " + it->second.offer.name + " " + string(status));
+    }
+    outgoing_.erase(it);
+}
+
+// The sender gave up on a file this side was receiving, the part file is kept for a later resume
+void FileTransfers::handle_cancel(string_view body) {
+    std::size_t space = body.find(' ');
+    uint32_t id = 0;
+    std::from_chars(body.data(), body.data() + std::min(space, body.size()), id);
+    string_view status = space == string_view::npos ? string_view() : body.substr(space + 1);
+
+    auto it = incoming_.find(id);
+    if (it == incoming_.end()) {
+        return;
+    }
+    Console::instance().print_line("Receiving " + it->second.name + " " + string(status));
+    EVP_MD_CTX_free(it->second.hash);
+    incoming_.erase(it);
+}
+
+// Verifies a complete download, moves it next to the other downloads and tells the sender
+void FileTransfers::finish_incoming(uint32_t id) {
+    Incoming& incoming = incoming_[id];
+    incoming.file.close();
+    string digest = finish_hash(incoming.hash);
+    if (digest != incoming.sha256) {
+        // A corrupt part file must not be resumed from
+        std::error_code ec;
+        fs::remove(incoming.part_path, ec);
+        fail_incoming(id, "checksum mismatch");
+        return;
+    }
+
+    // Never overwrite an existing file, add a counter to the name instead. Sessions finishing files of the
+    // same name at once pick their names one at a time.
+    fs::path target = fs::path(DOWNLOAD_DIRECTORY) / incoming.name;
+    std::error_code ec;
+    {
+        std::lock_guard<std::mutex> lock(part_paths_mutex);
+        for (int copy = 1; fs::exists(target, ec); ++copy) {
+            fs::path original(incoming.name);
+            target = fs::path(DOWNLOAD_DIRECTORY) / (original.stem().string() + " (" + std::to_string(copy) + ")" + original.extension().string());
+        }
+        fs::rename(incoming.part_path, target, ec);
+    }
+    if (ec) {
+        fail_incoming(id, "could not rename " + incoming.part_path);
+        return;
+    }
+
+    print_progress("Received", incoming.name, incoming.size, incoming.size, incoming.progress, true);
+    Console::instance().print_line("Saved " + target.string() + " (sha256 " + digest + ")");
+    send_control(FrameType::file_end, std::to_string(id) + " ok");
+    EVP_MD_CTX_free(incoming.hash);
+    release_part_path(incoming.part_path);
+    incoming_.erase(id);
+}
+
+// Drops a download and tells the sender why
+void FileTransfers::fail_incoming(uint32_t id, const string& reason) {
+    auto it = incoming_.find(id);
+    if (it != incoming_.end()) {
+        Console::instance().print_line("Receiving " + it->second.name + " failed: " + reason);
+        EVP_MD_CTX_free(it->second.hash);
+        it->second.file.close();
+        release_part_path(it->second.part_path);
+        incoming_.erase(it);
+    }
+    send_control(FrameType::file_end, std::to_string(id) + " failed: " + reason);
+}
+
+// True if a transfer has data to send and room in its window
+bool FileTransfers::has_chunk_ready() const {
+    for (const auto& [id, outgoing] : outgoing_) {
+        if (outgoing.started && outgoing.sent < outgoing.offer.size && outgoing.sent - outgoing.acked < WINDOW_BYTES) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the next chunk, transfers that may send take turns starting after the last one served
+std::shared_ptr<const OutboundMessage> FileTransfers::next_chunk() {
+    if (outgoing_.empty()) {
+        return nullptr;
+    }
+
+    auto it = outgoing_.upper_bound(last_chunk_id_);
+    for (std::size_t checked = 0; checked < outgoing_.size(); ++checked, ++it) {
+        if (it == outgoing_.end()) {
+            it = outgoing_.begin();
+        }
+        Outgoing& outgoing = it->second;
+        if (outgoing.started && outgoing.sent < outgoing.offer.size && outgoing.sent - outgoing.acked < WINDOW_BYTES) {
+            uint32_t id = it->first;
+            std::size_t length = std::size_t(std::min<uint64_t>(CHUNK_SIZE, outgoing.offer.size - outgoing.sent));
+            chunk_buffer_.resize(CHUNK_HEADER_SIZE + length);
+            for (std::size_t i = 0; i < 4; ++i) chunk_buffer_[i] = char(id >> (8 * (3 - i)));
+            for (std::size_t i = 0; i < 8; ++i) chunk_buffer_[4 + i] = char(outgoing.sent >> (8 * (7 - i)));
+            outgoing.file.read(&chunk_buffer_[CHUNK_HEADER_SIZE], std::streamsize(length));
+            if (outgoing.file.gcount() != std::streamsize(length)) {
+                Console::instance().print_line("Could not read " + outgoing.offer.path);
+                send_control(FrameType::file_cancel, std::to_string(id) + " failed: sender could not read the file");
+                outgoing_.erase(it);
+                return nullptr;
+            }
+
+            outgoing.sent += length;
+            last_chunk_id_ = id;
+            return OutboundMessage::create(FrameType::file_chunk, 0, string_view(), chunk_buffer_);
+        }
+    }
+    return nullptr;
+}
+
+// Abandons every transfer, downloads keep their .part file so offering the file again resumes it
+void FileTransfers::close() {
+    for (auto& [id, incoming] : incoming_) {
+        EVP_MD_CTX_free(incoming.hash);
+        incoming.file.close();
+        release_part_path(incoming.part_path);
+    }
+    incoming_.clear();
+    outgoing_.clear();
+}
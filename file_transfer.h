@@ -0,0 +1,135 @@
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include "protocol.h"
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <openssl/evp.h>
+
+using std::string;
+
+// Received files are written here, partial files keep a .part suffix until verified
+const string DOWNLOAD_DIRECTORY = "downloads";
+// Largest file accepted unless set_max_incoming_size says otherwise, bigger offers are refused
+const uint64_t DEFAULT_MAX_DOWNLOAD = 4ull * 1024 * 1024 * 1024;
+
+// A file ready to be offered, hashed up front so the receiver can verify it and resume
+struct FileOffer {
+    string path;     // Local path the chunks are read from
+    string name;     // File name shown to and saved by the receiver
+    uint64_t size = 0;
+    string sha256;   // Hex digest of the whole file
+};
+
+// Hashes a file for sending, returns false and sets `error` if it cannot be read. Reads the file in
+// small blocks so memory use does not depend on its size.
+bool prepare_file_offer(const string& path, FileOffer& offer, string& error);
+
+// File transfers running over one connection, in both directions. The sender offers a file, the
+// receiver answers with the offset to start from (the size of a matching .part file, so interrupted
+// transfers resume), and the file then streams in CHUNK_SIZE chunks. The receiver acknowledges what it
+// has written and the sender keeps at most WINDOW_BYTES unacknowledged, so neither side buffers more
+// than a window whatever the file size. The receiver checks the SHA-256 of the finished file. A .part
+// file is written by one transfer at a time across every connection, an offer of a file another
+// connection is still receiving is refused.
+//
+// Frames (binary format only, the text fields are separated by spaces):
+//   file_offer   name = file name, body = "<id> <size> <sha256>"
+//   file_accept  body = "<id> <offset>"
+//   file_chunk   body = u32 id, u64 offset (big-endian), data
+//   file_ack     body = "<id> <offset>"
+//   file_end     receiver to sender, body = "<id> ok" or "<id> failed: <reason>"
+//   file_cancel  sender to receiver, body = "<id> failed: <reason>"
+//
+// Every method must be called on the connection's IO thread.
+class FileTransfers {
+public:
+    // Bytes of file data carried by one chunk frame, one TLS record
+    static constexpr std::size_t CHUNK_SIZE = 16 * 1024;
+    // Unacknowledged bytes a sender may have in flight per transfer
+    static constexpr uint64_t WINDOW_BYTES = 256 * 1024;
+    // The receiver acknowledges at least every ACK_INTERVAL bytes
+    static constexpr uint64_t ACK_INTERVAL = 64 * 1024;
+
+    // Queues a control frame on the connection
+    using frame_sender = std::function<void(std::shared_ptr<const OutboundMessage>)>;
+
+    // Constructor to set how control frames are sent
+    explicit FileTransfers(frame_sender send);
+    ~FileTransfers();
+
+    FileTransfers(const FileTransfers&) = delete;
+    FileTransfers& operator=(const FileTransfers&) = delete;
+
+    // Refuses offers of files larger than `bytes`, DEFAULT_MAX_DOWNLOAD unless set
+    void set_max_incoming_size(uint64_t bytes);
+
+    // Offers a prepared file to the remote peer
+    void offer(const FileOffer& offer);
+
+    // Handles a received file_* frame
+    void handle(const MessageView& message);
+
+    // True if a transfer has data to send and room in its window
+    bool has_chunk_ready() const;
+
+    // Reads the next chunk of a transfer that may send, null if none can. Transfers take turns.
+    std::shared_ptr<const OutboundMessage> next_chunk();
+
+    // Abandons every transfer after the connection is lost, partial downloads are kept for resuming
+    void close();
+
+private:
+    // Rate-limited progress line
+    struct Progress {
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point printed = started;
+    };
+
+    struct Outgoing {
+        FileOffer offer;
+        std::ifstream file;
+        uint64_t sent = 0;     // Bytes read into chunks so far
+        uint64_t acked = 0;    // Bytes the receiver has written
+        bool started = false;  // Set once the receiver has accepted
+        Progress progress;
+    };
+
+    struct Incoming {
+        string name;
+        uint64_t size = 0;
+        string sha256;
+        string part_path;
+        std::ofstream file;
+        uint64_t received = 0;  // Bytes written to the .part file
+        uint64_t acked = 0;     // Bytes acknowledged to the sender
+        EVP_MD_CTX* hash = nullptr;
+        Progress progress;
+    };
+
+    void handle_offer(const MessageView& message);
+    void handle_accept(string_view body);
+    void handle_chunk(string_view body);
+    void handle_ack(string_view body);
+    void handle_end(string_view body);
+    void handle_cancel(string_view body);
+    void finish_incoming(uint32_t id); // Verifies a complete download and moves it into place
+    void fail_incoming(uint32_t id, const string& reason); // Drops a download and tells the sender
+    void send_control(FrameType type, const string& body, string_view name = string_view());
+    static void print_progress(const char* verb, const string& name, uint64_t done, uint64_t size, Progress& progress, bool force);
+
+    frame_sender send_;
+    uint32_t next_id_ = 1;                   // Id of the next file offered
+    uint32_t last_chunk_id_ = 0;             // Transfer that sent the last chunk, for round robin
+    uint64_t max_incoming_size_ = DEFAULT_MAX_DOWNLOAD; // Largest file accepted
+    std::map<uint32_t, Outgoing> outgoing_;  // Files being sent, by id
+    std::map<uint32_t, Incoming> incoming_;  // Files being received, by the sender's id
+    string chunk_buffer_;                    // Reused read buffer
+};
+
+#endif // FILE_TRANSFER_H
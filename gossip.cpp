@@ -0,0 +1,37 @@
+#include "gossip.h"
+#include <random>
+
+// Constructor to set how many ids are remembered
+RecentMessageIds::RecentMessageIds(std::size_t capacity)
+    : capacity_(capacity) {
+    ids_.reserve(capacity);
+    order_.reserve(capacity);
+}
+
+// Records an id, evicting the oldest once full, returns false if it was already present
+bool RecentMessageIds::insert(const MessageId& id) {
+    if (!ids_.insert(id).second) {
+        return false;
+    }
+
+    if (order_.size() < capacity_) {
+        order_.push_back(id);
+    }
+    else {
+        ids_.erase(order_[next_]);
+        order_[next_] = id;
+        next_ = (next_ + 1) % capacity_;
+    }
+    return true;
+}
+
+// Number of ids currently remembered
+std::size_t RecentMessageIds::size() const {
+    return ids_.size();
+}
+
+// Random id for a node, 64 bits keeps collisions between nodes negligible
+uint64_t random_node_id() {
+    std::random_device device;
+    return (uint64_t(device()) << 32) ^ device();
+}
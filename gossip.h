@@ -0,0 +1,43 @@
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include "buffer_pool.h"
+#include "protocol.h"
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Hash for message ids, origins are random so mixing in the sequence is enough
+struct MessageIdHash {
+    std::size_t operator()(const MessageId& id) const {
+        return std::size_t(id.origin ^ (id.sequence * 0x9E3779B97F4A7C15ull));
+    }
+};
+
+// Remembers the most recent message ids seen by a node so a message arriving again over another
+// link is recognised. The oldest id is forgotten once `capacity` ids are held, which only matters
+// if a duplicate is delayed by more than `capacity` newer messages.
+class RecentMessageIds {
+public:
+    // Constructor to set how many ids are remembered
+    explicit RecentMessageIds(std::size_t capacity);
+
+    // Records an id, returns false if it was already present
+    bool insert(const MessageId& id);
+
+    // Number of ids currently remembered
+    std::size_t size() const;
+
+private:
+    // Lookup set, nodes come from the pool since one is created and one evicted per message
+    std::unordered_set<MessageId, MessageIdHash, std::equal_to<MessageId>, PoolAllocator<MessageId>> ids_;
+    std::vector<MessageId> order_;                     // Ring of ids in arrival order, used for eviction
+    std::size_t next_ = 0;                             // Slot in order_ to overwrite next once full
+    std::size_t capacity_;
+};
+
+// Random id for a node, messages entering the mesh at the node are numbered under it
+uint64_t random_node_id();
+
+#endif // GOSSIP_H
@@ -0,0 +1,467 @@
+#include "host.h"
+#include "console.h"
+#include "metrics.h"
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+
+// Counters that only grow, a closed session's values are kept for session_total
+static std::atomic<uint64_t> PeerStats::* const CUMULATIVE_COUNTERS[] = {
+    &PeerStats::messages_in, &PeerStats::messages_out, &PeerStats::bytes_in, &PeerStats::bytes_out, &PeerStats::errors,
+    &PeerStats::watermark_crossings, &PeerStats::dropped_messages, &PeerStats::slow_disconnects,
+};
+
+// Constructor to open the listening socket and store the host user's name and colour
+Host::Host(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const tcp::endpoint& endpoint, const string& user_name, Color user_colour)
+    : io_(io), ssl_context_(ssl_context), acceptor_(io, endpoint), name_(user_name), colour_(user_colour), session_count_(0),
+    node_id_(random_node_id()), recent_ids_(RECENT_MESSAGE_IDS) {}
+
+// Starts the accept loop
+void Host::start() {
+    do_accept();
+}
+
+// Sets the log shared by every session, each session appends what it receives and answers history requests
+void Host::set_message_log(MessageLog* log) {
+    message_log_ = log;
+}
+
+// Sets the capture every session records its traffic to
+void Host::set_capture(CaptureWriter* capture) {
+    capture_ = capture;
+}
+
+// Sets the pool sessions are placed on
+void Host::set_io_pool(IoContextPool* pool) {
+    io_pool_ = pool;
+}
+
+// Sets the limits each session is given when it is registered
+void Host::set_backpressure(const BackpressureLimits& limits) {
+    limits_ = limits;
+}
+
+// Sets the keepalive timing each session is given when it is registered
+void Host::set_heartbeat(const HeartbeatSettings& heartbeat) {
+    heartbeat_ = heartbeat;
+}
+
+// Sets whether sessions try kernel TLS
+void Host::set_ktls(bool enabled) {
+    ktls_ = enabled;
+}
+
+// Sets the largest file accepted from a session
+void Host::set_max_download(uint64_t bytes) {
+    max_download_ = bytes;
+}
+
+// Sets the callback pausing the host user's input
+void Host::set_input_pause_handler(std::function<void(bool)> handler) {
+    on_input_pause_ = std::move(handler);
+}
+
+// Accepts the next connection, starts its handshake and re-arms the accept
+void Host::do_accept() {
+    auto peer = std::make_shared<Peer>(io_pool_ ? io_pool_->next() : io_, ssl_context_, name_, colour_);
+
+    acceptor_.async_accept(peer->socket().lowest_layer(), [this, peer](boost::system::error_code ec) {
+        if (!ec) {
+            Console::instance().print_line("Host: Connection established.");
+            peer->set_remote_label();
+
+            // Register the session before the handshake so shutdown can reach it
+            add_session(peer);
+
+            // Start the SSL handshake in server mode, on the session's own IO thread
+            boost::asio::dispatch(peer->get_executor(), [peer]() {
+                peer->start_handshake(boost::asio::ssl::stream_base::server);
+                });
+        }
+        else if (ec == boost::asio::error::operation_aborted) {
+            // The acceptor was closed during shutdown
+            return;
+        }
+        else {
+            Console::instance().print_line("Host: Error in accepting connection: " + ec.message());
+        }
+
+        // Keep accepting so further peers can join
+        do_accept();
+        });
+}
+
+// Opens a link to another node, the other node sees it as an accepted session
+void Host::connect_to(const tcp::endpoint& endpoint) {
+    auto peer = std::make_shared<Peer>(io_pool_ ? io_pool_->next() : io_, ssl_context_, name_, colour_);
+
+    peer->socket().lowest_layer().async_connect(endpoint, [this, peer, endpoint](boost::system::error_code ec) {
+        string address = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+        if (ec) {
+            Console::instance().print_line("Host: Could not connect to " + address + ": " + ec.message());
+            return;
+        }
+
+        Console::instance().print_line("Host: Linked to " + address + ".");
+        peer->set_remote_label();
+        add_session(peer);
+        // Links carry every room both ways: subscribe it here and ask the other node to do the same
+        handle_room(peer, true, ALL_ROOMS);
+        peer->join_room(string(ALL_ROOMS));
+        // This node is the TLS client on links it opens
+        peer->start_handshake(boost::asio::ssl::stream_base::client);
+        });
+}
+
+// Registers a connected peer with the relay, log and close handlers
+void Host::add_session(const std::shared_ptr<Peer>& peer) {
+    peer->set_message_handler([this](const std::shared_ptr<Peer>& from, const MessageView& message) {
+        return accept_message(from, message);
+        });
+    peer->set_close_handler([this](const std::shared_ptr<Peer>& closed) {
+        remove(closed);
+        });
+    peer->set_pressure_handler([this](const std::shared_ptr<Peer>& congested_peer, bool congested) {
+        handle_pressure(congested_peer, congested);
+        });
+    peer->set_room_handler([this](const std::shared_ptr<Peer>& member, bool join, std::string_view room) {
+        handle_room(member, join, room);
+        });
+    peer->set_backpressure(limits_);
+    peer->set_heartbeat(heartbeat_);
+    peer->set_ktls(ktls_);
+    peer->set_max_download(max_download_);
+    peer->set_message_log(message_log_);
+    if (capture_) {
+        peer->set_capture(capture_);
+    }
+    std::unique_lock<std::shared_mutex> lock(sessions_mutex_);
+    // A session joining while input is paused waits with the others
+    if (input_paused_) {
+        peer->pause_reading();
+    }
+    sessions_.insert(peer);
+    rooms_[string(LOBBY)].subscribers.insert(peer);
+    session_count_ = sessions_.size();
+}
+
+// Adds a session to a room's subscribers or removes it, a room is created by its first subscriber and
+// removed with its last
+void Host::handle_room(const std::shared_ptr<Peer>& peer, bool join, std::string_view room) {
+    if (room != ALL_ROOMS && !is_valid_room_name(room)) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> lock(sessions_mutex_);
+    // The session may have closed while the request was in flight
+    if (!sessions_.count(peer)) {
+        return;
+    }
+    auto it = rooms_.find(room);
+    if (join) {
+        if (it == rooms_.end()) {
+            if (rooms_.size() >= MAX_ROOMS) {
+                Console::instance().print_line("Host: Refused to open room " + string(room) + ", " + std::to_string(MAX_ROOMS) + " rooms are open.");
+                return;
+            }
+            it = rooms_.try_emplace(string(room)).first;
+        }
+        it->second.subscribers.insert(peer);
+    }
+    else if (it != rooms_.end() && it->second.subscribers.erase(peer) && it->second.subscribers.empty()) {
+        rooms_.erase(it);
+    }
+}
+
+// Under pause_input the host stops reading from every session while any session is congested, so
+// nothing new is relayed until the slow peers catch up. Congested sessions keep reading, they are
+// draining and the acknowledgements they send may be what lets them drain.
+void Host::handle_pressure(const std::shared_ptr<Peer>& peer, bool congested) {
+    if (limits_.policy != SlowConsumerPolicy::pause_input) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> lock(sessions_mutex_);
+    if (congested) {
+        congested_.insert(peer);
+        if (input_paused_) {
+            peer->resume_reading();
+        }
+        else {
+            set_input_paused(true);
+        }
+    }
+    else {
+        congested_.erase(peer);
+        if (input_paused_ && congested_.empty()) {
+            set_input_paused(false);
+        }
+        else if (input_paused_) {
+            peer->pause_reading();
+        }
+    }
+}
+
+// Pauses or resumes reading on every session that is not congested
+void Host::set_input_paused(bool paused) {
+    input_paused_ = paused;
+    if (paused) {
+        PeerStats::add(Metrics::global().input_pauses, 1);
+        Console::instance().print_line("Host: Pausing input until " + std::to_string(congested_.size()) + " slow peer(s) catch up.");
+    }
+    else {
+        Console::instance().print_line("Host: Resuming input.");
+    }
+    if (on_input_pause_) {
+        on_input_pause_(paused);
+    }
+    for (const auto& session : sessions_) {
+        if (!paused) {
+            session->resume_reading();
+        }
+        else if (!congested_.count(session)) {
+            session->pause_reading();
+        }
+    }
+}
+
+// Numbers a message entering the mesh at this node
+MessageId Host::next_message_id() {
+    return MessageId{ node_id_, next_sequence_.fetch_add(1, std::memory_order_relaxed) };
+}
+
+// Relays a received message unless this node has already relayed it, returns false for a duplicate or an oversized body
+bool Host::accept_message(const std::shared_ptr<Peer>& from, const MessageView& message) {
+    // Chat from a plain client enters the mesh here, gossip keeps the id given where it entered
+    bool entering = message.type != FrameType::gossip;
+    // A body that would not fit a gossip frame cannot be relayed without breaking the links it crosses, drop it
+    if (message.body.size() > MAX_MESSAGE_BODY) {
+        return false;
+    }
+    MessageId id = entering ? next_message_id() : message.id;
+    bool duplicate;
+    {
+        std::lock_guard<std::mutex> lock(ids_mutex_);
+        duplicate = !recent_ids_.insert(id);
+    }
+    if (duplicate) {
+        PeerStats::add(Metrics::global().mesh_duplicates, 1);
+        return false;
+    }
+    PeerStats::add(Metrics::global().mesh_messages, 1);
+
+    // Forward with one hop less, a message that has used up its hops is delivered here only
+    uint8_t hops = entering ? MAX_HOPS : message.hops;
+    if (hops > 0) {
+        // Copy the message out of the receive buffer once, every recipient shares it
+        relay(from, OutboundMessage::create(FrameType::gossip, message.colour_id, message.name, message.body, id, uint8_t(hops - 1), message.room));
+    }
+    return true;
+}
+
+// Sends the host user's message to every connected peer, encoded once per wire format and shared
+void Host::broadcast(const string& message) {
+    broadcast(std::vector<string>{ message });
+}
+
+// Logs the messages with one flush and relays them in order
+void Host::broadcast(std::vector<string> messages) {
+    std::erase_if(messages, [](const string& message) {
+        if (message.size() <= MAX_MESSAGE_BODY) {
+            return false;
+        }
+        Console::instance().print_line(oversized_message_error(message.size()));
+        return true;
+        });
+    if (message_log_) {
+        for (const string& message : messages) {
+            message_log_->append(colour_to_id(colour_), name_, message);
+        }
+        message_log_->flush();
+    }
+    // Number the messages on the IO thread, which keeps successive batches in order
+    boost::asio::post(io_, [this, messages = std::move(messages)]() {
+        for (const string& message : messages) {
+            MessageId id = next_message_id();
+            {
+                std::lock_guard<std::mutex> lock(ids_mutex_);
+                recent_ids_.insert(id);
+            }
+            PeerStats::add(Metrics::global().mesh_messages, 1);
+            relay(nullptr, OutboundMessage::create(FrameType::gossip, colour_to_id(colour_), name_, message, id, uint8_t(MAX_HOPS - 1), room_));
+        }
+        });
+}
+
+// Switches the room the host user's messages go to, on the IO thread so it takes effect between batches
+void Host::join_room(const string& room) {
+    boost::asio::post(io_, [this, room]() {
+        room_ = room;
+        Console::instance().print_line(room.empty() ? string("Host: Talking in the lobby.") : "Host: Talking in [" + room + "].");
+        });
+}
+
+// Returns the host user to the lobby if they are talking in `room`, or in any room if it is empty
+void Host::leave_room(const string& room) {
+    boost::asio::post(io_, [this, room]() {
+        if (room.empty() || room == room_) {
+            room_.clear();
+            Console::instance().print_line("Host: Talking in the lobby.");
+        }
+        });
+}
+
+// Offers a file to every session, each session streams it from its own file handle
+void Host::send_file(const FileOffer& offer) {
+    boost::asio::post(io_, [this, offer]() {
+        std::shared_lock<std::shared_mutex> lock(sessions_mutex_);
+        if (sessions_.empty()) {
+            Console::instance().print_line("Error: No peers connected.");
+        }
+        for (const auto& session : sessions_) {
+            session->send_file(offer);
+        }
+        });
+}
+
+// Fans a message out to the subscribers of its room and to the mesh links, except the session it came
+// from. The work follows the number of subscribers, not of sessions. Delivering only posts to each
+// session's IO thread, so the shared lock is held briefly.
+void Host::relay(const std::shared_ptr<Peer>& from, const std::shared_ptr<const OutboundMessage>& message) {
+    std::shared_lock<std::shared_mutex> lock(sessions_mutex_);
+    uint64_t delivered = 0;
+    auto room = rooms_.find(message->room());
+    if (room != rooms_.end()) {
+        for (const auto& session : room->second.subscribers) {
+            if (session != from) {
+                session->deliver(message);
+                ++delivered;
+            }
+        }
+    }
+    // A link that also joined the room by name already has the message
+    auto links = rooms_.find(ALL_ROOMS);
+    if (links != rooms_.end() && links != room) {
+        for (const auto& session : links->second.subscribers) {
+            if (session != from && (room == rooms_.end() || !room->second.subscribers.count(session))) {
+                session->deliver(message);
+                ++delivered;
+            }
+        }
+    }
+    if (room != rooms_.end()) {
+        room->second.messages.record();
+        room->second.deliveries.record(delivered);
+    }
+}
+
+// Drops a session from the registry once its connection has closed
+void Host::remove(const std::shared_ptr<Peer>& peer) {
+    std::unique_lock<std::shared_mutex> lock(sessions_mutex_);
+    if (sessions_.erase(peer)) {
+        // Keep what the session counted so session_total does not go backwards
+        for (auto counter : CUMULATIVE_COUNTERS) {
+            closed_stats_.*counter += peer->stats().*counter;
+        }
+    }
+    session_count_ = sessions_.size();
+    for (auto it = rooms_.begin(); it != rooms_.end();) {
+        if (it->second.subscribers.erase(peer) && it->second.subscribers.empty()) {
+            it = rooms_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    // A slow peer that disconnects no longer holds up the others
+    if (congested_.erase(peer) && input_paused_ && congested_.empty()) {
+        set_input_paused(false);
+    }
+}
+
+// Stops accepting and closes every session on its own IO thread, waiting so the threads can be stopped next
+void Host::shutdown() {
+    boost::asio::post(io_, boost::asio::use_future([this]() {
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        })).wait();
+
+    // Take the sessions first as closing a session calls back into remove()
+    std::unordered_set<std::shared_ptr<Peer>> sessions;
+    {
+        std::unique_lock<std::shared_mutex> lock(sessions_mutex_);
+        sessions.swap(sessions_);
+        rooms_.clear();
+        congested_.clear();
+        session_count_ = 0;
+    }
+    std::vector<std::future<void>> closed;
+    for (const auto& session : sessions) {
+        closed.push_back(boost::asio::post(session->get_executor(), boost::asio::use_future([session]() {
+            session->shutdown();
+            })));
+    }
+    for (auto& done : closed) {
+        done.wait();
+    }
+}
+
+// Clears the line and displays a prompt with the host user's name
+void Host::display_prompt() const {
+    Console::instance().print_prompt(name_, colour_to_id(colour_));
+}
+
+// Number of sessions currently registered
+std::size_t Host::session_count() const {
+    return session_count_;
+}
+
+// Adds up a counter across the sessions under the lock, so a session is never counted twice or missed
+uint64_t Host::session_total(std::atomic<uint64_t> PeerStats::* counter) const {
+    std::shared_lock<std::shared_mutex> lock(sessions_mutex_);
+    uint64_t total = 0;
+    for (const auto& session : sessions_) {
+        total += session->stats().*counter;
+    }
+    if (std::find(std::begin(CUMULATIVE_COUNTERS), std::end(CUMULATIVE_COUNTERS), counter) != std::end(CUMULATIVE_COUNTERS)) {
+        total += closed_stats_.*counter;
+    }
+    return total;
+}
+
+// Totals plus per-session counters for the /stats command
+string Host::stats_report() const {
+    std::shared_lock<std::shared_mutex> lock(sessions_mutex_);
+    std::ostringstream out;
+    out << Metrics::global().report() << "\nsessions registered: " << sessions_.size() << ", rooms: " << rooms_.size();
+
+    // Busiest rooms first, each rate is read once rather than on every comparison
+    std::vector<std::pair<double, const std::pair<const string, Room>*>> ranked;
+    ranked.reserve(rooms_.size());
+    for (const auto& entry : rooms_) {
+        ranked.emplace_back(entry.second.messages.per_second(), &entry);
+    }
+    std::size_t reported = std::min(ranked.size(), MAX_REPORTED_ROOMS);
+    std::partial_sort(ranked.begin(), ranked.begin() + reported, ranked.end(), [](const auto& a, const auto& b) {
+        return a.first > b.first;
+        });
+    for (std::size_t i = 0; i < reported; ++i) {
+        const auto& [name, room] = *ranked[i].second;
+        string label = name == LOBBY ? string("lobby") : name == ALL_ROOMS ? string("mesh links") : "[" + name + "]";
+        out << "\nroom " << label << ": " << room.subscribers.size() << " subscribers"
+            << " | messages " << room.messages.total() << " (" << ranked[i].first << "/s)"
+            << " | deliveries " << room.deliveries.total() << " (" << room.deliveries.per_second() << "/s)";
+    }
+    if (ranked.size() > reported) {
+        out << "\n... " << (ranked.size() - reported) << " more rooms";
+    }
+
+    std::size_t listed = 0;
+    for (const auto& session : sessions_) {
+        if (listed++ == MAX_REPORTED_SESSIONS) {
+            out << "\n... " << (sessions_.size() - MAX_REPORTED_SESSIONS) << " more";
+            break;
+        }
+        // The socket belongs to the session's IO thread, only the label saved when it connected is read
+        out << "\n" << session->stats().report(session->remote_label());
+    }
+    return out.str();
+}
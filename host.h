@@ -0,0 +1,162 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "gossip.h"
+#include "io_pool.h"
+#include "peer.h"
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/use_future.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <ftxui/screen/color.hpp>
+
+using boost::asio::ip::tcp;
+using std::string;
+using namespace ftxui;
+
+// A mesh node: accepts any number of peers, opens links to other nodes and relays each message to every
+// other connected session. Messages are numbered when they enter the mesh, every node drops copies it has
+// already relayed and a hop limit bounds how far a message can travel, so each link carries it at most once.
+// Every session starts in the lobby and can join named rooms. A message tagged with a room goes only to
+// that room's subscribers, found through a room -> subscriber index, plus the mesh links, which join
+// ALL_ROOMS. The host user sees every room.
+// Sessions can be spread over the contexts of an IoContextPool so they are handled on several cores. Each
+// session stays on one context, the accept loop and the host user's messages run on the host's own, and
+// the state shared between sessions is guarded by mutexes.
+class Host {
+public:
+    // Constructor to open the listening socket and store the host user's name and colour
+    Host(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const tcp::endpoint& endpoint, const string& user_name, Color user_colour);
+
+    // Starts the accept loop, new peers keep being accepted until shutdown
+    void start();
+
+    // Opens a link to another node, messages are relayed over it like any accepted session
+    void connect_to(const tcp::endpoint& endpoint);
+
+    // Logs every relayed message to `log` so joining peers can ask for the history, call before start()
+    void set_message_log(MessageLog* log);
+
+    // Records the traffic of every session to `capture`, call before start()
+    void set_capture(CaptureWriter* capture);
+
+    // Places new sessions on the contexts of `pool` in turn instead of the host's own, call before start()
+    void set_io_pool(IoContextPool* pool);
+
+    // Sets the outbound queue limits and slow consumer policy of every session, call before start()
+    void set_backpressure(const BackpressureLimits& limits);
+
+    // Sets the ping interval and dead peer timeout of every session, call before start()
+    void set_heartbeat(const HeartbeatSettings& heartbeat);
+
+    // Hands every session's record encryption to the kernel where it can, the SSL context must have had
+    // enable_ktls called on it. Call before start().
+    void set_ktls(bool enabled);
+
+    // Refuses files larger than `bytes` offered by any session, call before start()
+    void set_max_download(uint64_t bytes);
+
+    // Called on an IO thread when the pause_input policy pauses (true) and resumes (false) input, so the
+    // host user's own input can wait along with the sessions. Call before start().
+    void set_input_pause_handler(std::function<void(bool paused)> handler);
+
+    // Sends a message typed by the host user to every connected peer
+    void broadcast(const string& message);
+
+    // Sends several messages in order with one hand-off to the IO thread, used for piped input
+    void broadcast(std::vector<string> messages);
+
+    // Sends the host user's later messages to `room`, or back to the lobby if the host user leaves it or
+    // `room` is empty. The host user sees every room either way.
+    void join_room(const string& room);
+    void leave_room(const string& room);
+
+    // Streams a prepared file to every connected peer
+    void send_file(const FileOffer& offer);
+
+    // Stops accepting and closes every session, waiting for their IO threads. Must not be called on one.
+    void shutdown();
+
+    // Clears the line and displays a prompt with the host user's name
+    void display_prompt() const;
+
+    // Number of sessions currently registered
+    std::size_t session_count() const;
+
+    // Sum of a session counter over the registered sessions and, for counters that only grow, the
+    // sessions closed since start. Gauges such as queue_bytes cover the registered sessions. Any thread.
+    uint64_t session_total(std::atomic<uint64_t> PeerStats::* counter) const;
+
+    // Totals plus per-session counters for the /stats command, any thread
+    string stats_report() const;
+
+private:
+    // Sessions listed individually by stats_report before it summarises the rest
+    static constexpr std::size_t MAX_REPORTED_SESSIONS = 16;
+    // Message ids remembered for duplicate detection
+    static constexpr std::size_t RECENT_MESSAGE_IDS = 64 * 1024;
+    // Rooms that may exist at once, joins creating more are refused
+    static constexpr std::size_t MAX_ROOMS = 4096;
+    // Rooms listed by stats_report, busiest first
+    static constexpr std::size_t MAX_REPORTED_ROOMS = 16;
+
+    // Sessions subscribed to a room and the rate of its traffic
+    struct Room {
+        std::unordered_set<std::shared_ptr<Peer>> subscribers;
+        RateMeter messages;    // Messages sent to the room
+        RateMeter deliveries;  // Copies delivered to its subscribers and the mesh links
+    };
+
+    // Lets rooms be looked up by the view into a received frame without building a string
+    struct RoomHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view room) const { return std::hash<std::string_view>()(room); }
+    };
+
+    void do_accept(); // Accepts the next connection and re-arms itself
+    void add_session(const std::shared_ptr<Peer>& peer); // Registers a connected peer and its handlers
+    bool accept_message(const std::shared_ptr<Peer>& from, const MessageView& message); // Dedupes and relays a received message
+    MessageId next_message_id(); // Numbers a message entering the mesh at this node
+    void relay(const std::shared_ptr<Peer>& from, const std::shared_ptr<const OutboundMessage>& message); // Fans a message out to the subscribers of its room
+    void handle_room(const std::shared_ptr<Peer>& peer, bool join, std::string_view room); // Subscribes or unsubscribes a session
+    void remove(const std::shared_ptr<Peer>& peer); // Drops a session from the registry
+    void handle_pressure(const std::shared_ptr<Peer>& peer, bool congested); // Pauses or resumes input for the pause_input policy
+    void set_input_paused(bool paused); // Pauses or resumes reading on every session that is not congested, sessions_mutex_ held
+
+    boost::asio::io_context& io_;                   // Host's own IO context, also used by sessions without a pool
+    boost::asio::ssl::context& ssl_context_;        // SSL context used for every accepted session
+    IoContextPool* io_pool_ = nullptr;              // Contexts new sessions are spread over, may be null
+    tcp::acceptor acceptor_;                        // Listening socket
+    string name_;                                   // Username of the host user
+    Color colour_;                                  // Colour of the host user
+    mutable std::shared_mutex sessions_mutex_;      // Guards sessions_, rooms_, congested_ and input_paused_, relaying takes it shared
+    std::unordered_set<std::shared_ptr<Peer>> sessions_; // Live sessions
+    std::unordered_map<string, Room, RoomHash, std::equal_to<>> rooms_; // Room -> subscribers, rooms without any are removed
+    string room_;                                   // Room the host user's messages go to, host IO thread only
+    MessageLog* message_log_ = nullptr;             // Chat history shared by every session, may be null
+    CaptureWriter* capture_ = nullptr;              // Traffic capture shared by every session, may be null
+    std::atomic<std::size_t> session_count_;        // Mirror of sessions_.size() readable without the lock
+    PeerStats closed_stats_;                        // Growing counters of sessions that have been removed, sessions_mutex_ held
+    uint64_t node_id_;                              // Origin of messages entering the mesh here
+    std::atomic<uint64_t> next_sequence_{ 0 };      // Sequence of the next message entering here
+    std::mutex ids_mutex_;                          // Guards recent_ids_
+    RecentMessageIds recent_ids_;                   // Messages already relayed
+    BackpressureLimits limits_;                     // Queue limits applied to every session
+    HeartbeatSettings heartbeat_;                   // Keepalive timing applied to every session
+    bool ktls_ = false;                             // Sessions try kernel TLS
+    uint64_t max_download_ = DEFAULT_MAX_DOWNLOAD;  // Largest file a session may be sent
+    std::unordered_set<std::shared_ptr<Peer>> congested_; // Sessions above their high watermark
+    bool input_paused_ = false;                     // Reading is paused on uncongested sessions
+    std::function<void(bool)> on_input_pause_;      // Pauses the host user's input, may be empty
+};
+
+#endif // HOST_H
@@ -0,0 +1,273 @@
+#include "input.h"
+#include "protocol.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+const std::size_t InputReader::MAX_LINE_LENGTH = MAX_MESSAGE_BODY;
+
+// Constructor to set the IO context reads run on, nothing is read until start()
+InputReader::InputReader(boost::asio::io_context& io)
+    : io_(io), queue_(std::make_shared<Queue>())
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    , input_(io), buffer_(READ_SIZE)
+#endif
+{}
+
+// Stops reading, the fallback thread is left blocked in getline and ends with the process
+InputReader::~InputReader() {
+#if !defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    if (thread_.joinable()) {
+        thread_.detach();
+    }
+#endif
+}
+
+// True if standard input is a terminal
+bool InputReader::is_terminal() {
+#ifdef _WIN32
+    return _isatty(_fileno(stdin)) != 0;
+#else
+    return isatty(STDIN_FILENO) != 0;
+#endif
+}
+
+// Splits `data` into lines, returns false if reading should wait
+bool InputReader::add_input(Queue& queue, string& partial, const char* data, std::size_t size) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    std::size_t added = 0;
+    const char* end = data + size;
+    while (data != end) {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', std::size_t(end - data)));
+        if (!newline) {
+            partial.append(data, end);
+            added += split_long_line(queue, partial);
+            break;
+        }
+        partial.append(data, newline);
+        // Accept files with Windows line endings
+        if (!partial.empty() && partial.back() == '\r') {
+            partial.pop_back();
+        }
+        added += split_long_line(queue, partial);
+        queue.lines.push_back(std::move(partial));
+        partial.clear();
+        ++added;
+        data = newline + 1;
+    }
+
+    if (added > 0) {
+        queue.changed.notify_all();
+    }
+    queue.read_waiting = queue.paused || queue.lines.size() >= MAX_QUEUED_LINES;
+    return !queue.read_waiting;
+}
+
+// Splits at a UTF-8 character boundary where there is one, so a multi-byte character is not cut in half
+std::size_t InputReader::split_long_line(Queue& queue, string& line) {
+    std::size_t pieces = 0;
+    std::size_t start = 0;
+    while (line.size() - start > MAX_LINE_LENGTH) {
+        std::size_t cut = start + MAX_LINE_LENGTH;
+        // Step back over continuation bytes (10xxxxxx) to the lead byte of the character
+        while (cut > start && (static_cast<unsigned char>(line[cut]) & 0xC0) == 0x80) {
+            --cut;
+        }
+        if (cut == start) {
+            cut = start + MAX_LINE_LENGTH;
+        }
+        queue.lines.emplace_back(line, start, cut - start);
+        start = cut;
+        ++pieces;
+    }
+    line.erase(0, start);
+    return pieces;
+}
+
+// Queues the last line even without a newline and marks the end of input
+void InputReader::finish(Queue& queue, string& partial) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!partial.empty()) {
+        queue.lines.push_back(std::move(partial));
+        partial.clear();
+    }
+    queue.ended = true;
+    queue.changed.notify_all();
+}
+
+// Leaves standard input to the full-screen view
+void InputReader::use_typed_input() {
+    typed_input_ = true;
+}
+
+// Queues a typed line, typing is too slow to need the MAX_QUEUED_LINES bound
+void InputReader::submit(string line) {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    if (queue_->ended) {
+        return;
+    }
+    split_long_line(*queue_, line);
+    queue_->lines.push_back(std::move(line));
+    queue_->changed.notify_all();
+}
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+
+// Opens standard input for asynchronous reads on the IO thread
+void InputReader::start() {
+    if (typed_input_) {
+        return;
+    }
+    // A terminal is opened again rather than duplicated: non-blocking mode belongs to the open file,
+    // and standard output usually shares it, so writes to the terminal would become non-blocking too
+    int fd = -1;
+    if (is_terminal()) {
+        if (const char* path = ttyname(STDIN_FILENO)) {
+            fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+    if (fd < 0) {
+        fd = ::dup(STDIN_FILENO);
+    }
+
+    boost::system::error_code ec;
+    if (fd >= 0) {
+        input_.assign(fd, ec);
+    }
+    if (fd < 0 || ec) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        std::cerr << "Could not read standard input." << std::endl;
+        finish(*queue_, partial_);
+        return;
+    }
+    boost::asio::post(io_, [this]() {
+        read_more();
+        });
+}
+
+// Reads the next chunk, pausing while the queue is full
+void InputReader::read_more() {
+    input_.async_read_some(boost::asio::buffer(buffer_), [this](boost::system::error_code ec, std::size_t length) {
+        // Closed by stop(), the reader may already be gone
+        if (ec == boost::asio::error::operation_aborted) {
+            return;
+        }
+        if (ec) {
+            // End of input or a read error
+            finish(*queue_, partial_);
+            return;
+        }
+        if (add_input(*queue_, partial_, buffer_.data(), length)) {
+            read_more();
+        }
+        });
+}
+
+// Closes the descriptor on the IO thread and waits, the pending read is cancelled
+void InputReader::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queue_->mutex);
+        queue_->ended = true;
+        queue_->read_waiting = false;
+    }
+    queue_->changed.notify_all();
+    boost::asio::post(io_, boost::asio::use_future([this]() {
+        boost::system::error_code ec;
+        input_.close(ec);
+        })).wait();
+}
+
+// Holds back the next read
+void InputReader::pause() {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    queue_->paused = true;
+}
+
+// Issues the read held back by pause, unless the queue is still full
+void InputReader::resume() {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    queue_->paused = false;
+    if (queue_->read_waiting && !queue_->ended && queue_->lines.size() < MAX_QUEUED_LINES) {
+        queue_->read_waiting = false;
+        boost::asio::post(io_, [this]() {
+            read_more();
+            });
+    }
+}
+
+#else
+
+// Starts a thread reading std::cin a line at a time
+void InputReader::start() {
+    if (typed_input_) {
+        return;
+    }
+    thread_ = std::thread([queue = queue_]() {
+        string line;
+        while (std::getline(std::cin, line)) {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->changed.wait(lock, [&queue]() { return (queue->lines.size() < MAX_QUEUED_LINES && !queue->paused) || queue->ended; });
+            if (queue->ended) {
+                return;
+            }
+            split_long_line(*queue, line);
+            queue->lines.push_back(std::move(line));
+            queue->changed.notify_all();
+        }
+        string partial;
+        finish(*queue, partial);
+        });
+}
+
+// Marks the end, the thread notices once its current getline returns
+void InputReader::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queue_->mutex);
+        queue_->ended = true;
+    }
+    queue_->changed.notify_all();
+}
+
+// Makes the thread wait before queueing its next line
+void InputReader::pause() {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    queue_->paused = true;
+}
+
+// Wakes the thread
+void InputReader::resume() {
+    {
+        std::lock_guard<std::mutex> lock(queue_->mutex);
+        queue_->paused = false;
+    }
+    queue_->changed.notify_all();
+}
+
+#endif
+
+// Blocks until lines are available and takes all of them
+bool InputReader::next_batch(std::vector<string>& lines) {
+    lines.clear();
+    std::unique_lock<std::mutex> lock(queue_->mutex);
+    queue_->changed.wait(lock, [this]() { return !queue_->lines.empty() || queue_->ended; });
+    lines.swap(queue_->lines);
+    // Wake the reader, it pauses while the queue is full
+    queue_->changed.notify_all();
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    if (queue_->read_waiting && !queue_->paused) {
+        queue_->read_waiting = false;
+        boost::asio::post(io_, [this]() {
+            read_more();
+            });
+    }
+#endif
+    return !lines.empty();
+}
@@ -0,0 +1,93 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/use_future.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+
+// Reads standard input on the IO context in READ_SIZE chunks and splits it into lines, which the input
+// thread takes a batch at a time with next_batch. A large file or a live log piped in is therefore read
+// with few system calls and handed over without a round trip per line. Reading stops while
+// MAX_QUEUED_LINES are waiting and while paused, which the host and client do when their peers fall
+// behind, so piping more than the connection can carry does not fill memory. A line longer than
+// MAX_LINE_LENGTH is split into several, so no line is held in memory whole or refused by the sender
+// for not fitting a frame. Where Asio has no POSIX stream descriptors (Windows) a thread reading
+// std::cin line by line is used.
+class InputReader {
+public:
+    static constexpr std::size_t READ_SIZE = 64 * 1024;
+    static constexpr std::size_t MAX_QUEUED_LINES = 4096;
+    static const std::size_t MAX_LINE_LENGTH; // MAX_MESSAGE_BODY, the longest message a frame can carry
+
+    explicit InputReader(boost::asio::io_context& io);
+    ~InputReader();
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    // True if standard input is a terminal, false when input is piped or redirected from a file
+    static bool is_terminal();
+
+    // Takes lines from submit() instead of reading standard input, for the full-screen view which reads
+    // the terminal itself. Call before start().
+    void use_typed_input();
+
+    // Queues a line typed in the full-screen view. Any thread.
+    void submit(string line);
+
+    // Starts reading, call once
+    void start();
+
+    // Blocks until lines are available and moves all of them into `lines`, replacing its contents.
+    // Returns false once the input has ended and every line has been taken.
+    bool next_batch(std::vector<string>& lines);
+
+    // Stops reading, lines already read can still be taken. Must not be called on the IO thread.
+    void stop();
+
+    // Holds back further input until resume, lines already read can still be taken. Any thread.
+    void pause();
+    void resume();
+
+private:
+    // Lines shared between the reading side and the input thread
+    struct Queue {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<string> lines;    // Complete lines not yet taken
+        bool ended = false;           // End of input, an error or stop()
+        bool read_waiting = false;    // The next read waits for the queue to empty or resume()
+        bool paused = false;          // Set by pause()
+    };
+
+    // Splits `data` into lines, the last partial line is kept for the next call. Returns false if
+    // the queue is full or input is paused and reading should wait.
+    static bool add_input(Queue& queue, string& partial, const char* data, std::size_t size);
+    static void finish(Queue& queue, string& partial); // Queues the last unterminated line and marks the end
+    // Queues MAX_LINE_LENGTH pieces off the front of `line` until the rest fits, returns the pieces
+    // queued. The queue mutex must be held.
+    static std::size_t split_long_line(Queue& queue, string& line);
+
+    boost::asio::io_context& io_;
+    std::shared_ptr<Queue> queue_;
+    string partial_;                  // Line read up to the end of the last chunk, reading side only
+    bool typed_input_ = false;        // Lines come from submit(), standard input is left alone
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    void read_more(); // Issues the next read, IO thread only
+
+    boost::asio::posix::stream_descriptor input_; // Duplicate of standard input
+    std::vector<char> buffer_;        // Chunk being read
+#else
+    std::thread thread_;              // Blocking reader, detached as it cannot be woken from getline
+#endif
+};
+
+#endif // INPUT_H
@@ -0,0 +1,61 @@
+#include "io_pool.h"
+#include <algorithm>
+#include <iostream>
+
+// Creates the contexts, each hinted that a single thread runs it so Asio takes its one-thread fast paths
+IoContextPool::IoContextPool(std::size_t size) {
+    if (size == 0) {
+        size = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (std::size_t i = 0; i < size; ++i) {
+        contexts_.push_back(std::make_unique<boost::asio::io_context>(1));
+    }
+}
+
+// Stops the threads if the owner has not
+IoContextPool::~IoContextPool() {
+    stop();
+}
+
+// Number of contexts
+std::size_t IoContextPool::size() const {
+    return contexts_.size();
+}
+
+// The first context
+boost::asio::io_context& IoContextPool::primary() {
+    return *contexts_.front();
+}
+
+// Picks the next context in turn
+boost::asio::io_context& IoContextPool::next() {
+    return *contexts_[next_.fetch_add(1, std::memory_order_relaxed) % contexts_.size()];
+}
+
+// Starts one thread per context
+void IoContextPool::start() {
+    for (auto& context : contexts_) {
+        work_.push_back(boost::asio::make_work_guard(*context));
+        threads_.emplace_back([&io = *context]() {
+            try {
+                // Run the IO context
+                io.run();
+            }
+            catch (const std::exception& e) {
+                std::cout << "Exception in IO thread: " << e.what() << std::endl;
+            }
+            });
+    }
+}
+
+// Stops every context and waits for its thread
+void IoContextPool::stop() {
+    work_.clear();
+    for (auto& context : contexts_) {
+        context->stop();
+    }
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+}
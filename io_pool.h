@@ -0,0 +1,47 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// A fixed set of io_contexts, each run by a thread of its own. Every connection is placed on one
+// context and stays there, so its handlers never run concurrently and need no strand, while
+// different connections are handled in parallel on as many cores as there are contexts.
+class IoContextPool {
+public:
+    // Creates `size` contexts, 0 for one per core
+    explicit IoContextPool(std::size_t size);
+    ~IoContextPool();
+
+    IoContextPool(const IoContextPool&) = delete;
+    IoContextPool& operator=(const IoContextPool&) = delete;
+
+    // Number of contexts
+    std::size_t size() const;
+
+    // The first context, where the owner keeps its own timers and accept loop
+    boost::asio::io_context& primary();
+
+    // Picks a context for a new connection, round robin. Any thread.
+    boost::asio::io_context& next();
+
+    // Starts one thread per context, the contexts keep running while idle until stop()
+    void start();
+
+    // Stops every context and waits for the threads. Must not be called on one of them.
+    void stop();
+
+private:
+    using work_guard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts_;
+    std::vector<work_guard> work_;          // Keeps run() from returning while a context is idle
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> next_{ 0 };    // Context handed out by the next call to next()
+};
+
+#endif // IO_POOL_H
@@ -0,0 +1,261 @@
+#include "ktls.h"
+#include <cstring>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#if defined(__linux__) && __has_include(<linux/tls.h>)
+#define ECHOCHAT_KTLS 1
+#include <cerrno>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
+// TLS 1.3 cipher suites the kernel implements, as returned by SSL_CIPHER_get_id
+const uint32_t TLS13_AES_128_GCM = 0x03001301;
+const uint32_t TLS13_AES_256_GCM = 0x03001302;
+const uint32_t TLS13_CHACHA20_POLY1305 = 0x03001303;
+// Length of the per-record nonce every TLS 1.3 cipher suite uses
+const std::size_t TLS13_IV_SIZE = 12;
+
+// SSL ex_data slot holding a pointer to the connection's KtlsState
+static int state_index() {
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// Decodes the hex secret of a key log line, empty if it is malformed
+static string from_hex(string_view hex) {
+    string out;
+    if (hex.size() % 2 != 0) {
+        return out;
+    }
+    auto nibble = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    out.reserve(hex.size() / 2);
+    for (std::size_t i = 0; i < hex.size(); i += 2) {
+        int high = nibble(hex[i]);
+        int low = nibble(hex[i + 1]);
+        if (high < 0 || low < 0) {
+            OPENSSL_cleanse(out.data(), out.size());
+            return string();
+        }
+        out.push_back(char(high << 4 | low));
+    }
+    return out;
+}
+
+// OpenSSL reports each secret as an NSS key log line: "<label> <client random> <secret>". Only the first
+// application traffic secrets are kept, the rest stay with OpenSSL.
+static void on_keylog(const SSL* ssl, const char* line) {
+    auto* state = static_cast<KtlsState*>(SSL_get_ex_data(ssl, state_index()));
+    if (!state) {
+        return;
+    }
+    string_view text(line);
+    std::size_t label_end = text.find(' ');
+    std::size_t random_end = label_end == string_view::npos ? label_end : text.find(' ', label_end + 1);
+    if (random_end == string_view::npos) {
+        return;
+    }
+    string_view label = text.substr(0, label_end);
+    bool client_secret = label == "CLIENT_TRAFFIC_SECRET_0";
+    if (!client_secret && label != "SERVER_TRAFFIC_SECRET_0") {
+        return;
+    }
+    // The client writes with the client secret and reads with the server's, the host the other way round
+    bool is_server = SSL_is_server(const_cast<SSL*>(ssl)) == 1;
+    bool write = client_secret != is_server;
+    ktls_forget(*state, write);
+    (write ? state->write_secret : state->read_secret) = from_hex(text.substr(random_end + 1));
+}
+
+// Counts records per direction. Records before a side's Finished use handshake keys, so the count
+// restarts at the Finished message and then matches the sequence number of the next record.
+static void on_message(int write_p, int, int content_type, const void* buf, std::size_t length, SSL* ssl, void*) {
+    auto* state = static_cast<KtlsState*>(SSL_get_ex_data(ssl, state_index()));
+    if (!state) {
+        return;
+    }
+    uint64_t& records = write_p ? state->write_records : state->read_records;
+    bool& counting = write_p ? state->write_counting : state->read_counting;
+    if (content_type == SSL3_RT_HEADER) {
+        ++records;
+    }
+    // OpenSSL reports a handshake message after the header of the record carrying it
+    else if (content_type == SSL3_RT_HANDSHAKE && length > 0 && static_cast<const uint8_t*>(buf)[0] == SSL3_MT_FINISHED) {
+        records = 0;
+        counting = true;
+    }
+}
+
+// True if this build can hand connections to the kernel
+bool ktls_compiled() {
+#ifdef ECHOCHAT_KTLS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Installs the key log callback, it only acts on connections passed to ktls_track
+void enable_ktls(boost::asio::ssl::context& ssl_context) {
+    SSL_CTX_set_keylog_callback(ssl_context.native_handle(), &on_keylog);
+}
+
+// Secrets of a connection that closed before its handover are not left behind in freed memory
+KtlsState::~KtlsState() {
+    ktls_forget(*this, true);
+    ktls_forget(*this, false);
+}
+
+// OPENSSL_cleanse cannot be optimised away like a plain memset of memory about to be freed
+void ktls_forget(KtlsState& state, bool send) {
+    string& secret = send ? state.write_secret : state.read_secret;
+    OPENSSL_cleanse(secret.data(), secret.size());
+    secret.clear();
+    secret.shrink_to_fit();
+}
+
+// Tags the connection with its state and counts its records from now on
+void ktls_track(SSL* ssl, KtlsState* state) {
+    SSL_set_ex_data(ssl, state_index(), state);
+    SSL_set_msg_callback(ssl, &on_message);
+}
+
+#ifdef ECHOCHAT_KTLS
+// HKDF-Expand-Label from RFC 8446 section 7.1 with an empty context
+static bool expand_label(const EVP_MD* digest, const string& secret, string_view label, unsigned char* out, std::size_t length) {
+    string info;
+    info.push_back(char(length >> 8));
+    info.push_back(char(length & 0xFF));
+    info.push_back(char(6 + label.size()));
+    info.append("tls13 ").append(label);
+    info.push_back(0);
+
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    bool ok = ctx
+        && EVP_PKEY_derive_init(ctx) > 0
+        && EVP_PKEY_CTX_set_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+        && EVP_PKEY_CTX_set_hkdf_md(ctx, digest) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(ctx, reinterpret_cast<const unsigned char*>(secret.data()), int(secret.size())) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<const unsigned char*>(info.data()), int(info.size())) > 0
+        && EVP_PKEY_derive(ctx, out, &length) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    return ok;
+}
+
+// Writes the sequence number of the next record big-endian, the way the kernel expects it
+static void put_record_sequence(unsigned char (&rec_seq)[8], uint64_t records) {
+    for (std::size_t i = 0; i < sizeof(rec_seq); ++i) {
+        rec_seq[i] = (unsigned char)(records >> (8 * (sizeof(rec_seq) - 1 - i)));
+    }
+}
+
+// Fills in one of the kernel's crypto_info layouts. GCM splits the nonce into a 4 byte salt and an
+// 8 byte explicit part, ChaCha20-Poly1305 takes it whole.
+template <typename Info>
+static Info make_crypto_info(uint16_t cipher_type, const unsigned char* key, const unsigned char* iv, uint64_t records) {
+    Info info;
+    std::memset(&info, 0, sizeof(info));
+    info.info.version = TLS_1_3_VERSION;
+    info.info.cipher_type = cipher_type;
+    std::memcpy(info.key, key, sizeof(info.key));
+    std::memcpy(info.salt, iv, sizeof(info.salt));
+    std::memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+    put_record_sequence(info.rec_seq, records);
+    return info;
+}
+#endif
+
+// Derives the record key and nonce for the direction and passes them to the kernel's TLS module
+bool ktls_start(int fd, SSL* ssl, const KtlsState& state, bool send, string& error) {
+#ifdef ECHOCHAT_KTLS
+    if (SSL_version(ssl) != TLS1_3_VERSION) {
+        error = "not a TLS 1.3 connection";
+        return false;
+    }
+    const string& secret = send ? state.write_secret : state.read_secret;
+    if (secret.empty() || !(send ? state.write_counting : state.read_counting)) {
+        error = "traffic secret not available";
+        return false;
+    }
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    uint32_t cipher_id = cipher ? SSL_CIPHER_get_id(cipher) : 0;
+    std::size_t key_size = cipher_id == TLS13_AES_128_GCM ? 16 : 32;
+    if (cipher_id != TLS13_AES_128_GCM && cipher_id != TLS13_AES_256_GCM && cipher_id != TLS13_CHACHA20_POLY1305) {
+        error = string("cipher ") + (cipher ? SSL_CIPHER_get_name(cipher) : "none") + " is not supported by the kernel";
+        return false;
+    }
+
+    unsigned char key[32];
+    unsigned char iv[TLS13_IV_SIZE];
+    const EVP_MD* digest = SSL_CIPHER_get_handshake_digest(cipher);
+    if (!digest || !expand_label(digest, secret, "key", key, key_size) || !expand_label(digest, secret, "iv", iv, sizeof(iv))) {
+        error = "could not derive the record keys";
+        return false;
+    }
+
+    // The upper layer is attached once, the second direction finds it in place
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0 && errno != EEXIST) {
+        // ENOENT means the tls module is not loaded
+        error = errno == ENOENT ? string("the kernel has no TLS module") : string("kernel TLS unavailable: ") + std::strerror(errno);
+        return false;
+    }
+    uint64_t records = send ? state.write_records : state.read_records;
+    int direction = send ? TLS_TX : TLS_RX;
+    int result = -1;
+    if (cipher_id == TLS13_AES_128_GCM) {
+        auto info = make_crypto_info<tls12_crypto_info_aes_gcm_128>(TLS_CIPHER_AES_GCM_128, key, iv, records);
+        result = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+        OPENSSL_cleanse(&info, sizeof(info));
+    }
+    else if (cipher_id == TLS13_AES_256_GCM) {
+        auto info = make_crypto_info<tls12_crypto_info_aes_gcm_256>(TLS_CIPHER_AES_GCM_256, key, iv, records);
+        result = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+        OPENSSL_cleanse(&info, sizeof(info));
+    }
+    else {
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        tls12_crypto_info_chacha20_poly1305 info;
+        std::memset(&info, 0, sizeof(info));
+        info.info.version = TLS_1_3_VERSION;
+        info.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        std::memcpy(info.key, key, sizeof(info.key));
+        std::memcpy(info.iv, iv, sizeof(info.iv));
+        put_record_sequence(info.rec_seq, records);
+        result = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info));
+        OPENSSL_cleanse(&info, sizeof(info));
+#else
+        error = "kernel headers lack ChaCha20-Poly1305";
+        return false;
+#endif
+    }
+    int setsockopt_error = errno;
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    if (result != 0) {
+        error = string("kernel refused the keys: ") + std::strerror(setsockopt_error);
+        return false;
+    }
+    return true;
+#else
+    (void)fd;
+    (void)ssl;
+    (void)state;
+    (void)send;
+    error = "kernel TLS is only available on Linux";
+    return false;
+#endif
+}
@@ -0,0 +1,56 @@
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <boost/asio/ssl.hpp>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <openssl/ssl.h>
+
+using std::string;
+using std::string_view;
+
+// Control line announcing that a peer takes part in the receive handover, it is sent whether or not the
+// peer uses kernel TLS itself
+const string_view KTLS_LINE = "#ktls handover=1";
+
+// What the kernel needs to continue a TLS 1.3 connection that OpenSSL started: the application traffic
+// secrets and how many records each direction has carried under them. Filled in by OpenSSL callbacks
+// during the handshake and while records pass through OpenSSL, IO thread only. A secret is wiped with
+// ktls_forget once its direction is settled, and any left are wiped when the state is destroyed.
+struct KtlsState {
+    string write_secret;          // Traffic secret of this side
+    string read_secret;           // Traffic secret of the remote side
+    uint64_t write_records = 0;   // Records sent since this side's Finished
+    uint64_t read_records = 0;    // Records received since the remote side's Finished
+    bool write_counting = false;  // This side's Finished has been sent
+    bool read_counting = false;   // The remote side's Finished has been received
+
+    KtlsState() = default;
+    ~KtlsState();
+
+    KtlsState(const KtlsState&) = delete;
+    KtlsState& operator=(const KtlsState&) = delete;
+};
+
+// True if this build can hand connections to the kernel at all (Linux with <linux/tls.h>)
+bool ktls_compiled();
+
+// Makes connections on `ssl_context` report the secrets the kernel needs, call before any handshake
+void enable_ktls(boost::asio::ssl::context& ssl_context);
+
+// Tracks the secrets and record counts of `ssl` in `state`, call before the handshake. The state
+// must outlive the SSL object.
+void ktls_track(SSL* ssl, KtlsState* state);
+
+// Hands the sending (`send`) or receiving direction of the connection on `fd` to the kernel, carrying on
+// after the records OpenSSL has already sent or received. Nothing may be buffered in OpenSSL in that
+// direction. Returns false with `error` set if the connection is not TLS 1.3 with AES-GCM or
+// ChaCha20-Poly1305 or the kernel refuses, the direction then stays with OpenSSL.
+bool ktls_start(int fd, SSL* ssl, const KtlsState& state, bool send, string& error);
+
+// Wipes and drops the secret of the sending (`send`) or receiving direction, call once the kernel has
+// it or the direction stays with OpenSSL for good
+void ktls_forget(KtlsState& state, bool send);
+
+#endif // KTLS_H
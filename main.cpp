@@ -1,10 +1,30 @@
 #include "peer.h"
+#include "host.h"
+#include "client.h"
+#include "bench.h"
+#include "capture.h"
+#include "chat_view.h"
+#include "console.h"
+#include "metrics.h"
 #include "config.h"
+#include "input.h"
+#include "io_pool.h"
+#include "ktls.h"
+#include "message_log.h"
+#include "microbench.h"
+#include "options.h"
+#include <cctype>
+#include <cstdio>
+#include <ctime>
 #include <iostream>
 #include <thread>
-#include <atomic>
 #include <memory>
+#include <functional>
 #include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <ftxui/screen/color.hpp>
@@ -21,11 +41,17 @@ using std::endl;
 using std::getline;
 using std::exception;
 
-// Define the port range and default port
-const int PORT_MIN = 8000;
-const int PORT_MAX = 9000;
+// Define the default port, the range is in options.h
 const int DEFAULT_PORT = 8080;
 const string DEFAULT_IP_ADDRESS = "127.0.0.1";
+// Number of logged messages a client asks for when it joins
+const int REPLAY_MESSAGES = 50;
+// Number of best matches /search shows
+const std::size_t SEARCH_HITS = 20;
+// How long the client waits for its first connection before showing the prompt anyway
+const auto FIRST_CONNECT_WAIT = std::chrono::seconds(5);
+// How long queued messages get to reach the network when the chat ends
+const auto DRAIN_TIMEOUT = std::chrono::seconds(5);
 
 // Prompts the user for an IP address, defaults to 127.0.0.1 if input is empty
 string get_ip_address() {
@@ -43,31 +69,26 @@ string get_ip_address() {
 
 // Prompts the user for a port number within the specified range, defaults to 8080 if input is empty
 int get_port() {
-    string port_input;
-    int port;
-
-    try {
+    while (true) {
+        string port_input;
         cout << "Enter a port number (" << PORT_MIN << "-" << PORT_MAX << ") or press enter for default port: " << DEFAULT_PORT << "\n";
-        getline(cin, port_input);
-
-        if (port_input.empty()) {
+        // The end of input also takes the default rather than asking forever
+        if (!getline(cin, port_input) || port_input.empty()) {
             return DEFAULT_PORT;
         }
 
-        port = std::stoi(port_input);
-		// Check if the port number is within the specified range
-        if (port >= PORT_MIN && port <= PORT_MAX) {
-            return port;
-        }
-        else {
-			// Recursively call the function until a valid port number is received
+        try {
+            int port = std::stoi(port_input);
+            // Check if the port number is within the specified range
+            if (port >= PORT_MIN && port <= PORT_MAX) {
+                return port;
+            }
+            // Ask again until a valid port number is received
             cout << "Port number must be between " << PORT_MIN << " and " << PORT_MAX << ". Please try again.\n";
-            return get_port();
         }
-    }
-    catch (const exception& e) {
-        cout << "Invalid input. Please enter a numeric port number.\n";
-        return get_port();
+        catch (const exception& e) {
+            cout << "Invalid input. Please enter a numeric port number.\n";
+        }
     }
 }
 
@@ -87,6 +108,11 @@ Color get_user_colour() {
             int choice;
             cin >> choice;
 
+            // Nothing more will arrive, give up rather than asking forever
+            if (cin.fail() && cin.eof()) {
+                break;
+            }
+
             // Check if the input is invalid
             if (cin.fail()) {
                 cin.clear(); // Clear the error state
@@ -95,6 +121,9 @@ Color get_user_colour() {
                 continue; // Prompt the user again
             }
 
+            // Discard the rest of the line so the next prompt starts on a fresh line
+            cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
             // Validate the range of the input
             if (choice < 1 || choice > 6) {
                 cout << "Invalid choice. Please enter a number between 1 and 6.\n";
@@ -116,73 +145,375 @@ Color get_user_colour() {
             cout << "An error occurred: " << e.what() << "\nPlease try again.\n";
         }
     }
+    throw std::runtime_error("Input ended before a colour was chosen");
+}
+
+// Handles the /stats commands, returns false if the message is not one of them:
+//   /stats                     print the counters
+//   /stats dump <file> [secs]  append the counters as JSON to a file every few seconds
+//   /stats dump off            stop dumping
+bool handle_stats_command(const string& message, io_context& io, MetricsDumper& dumper, const std::function<string()>& report) {
+    std::istringstream words(message);
+    string command, action, path;
+    words >> command >> action >> path;
+    if (command != "/stats") {
+        return false;
+    }
+
+    if (action.empty()) {
+        Console::instance().print_line(report());
+    }
+    else if (action == "dump" && path == "off") {
+        post(io, [&dumper]() { dumper.stop(); });
+        Console::instance().print_line("Stopped dumping stats.");
+    }
+    else if (action == "dump" && !path.empty()) {
+        int seconds = 10;
+        words >> seconds;
+        // The dumper's timer lives on the IO thread
+        bool started = post(io, use_future([&dumper, path, seconds]() { return dumper.start(path, std::chrono::seconds(seconds)); })).get();
+        Console::instance().print_line(started ? "Dumping stats to " + path + " every " + std::to_string(seconds) + "s." : "Could not open " + path);
+    }
+    else {
+        Console::instance().print_line("Usage: /stats | /stats dump <file> [seconds] | /stats dump off");
+    }
+    return true;
 }
 
-// Sets up and runs the host side of the application
-void run_host(io_context& io, ssl::context& ssl_context, std::atomic<bool>& connected, const string& ip, const string& name, Color user_colour, int port) {
+// Directory holding the message log for one user and chat, e.g. history/host-alice-8080
+string history_directory(const string& role, const string& name, int port) {
+    string directory = "history/" + role + "-";
+    // Keep the user name from escaping the history directory
+    for (char c : name) {
+        directory += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    }
+    return directory + "-" + std::to_string(port);
+}
+
+// Opens the message log, returns null and carries on without history if it cannot be opened
+std::unique_ptr<MessageLog> open_message_log(const string& directory) {
+    auto log = std::make_unique<MessageLog>(directory);
+    log->enable_search();
     try {
-        // Create a shared pointer to the Peer object
-        auto host_peer = std::make_shared<Peer>(io, ssl_context, connected, name, user_colour);
-        // Create an acceptor object to listen for incoming connections
-        tcp::acceptor acceptor(io, tcp::endpoint(ip::make_address(ip), port));
+        if (log->open()) {
+            return log;
+        }
+    }
+    catch (const exception& e) {
+        cout << "Error opening message log: " << e.what() << endl;
+    }
+    cout << "Message history is disabled, could not open " << directory << endl;
+    return nullptr;
+}
 
-        // Display host information
-        cout << "Host IP: " << ip << ", Port: " << port << endl;
-        cout << "Waiting for someone to connect..." << endl;
-
-        // Asynchronously accept incoming connections
-        acceptor.async_accept(host_peer->socket().lowest_layer(), [&host_peer](boost::system::error_code ec) {
-            if (!ec) {
-                cout << "Host: Connection established." << endl;
-                // Start the SSL handshake in server mode
-                host_peer->start_handshake(ssl::stream_base::server);
-            }
-            else {
-                cout << "Host: Error in accepting connection: " << ec.message() << endl;
-            }
-            });
+// Handles the /history command, returns false if the message is not one of them:
+//   /history                   show the last few messages from the host's log
+//   /history <count>           show the last <count> messages
+//   /history since <minutes>   show everything from the last <minutes> minutes
+bool handle_history_command(const string& message, Client& client) {
+    std::istringstream words(message);
+    string command, argument;
+    words >> command >> argument;
+    if (command != "/history") {
+        return false;
+    }
 
-        // Start the IO context in a separate thread
-        std::thread io_thread([&io]() {
-            try {
-                // Run the IO context
-                io.run();
-            }
-            catch (const exception& e) {
-                cout << "Exception in IO thread: " << e.what() << endl;
-            }
-            });
+    long long value = REPLAY_MESSAGES;
+    if (argument == "since" && words >> value && value > 0) {
+        client.request_history("since=" + std::to_string(MessageLog::now_ms() - value * 60 * 1000));
+    }
+    else if (argument.empty() || (std::istringstream(argument) >> value && value > 0)) {
+        client.request_history("last=" + std::to_string(value));
+    }
+    else {
+        Console::instance().print_line("Usage: /history [count] | /history since <minutes>");
+    }
+    return true;
+}
+
+// Handles the /search command, returns false if the message is not one of them:
+//   /search <words>                          show the best matches in this user's log, newest first on ties
+//   /search <words> since:<minutes>          only messages from the last <minutes> minutes
+//   /search <words> until:<minutes>          only messages older than <minutes> minutes
+bool handle_search_command(const string& message, MessageLog* log) {
+    std::istringstream words(message);
+    string command, word, query;
+    words >> command;
+    if (command != "/search") {
+        return false;
+    }
+    if (!log) {
+        Console::instance().print_line("Search needs the message history, which is disabled.");
+        return true;
+    }
 
-        while (!connected) {
-            // Wait for the connection to be established
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    int64_t since_ms = 0;
+    int64_t until_ms = 0;
+    bool valid = true;
+    while (words >> word) {
+        long long minutes = 0;
+        bool since = word.rfind("since:", 0) == 0;
+        if (since || word.rfind("until:", 0) == 0) {
+            valid = valid && std::istringstream(word.substr(6)) >> minutes && minutes > 0;
+            (since ? since_ms : until_ms) = MessageLog::now_ms() - minutes * 60 * 1000;
         }
+        else {
+            query += (query.empty() ? "" : " ") + word;
+        }
+    }
+    if (query.empty() || !valid) {
+        Console::instance().print_line("Usage: /search <words> [since:<minutes>] [until:<minutes>]");
+        return true;
+    }
 
-        // Display exit chat instructions
-        cout << "\nEnter 'exit' to quit the chat.\nYour messages are being encrypted.\n" << endl;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<string> lines;
+    uint64_t matches = log->search(query, since_ms, until_ms, SEARCH_HITS, [&lines](const LogRecord& record) {
+        // Records are viewed in the log's mappings, so copy them out before the lock is released
+        std::time_t seconds = std::time_t(record.timestamp_ms / 1000);
+        char stamp[32] = "";
+        if (const std::tm* local = std::localtime(&seconds)) {
+            std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", local);
+        }
+        lines.push_back(string(stamp) + "  " + string(record.name) + ": " + string(record.body));
+        });
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    Console& console = Console::instance();
+    char summary[128];
+    std::snprintf(summary, sizeof(summary), "%llu matches, showing %zu (%.2f ms)",
+        (unsigned long long)matches, lines.size(), double(micros) / 1000.0);
+    console.write_line(summary);
+    for (const string& line : lines) {
+        console.write_line(line);
+    }
+    console.flush();
+    return true;
+}
 
-        // Continuously read user input and send messages
-        while (true) {
+// Handles the /connect command, returns false if the message is not one of them:
+//   /connect <ip> <port>   link this host to another host so messages are relayed across both chats
+bool handle_connect_command(const string& message, Host& host) {
+    std::istringstream words(message);
+    string command, address;
+    int port = 0;
+    words >> command;
+    if (command != "/connect") {
+        return false;
+    }
+
+    boost::system::error_code ec;
+    words >> address >> port;
+    auto ip_address = ip::make_address(address, ec);
+    if (ec || port <= 0 || port > 65535) {
+        Console::instance().print_line("Usage: /connect <ip> <port>");
+    }
+    else {
+        host.connect_to(tcp::endpoint(ip_address, static_cast<unsigned short>(port)));
+    }
+    return true;
+}
+
+// Handles the room commands, returns false if the message is not one of them:
+//   /join <room>    join a room and send messages to it from now on
+//   /leave [room]   leave a room, the current one if none is given
+bool handle_room_command(const string& message, const std::function<void(const string&)>& join,
+    const std::function<void(const string&)>& leave) {
+    std::istringstream words(message);
+    string command, room;
+    words >> command >> room;
+    if (command != "/join" && command != "/leave") {
+        return false;
+    }
+
+    if (!room.empty() && !is_valid_room_name(room)) {
+        Console::instance().print_line("Room names are up to " + std::to_string(MAX_ROOM_LENGTH) + " letters, digits, '-' or '_'.");
+    }
+    else if (command == "/join" && room.empty()) {
+        Console::instance().print_line("Usage: /join <room> | /leave [room]");
+    }
+    else if (command == "/join") {
+        join(room);
+    }
+    else {
+        leave(room);
+    }
+    return true;
+}
+
+// Handles the /send command, returns false if the message is not one of them:
+//   /send <path>   stream a file, received files are saved in the downloads directory
+bool handle_send_command(const string& message, const std::function<void(const FileOffer&)>& send) {
+    const string command = "/send";
+    if (message.compare(0, command.size(), command) != 0 || (message.size() > command.size() && message[command.size()] != ' ')) {
+        return false;
+    }
+
+    // Everything after the command is the path, so paths with spaces work without quotes
+    string path = message.size() > command.size() ? message.substr(command.size() + 1) : string();
+    if (path.empty()) {
+        Console::instance().print_line("Usage: /send <path>");
+        return true;
+    }
+
+    // Hash the file here rather than on the IO thread, large files take a while
+    FileOffer offer;
+    string error;
+    if (prepare_file_offer(path, offer, error)) {
+        send(offer);
+    }
+    else {
+        Console::instance().print_line("Error: " + error);
+    }
+    return true;
+}
+
+// Reads input until 'exit' or the end of input. Runs of chat lines are handed to `send` as one batch, so
+// piped input goes out as fast as the connection takes it. A line starting with '/' is offered to `command`
+// once the chat before it has been sent, and is sent as chat if it is not a command. The prompt is redrawn
+// once per batch while typing and never when input is piped.
+void run_input_loop(InputReader& input, const std::function<void()>& prompt, const std::function<bool(const string&)>& command,
+    const std::function<void(std::vector<string>)>& send) {
+    Console::instance().set_prompt_enabled(InputReader::is_terminal());
+
+    // Standard input is read on the IO thread, this thread takes whatever has arrived a batch at a time
+    input.start();
+    std::vector<string> lines;
+    std::vector<string> messages;
+    bool running = true;
+    prompt();
+    while (running && input.next_batch(lines)) {
+        for (string& line : lines) {
+            if (line == "exit") {
+                running = false;
+                break;
+            }
             try {
-                string message;
-                // Display the prompt and read user input
-                host_peer->display_prompt();
-                // Read the message from the user
-                std::getline(cin, message);
-                if (message == "exit") break;
-                // Send the message if it is not empty
-                if (!message.empty()) host_peer->send_message(message);
+                if (!line.empty() && line[0] == '/') {
+                    // Keep the chat typed before the command ahead of it
+                    if (!messages.empty()) {
+                        send(std::exchange(messages, {}));
+                    }
+                    if (command(line)) continue;
+                }
+                if (!line.empty()) messages.push_back(std::move(line));
             }
             catch (const exception& e) {
-                cout << "Error sending message: " << e.what() << endl;
+                Console::instance().print_line(string("Error sending message: ") + e.what());
             }
         }
+        if (!messages.empty()) {
+            send(std::exchange(messages, {}));
+        }
+        prompt();
+    }
+    input.stop();
+}
 
-        // Shutdown the connection and stop the IO context
-        host_peer->shutdown();
-        io.stop();
-        // Wait for the IO thread to finish
-        io_thread.join();
+// Runs the input loop in the full-screen view when it is enabled and input is typed, otherwise on printed
+// lines. In the view the loop runs on a thread of its own, taking the lines typed, while this thread draws.
+void run_chat(InputReader& input, const ViewSettings& view_settings, const std::function<void()>& prompt,
+    const std::function<bool(const string&)>& command, const std::function<void(std::vector<string>)>& send) {
+    if (!view_settings.fullscreen || !InputReader::is_terminal()) {
+        run_input_loop(input, prompt, command, send);
+        return;
+    }
+
+    ChatView view(view_settings);
+    input.use_typed_input();
+    Console::instance().set_view(&view);
+    std::thread chat([&]() {
+        run_input_loop(input, prompt, command, send);
+        view.exit();
+        });
+    view.run([&input](string line) { input.submit(std::move(line)); });
+    // Ctrl+C closes the view first, ending the input lets the loop return
+    input.stop();
+    chat.join();
+    Console::instance().set_view(nullptr);
+}
+
+// Waits up to DRAIN_TIMEOUT for the queued messages to be written, so piped input is not cut short at exit.
+// A message reaches its peer's queue in two steps, possibly on different IO threads, so the queues must be
+// seen empty twice with a pause between.
+void wait_for_queued_messages(io_context& io) {
+    auto deadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+    int idle_checks = 0;
+    while (idle_checks < 2 && std::chrono::steady_clock::now() < deadline) {
+        bool idle = post(io, use_future([]() { return Metrics::global().totals.queue_depth == 0; })).get();
+        idle_checks = idle ? idle_checks + 1 : 0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+// Sets up and runs the host side of the application, sessions are spread over the pool's threads
+void run_host(IoContextPool& io_pool, ssl::context& ssl_context, const string& ip, const string& name, Color user_colour, int port,
+    const BackpressureLimits& backpressure, const HeartbeatSettings& heartbeat, bool ktls, uint64_t max_download, const ViewSettings& view, CaptureWriter* capture) {
+    try {
+        // The host's own work, and the input and stats dumps, run on the first context
+        io_context& io = io_pool.primary();
+
+        // Create the host, which listens for incoming connections and relays messages between peers
+        Host host(io, ssl_context, tcp::endpoint(ip::make_address(ip), port), name, user_colour);
+        host.set_io_pool(&io_pool);
+
+        // Display host information
+        cout << "Host IP: " << ip << ", Port: " << port << endl;
+        cout << "Waiting for peers to connect..." << endl;
+
+        // Log every message so peers that join later can catch up
+        auto message_log = open_message_log(history_directory("host", name, port));
+        host.set_message_log(message_log.get());
+        // Bound what a slow peer can make the host queue
+        host.set_backpressure(backpressure);
+        // Ping quiet sessions and drop the ones that stopped answering
+        host.set_heartbeat(heartbeat);
+        // Let the kernel encrypt and decrypt where it supports it
+        host.set_ktls(ktls);
+        // Refuse files too large to want on disk
+        host.set_max_download(max_download);
+        // Record the traffic for replaying later
+        host.set_capture(capture);
+        // Under pause_input the host user's own input waits for slow peers along with the sessions
+        InputReader input(io);
+        host.set_input_pause_handler([&input](bool paused) {
+            if (paused) input.pause();
+            else input.resume();
+            });
+        // Keep accepting connections for as long as the host is running
+        host.start();
+        // Writes the counters to a file when asked to with /stats dump
+        MetricsDumper dumper(io);
+
+        // Start the IO threads, one per context
+        io_pool.start();
+
+        // Display exit chat instructions
+        cout << "\nEnter 'exit' to quit the chat, '/connect <ip> <port>' to link to another host, '/join <room>' and '/leave' to switch rooms, '/send <path>' to send a file, '/search <words>' to search the history or '/stats' to show connection statistics.\nYour messages are being encrypted.\n" << endl;
+
+        // Continuously read user input and send messages
+        run_chat(input, view, [&host]() { host.display_prompt(); },
+            [&io, &host, &dumper, &message_log](const string& message) {
+                // Show the counters for every session
+                return handle_stats_command(message, io, dumper, [&host]() { return host.stats_report(); })
+                    // Search the host's own log
+                    || handle_search_command(message, message_log.get())
+                    // Link to another host, forming a mesh
+                    || handle_connect_command(message, host)
+                    // Talk in a room, the host user sees every room
+                    || handle_room_command(message, [&host](const string& room) { host.join_room(room); },
+                        [&host](const string& room) { host.leave_room(room); })
+                    // Send a file to every connected peer
+                    || handle_send_command(message, [&host](const FileOffer& offer) { host.send_file(offer); });
+            },
+            // Send the messages to every connected peer
+            [&host](std::vector<string> messages) { host.broadcast(std::move(messages)); });
+        wait_for_queued_messages(io);
+
+        // Close every session on its IO thread, then stop the IO threads
+        post(io, use_future([&dumper]() { dumper.stop(); })).wait();
+        host.shutdown();
+        io_pool.stop();
     }
     catch (const exception& e) {
         cout << "Error running host: " << e.what() << endl;
@@ -190,58 +521,77 @@ void run_host(io_context& io, ssl::context& ssl_context, std::atomic<bool>& conn
 }
 
 // Sets up and runs the client side of the application
-void run_client(io_context& io, ssl::context& ssl_context, std::atomic<bool>& connected, const string& host, const string& name, Color user_colour, int port) {
+void run_client(IoContextPool& io_pool, ssl::context& ssl_context, SessionCache& session_cache, const string& host, const string& name, Color user_colour, int port,
+    const HeartbeatSettings& heartbeat, bool ktls, uint64_t max_download, const ViewSettings& view, CaptureWriter* capture) {
     try {
-        // Create a shared pointer to the Peer object
-        auto client_peer = std::make_shared<Peer>(io, ssl_context, connected, name, user_colour);
+        io_context& io = io_pool.primary();
+
+        // Connects in the background and reconnects whenever the link drops
+        Client client(io, ssl_context, host, std::to_string(port), name, user_colour);
+        // Store the negotiated session so later connections to this host can resume it
+        client.set_session_cache(&session_cache);
+
+        // Log the conversation, anything missed before joining is replayed from the host's log
+        auto message_log = open_message_log(history_directory("client", name, port));
+        client.set_message_log(message_log.get());
+        // Record the traffic for replaying later
+        client.set_capture(capture);
+        // Notice a dead host and reconnect instead of waiting on it forever
+        client.set_heartbeat(heartbeat);
+        // Let the kernel encrypt and decrypt where it supports it
+        client.set_ktls(ktls);
+        // Refuse files too large to want on disk
+        client.set_max_download(max_download);
+        // Catch up on the latest messages once connected
+        client.set_history_request("last=" + std::to_string(REPLAY_MESSAGES));
+        // Hold back input while the host is not keeping up
+        InputReader input(io);
+        client.set_pressure_handler([&input](bool congested) {
+            if (congested) input.pause();
+            else input.resume();
+            });
 
-        cout << "Host IP: " << host << ", Port: " << port << endl;
-        // Attempt to connect to the host
-        client_peer->socket().lowest_layer().connect(tcp::endpoint(ip::make_address(host), port));
-        // Start the SSL handshake in client mode
-        client_peer->start_handshake(ssl::stream_base::client);
+        cout << "Host: " << host << ", Port: " << port << endl;
+        client.start();
+        // Writes the counters to a file when asked to with /stats dump
+        MetricsDumper dumper(io);
 
         // Start the IO context in a separate thread
-        std::thread io_thread([&io]() {
-            try {
-                // Run the IO context
-                io.run();
-            }
-            catch (const exception& e) {
-                cout << "Exception in IO thread: " << e.what() << endl;
-            }
-            });
+        io_pool.start();
 
-        while (!connected) {
-            // Wait for the connection to be established
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // Wait for the first connection, messages typed before it is up are sent once it is
+        if (!client.wait_connected(FIRST_CONNECT_WAIT)) {
+            Console::instance().print_line("Still connecting, messages will be sent once connected.");
         }
 
         // Display exit chat instructions
-        cout << "\nEnter 'exit' to quit the chat.\nYour messages are being encrypted.\n" << endl;
-
-        while (true) {
-            try {
-                string message;
-                // Display the prompt and read user input
-                client_peer->display_prompt();
-                // Read the message from the user
-                std::getline(cin, message);
-                // Exit the chat if the user types 'exit'
-                if (message == "exit") break;
-                // Send the message if it is not empty
-                if (!message.empty()) client_peer->send_message(message);
-            }
-            catch (const exception& e) {
-                cout << "Error sending message: " << e.what() << endl;
-            }
-        }
+        cout << "\nEnter 'exit' to quit the chat, '/history' to show earlier messages, '/join <room>' and '/leave' to switch rooms, '/send <path>' to send a file, '/search <words>' to search the history or '/stats' to show connection statistics.\nYour messages are being encrypted.\n" << endl;
+
+        run_chat(input, view, [&client]() { client.display_prompt(); },
+            [&io, &client, &dumper, &message_log](const string& message) {
+                // Show the counters for this connection
+                return handle_stats_command(message, io, dumper, [&client]() { return client.stats_report(); })
+                    // Ask the host to replay part of its log
+                    || handle_history_command(message, client)
+                    // Search the messages this client has seen
+                    || handle_search_command(message, message_log.get())
+                    // Join or leave a room
+                    || handle_room_command(message, [&client](const string& room) { client.join_room(room); },
+                        [&client](const string& room) { client.leave_room(room); })
+                    // Send a file to the host
+                    || handle_send_command(message, [&client](const FileOffer& offer) { client.send_file(offer); });
+            },
+            // Send the messages, they are buffered while reconnecting
+            [&client](std::vector<string> messages) { client.send_messages(std::move(messages)); });
+        wait_for_queued_messages(io);
 
         // Shutdown the connection and stop the IO context
-        client_peer->shutdown();
-        io.stop();
-        // Wait for the IO thread to finish
-        io_thread.join();
+        post(io, use_future([&dumper, &client]() {
+            dumper.stop();
+            client.shutdown();
+            })).wait();
+        // Stop the IO context and wait for the IO thread to finish
+        io_pool.stop();
     }
     catch (const exception& e) {
         cout << "Error running client: " << e.what() << endl;
@@ -249,24 +599,50 @@ void run_client(io_context& io, ssl::context& ssl_context, std::atomic<bool>& co
 }
 
 // Creates and runs the appropriate peer (host or client)
-void create_peer(const string& ip, const string& name, Color user_colour, int port, bool is_host) {
-    // Create the IO context and SSL context
-    io_context io;
-    ssl::context ssl_context(ssl::context::tlsv12);
-    // Atomic flag to track connection status
-    std::atomic<bool> connected(false);
+void create_peer(const string& ip, const string& name, Color user_colour, int port, bool is_host, const BackpressureLimits& backpressure,
+    const HeartbeatSettings& heartbeat, bool ktls, uint64_t max_download, const ViewSettings& view, unsigned threads, const string& capture_path) {
+    // Traffic capture, outlives the IO contexts so no session can record into a closed file
+    std::unique_ptr<CaptureWriter> capture;
+    if (!capture_path.empty()) {
+        capture = std::make_unique<CaptureWriter>();
+        if (capture->open(capture_path)) {
+            cout << "Capturing traffic to " << capture_path << endl;
+        }
+        else {
+            cout << "Traffic capture is disabled, could not open " << capture_path << endl;
+            capture.reset();
+        }
+    }
+    // Create the IO contexts, a client needs only one, and the SSL context
+    IoContextPool io_pool(is_host ? threads : 1);
+    // Negotiate the highest version both sides support, TLS 1.3 where available
+    ssl::context ssl_context(ssl::context::tls);
+    // Sessions negotiated by the client, reused when it connects to the same host again
+    SessionCache session_cache;
 
     try {
         // Configure the SSL context with the necessary certificate and key files
         configure_ssl_context(ssl_context);
 
+        // Let returning peers resume their TLS session instead of a full handshake
+        if (is_host) {
+            enable_session_resumption(ssl_context);
+        }
+        else {
+            session_cache.attach(ssl_context);
+        }
+        // Collect the traffic secrets the kernel needs to take over a connection
+        if (ktls) {
+            enable_ktls(ssl_context);
+        }
+
         if (is_host) {
             // Run the host side of the application
-            run_host(io, ssl_context, connected, ip, name, user_colour, port);
+            run_host(io_pool, ssl_context, ip, name, user_colour, port, backpressure, heartbeat, ktls, max_download, view, capture.get());
         }
         else {
             // Run the client side of the application
-            run_client(io, ssl_context, connected, ip, name, user_colour, port);
+            run_client(io_pool, ssl_context, session_cache, ip, name, user_colour, port, heartbeat, ktls, max_download, view, capture.get());
         }
     }
     catch (const exception& e) {
@@ -275,12 +651,32 @@ void create_peer(const string& ip, const string& name, Color user_colour, int po
 }
 
 // Main function to start the program and collect user inputs
-int main() {
+int main(int argc, char* argv[]) {
+    // Run the headless benchmark instead of the interactive chat when asked to
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        return run_benchmark(argc, argv);
+    }
+    // Or time the per-message CPU work on its own
+    if (argc > 1 && string(argv[1]) == "--microbench") {
+        return run_microbenchmarks(argc, argv);
+    }
+
+    // Settings given on the command line or in a config file are not asked for
+    ChatOptions options;
+    string error;
+    if (!parse_chat_options(argc, argv, options, error)) {
+        std::cerr << "Error: " << error << "\n";
+        print_chat_usage();
+        return 1;
+    }
+    // Read the answers to the prompts a byte at a time, so input piped after them is left for the InputReader
+    std::setvbuf(stdin, nullptr, _IONBF, 0);
+
     string ip;
     int port;
     char mode;
     bool is_host;
-    string name;
+    string name = options.name;
 
     try {
         // Render the welcome message with yellow colour
@@ -290,25 +686,32 @@ int main() {
         cout << screen.ToString() << "\n";
 
         // Prompt the user info input
-        cout << "\nWhat is your username?: ";
-        cin >> name;
-        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if (name.empty()) {
+            cout << "\nWhat is your username?: ";
+            cin >> name;
+            cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
 
-        Color user_colour = get_user_colour();
+        Color user_colour = options.colour_id != 0 ? colour_from_id(options.colour_id) : get_user_colour();
 
-        cout << "Are you hosting the connection? (y/n): ";
-        cin >> mode;
-        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if (options.is_host) {
+            is_host = *options.is_host;
+        }
+        else {
+            cout << "Are you hosting the connection? (y/n): ";
+            cin >> mode;
+            cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
-        // Check if the user is hosting the connection
-        is_host = (mode == 'y' || mode == 'Y');
+            // Check if the user is hosting the connection
+            is_host = (mode == 'y' || mode == 'Y');
+        }
         // Get the IP address from the user
-        ip = get_ip_address();
+        ip = options.ip ? *options.ip : get_ip_address();
         // Get the port number from the user
-        port = get_port();
+        port = options.port != 0 ? options.port : get_port();
 
         // Create the appropriate peer based on user input
-        create_peer(ip, name, user_colour, port, is_host);
+        create_peer(ip, name, user_colour, port, is_host, options.backpressure, options.heartbeat, options.ktls, options.max_download, options.view, options.threads, options.capture);
     }
     catch (const exception& e) {
         cout << "Exception in main: " << e.what() << endl;
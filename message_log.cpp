@@ -0,0 +1,465 @@
+#include "message_log.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+
+namespace fs = std::filesystem;
+
+// Size of the fixed part of a record after its length field: timestamp, colour id, name length
+const uint64_t RECORD_HEADER_SIZE = 8 + 1 + 1;
+// Size of an index entry on disk: record number, offset, timestamp
+const std::size_t INDEX_ENTRY_SIZE = 8 + 8 + 8;
+// Bytes buffered by the C runtime before an append reaches the operating system
+const std::size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+// Little-endian helpers for the on-disk format
+static void put_u64(string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) out.push_back(char(value >> (8 * i)));
+}
+
+static void put_u32(string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out.push_back(char(value >> (8 * i)));
+}
+
+static uint64_t get_u64(const char* data) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | uint8_t(data[i]);
+    return value;
+}
+
+static uint32_t get_u32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) value = (value << 8) | uint8_t(data[i]);
+    return value;
+}
+
+// Constructor to set the log directory
+MessageLog::MessageLog(const string& directory)
+    : directory_(directory) {}
+
+// Flushes and closes the active segment and saves the search index if it has grown
+MessageLog::~MessageLog() {
+    close_active();
+    if (search_ && search_->end() != search_saved_end_) {
+        save_search_index();
+    }
+}
+
+// Creates the index, open() fills it
+void MessageLog::enable_search() {
+    search_ = std::make_unique<SearchIndex>();
+}
+
+// Current wall clock time in milliseconds
+int64_t MessageLog::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Path of a segment's data (.log) or index (.idx) file, named after its first record number
+string MessageLog::segment_path(uint64_t base, const char* extension) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu.%s", static_cast<unsigned long long>(base), extension);
+    return (fs::path(directory_) / name).string();
+}
+
+// Creates the directory or recovers the segments already in it
+bool MessageLog::open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::error_code ec;
+    fs::create_directories(directory_, ec);
+    if (ec) {
+        return false;
+    }
+
+    // Segment files are named after their base record number, so sorting by name sorts by base
+    std::vector<uint64_t> bases;
+    for (const auto& entry : fs::directory_iterator(directory_, ec)) {
+        if (entry.path().extension() == ".log") {
+            try {
+                bases.push_back(std::stoull(entry.path().stem().string()));
+            }
+            catch (const std::exception&) {
+                // Not one of ours
+            }
+        }
+    }
+    std::sort(bases.begin(), bases.end());
+
+    for (uint64_t base : bases) {
+        auto segment = std::make_unique<Segment>();
+        segment->base = base;
+        if (!recover(*segment)) {
+            return false;
+        }
+        segments_.push_back(std::move(segment));
+    }
+
+    if (segments_.empty()) {
+        start_segment(0);
+    }
+    else {
+        // Keep appending to the last segment
+        Segment& last = *segments_.back();
+        data_file_ = std::fopen(segment_path(last.base, "log").c_str(), "ab");
+        index_file_ = std::fopen(segment_path(last.base, "idx").c_str(), "ab");
+        if (data_file_) std::setvbuf(data_file_, nullptr, _IOFBF, WRITE_BUFFER_SIZE);
+    }
+
+    if (search_) {
+        // A missing, damaged or foreign index is rebuilt, a saved one only needs the records appended since
+        uint64_t first = segments_.front()->base;
+        uint64_t end = segments_.back()->base + segments_.back()->records;
+        if (!search_->load((fs::path(directory_) / SEARCH_FILE).string()) || search_->end() > end) {
+            search_->clear();
+        }
+        search_->drop_before(first);
+        search_saved_end_ = search_->end();
+        read_records(std::max(search_->end(), first), std::numeric_limits<std::size_t>::max(), [this](const LogRecord& record) {
+            search_->add(record.number, record.name, record.body);
+            });
+        if (search_->end() != search_saved_end_) {
+            save_search_index();
+        }
+    }
+    return data_file_ != nullptr && index_file_ != nullptr;
+}
+
+// Saves the index, a failed save only means more records to index at the next open
+void MessageLog::save_search_index() {
+    if (search_->save((fs::path(directory_) / SEARCH_FILE).string())) {
+        search_saved_end_ = search_->end();
+    }
+}
+
+// Loads a segment's index and walks its records from the last indexed one to find the true end,
+// truncating anything left half written by a crash
+bool MessageLog::recover(Segment& segment) {
+    std::error_code ec;
+    string data_path = segment_path(segment.base, "log");
+    string index_path = segment_path(segment.base, "idx");
+    uint64_t file_size = fs::file_size(data_path, ec);
+    if (ec) return false;
+
+    // Load index entries, ignoring any that point past the data
+    if (std::FILE* index = std::fopen(index_path.c_str(), "rb")) {
+        char entry[INDEX_ENTRY_SIZE];
+        while (std::fread(entry, 1, sizeof(entry), index) == sizeof(entry)) {
+            IndexEntry parsed{ get_u64(entry), get_u64(entry + 8), int64_t(get_u64(entry + 16)) };
+            if (parsed.offset >= file_size) break;
+            segment.index.push_back(parsed);
+        }
+        std::fclose(index);
+    }
+
+    // Scan forward from the last index entry
+    uint64_t offset = segment.index.empty() ? 0 : segment.index.back().offset;
+    uint64_t number = segment.index.empty() ? segment.base : segment.index.back().number;
+    segment.size = file_size;
+    string_view data = map(segment);
+    LogRecord record;
+    uint64_t next = 0;
+    while (offset < file_size && parse_record(data, offset, record, next)) {
+        // Rebuild index entries whose writes were lost
+        if ((number - segment.base) % INDEX_INTERVAL == 0 && (segment.index.empty() || segment.index.back().number < number)) {
+            segment.index.push_back(IndexEntry{ number, offset, record.timestamp_ms });
+        }
+        offset = next;
+        ++number;
+    }
+
+    segment.records = number - segment.base;
+    if (offset < file_size) {
+        // Drop the torn record and remap at the new size
+        segment.region.reset();
+        segment.file.reset();
+        segment.mapped_size = 0;
+        fs::resize_file(data_path, offset, ec);
+    }
+    segment.size = offset;
+
+    // Rewrite the index so it matches what was recovered
+    if (std::FILE* index = std::fopen(index_path.c_str(), "wb")) {
+        string bytes;
+        for (const auto& entry : segment.index) {
+            put_u64(bytes, entry.number);
+            put_u64(bytes, entry.offset);
+            put_u64(bytes, uint64_t(entry.timestamp_ms));
+        }
+        std::fwrite(bytes.data(), 1, bytes.size(), index);
+        std::fclose(index);
+    }
+    return true;
+}
+
+// Closes the active segment's files
+void MessageLog::close_active() {
+    if (data_file_) {
+        std::fclose(data_file_);
+        data_file_ = nullptr;
+    }
+    if (index_file_) {
+        std::fclose(index_file_);
+        index_file_ = nullptr;
+    }
+    dirty_ = false;
+}
+
+// Starts a new active segment whose first record will be `base`
+void MessageLog::start_segment(uint64_t base) {
+    close_active();
+
+    auto segment = std::make_unique<Segment>();
+    segment->base = base;
+    segments_.push_back(std::move(segment));
+    data_file_ = std::fopen(segment_path(base, "log").c_str(), "wb");
+    index_file_ = std::fopen(segment_path(base, "idx").c_str(), "wb");
+    if (data_file_) std::setvbuf(data_file_, nullptr, _IOFBF, WRITE_BUFFER_SIZE);
+
+    enforce_retention();
+    // A full segment is a natural point to save the index, it then needs at most one segment replayed
+    if (search_ && search_->end() != search_saved_end_) {
+        search_->drop_before(segments_.front()->base);
+        save_search_index();
+    }
+}
+
+// Deletes the oldest segments beyond MAX_SEGMENTS
+void MessageLog::enforce_retention() {
+    while (segments_.size() > MAX_SEGMENTS) {
+        uint64_t base = segments_.front()->base;
+        segments_.erase(segments_.begin());
+        std::error_code ec;
+        fs::remove(segment_path(base, "log"), ec);
+        fs::remove(segment_path(base, "idx"), ec);
+    }
+}
+
+// Appends a message stamped with the current time
+void MessageLog::append(uint8_t colour_id, string_view name, string_view body) {
+    append(now_ms(), colour_id, name, body);
+}
+
+// Appends a message with an explicit timestamp
+void MessageLog::append(int64_t timestamp_ms, uint8_t colour_id, string_view name, string_view body) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!data_file_) {
+        return;
+    }
+    if (name.size() > 255) {
+        name = name.substr(0, 255);
+    }
+
+    // Roll over to a new segment once the active one is full
+    Segment* active = segments_.back().get();
+    if (active->size >= SEGMENT_SIZE) {
+        start_segment(active->base + active->records);
+        active = segments_.back().get();
+        if (!data_file_) return;
+    }
+
+    record_.clear();
+    put_u32(record_, uint32_t(RECORD_HEADER_SIZE + name.size() + body.size()));
+    put_u64(record_, uint64_t(timestamp_ms));
+    record_.push_back(char(colour_id));
+    record_.push_back(char(name.size()));
+    record_.append(name).append(body);
+
+    // Every INDEX_INTERVAL-th record gets a sparse index entry
+    uint64_t number = active->base + active->records;
+    if (active->records % INDEX_INTERVAL == 0) {
+        IndexEntry entry{ number, active->size, timestamp_ms };
+        active->index.push_back(entry);
+        if (index_file_) {
+            string bytes;
+            put_u64(bytes, entry.number);
+            put_u64(bytes, entry.offset);
+            put_u64(bytes, uint64_t(entry.timestamp_ms));
+            std::fwrite(bytes.data(), 1, bytes.size(), index_file_);
+        }
+    }
+
+    std::fwrite(record_.data(), 1, record_.size(), data_file_);
+    active->size += record_.size();
+    ++active->records;
+    dirty_ = true;
+    if (search_) {
+        search_->add(number, name, body);
+    }
+}
+
+// Pushes buffered appends to the operating system so mappings can see them
+void MessageLog::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (data_file_) std::fflush(data_file_);
+    if (index_file_) std::fflush(index_file_);
+    dirty_ = false;
+}
+
+// Number of the next record to be written
+uint64_t MessageLog::end_record() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (segments_.empty()) return 0;
+    return segments_.back()->base + segments_.back()->records;
+}
+
+// Number of the oldest record still on disk
+uint64_t MessageLog::first_record() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return segments_.empty() ? 0 : segments_.front()->base;
+}
+
+// Maps a segment read-only, remapping when the active segment has grown past its mapping
+string_view MessageLog::map(Segment& segment) {
+    if (segment.size == 0) {
+        return string_view();
+    }
+    if (!segment.region || segment.mapped_size < segment.size) {
+        // Make sure everything appended so far is visible through the mapping
+        if (dirty_) {
+            if (data_file_) std::fflush(data_file_);
+            if (index_file_) std::fflush(index_file_);
+            dirty_ = false;
+        }
+        namespace ipc = boost::interprocess;
+        segment.region.reset();
+        segment.file = std::make_unique<ipc::file_mapping>(segment_path(segment.base, "log").c_str(), ipc::read_only);
+        segment.region = std::make_unique<ipc::mapped_region>(*segment.file, ipc::read_only, 0, std::size_t(segment.size));
+        segment.mapped_size = segment.size;
+    }
+    return string_view(static_cast<const char*>(segment.region->get_address()), std::size_t(segment.size));
+}
+
+// Parses the record at `offset`, returns false if it is incomplete or corrupt
+bool MessageLog::parse_record(string_view data, uint64_t offset, LogRecord& record, uint64_t& next_offset) {
+    if (offset + 4 > data.size()) return false;
+    uint64_t length = get_u32(data.data() + offset);
+    if (length < RECORD_HEADER_SIZE || offset + 4 + length > data.size()) return false;
+
+    const char* payload = data.data() + offset + 4;
+    uint8_t name_length = uint8_t(payload[9]);
+    if (RECORD_HEADER_SIZE + name_length > length) return false;
+
+    record.timestamp_ms = int64_t(get_u64(payload));
+    record.colour_id = uint8_t(payload[8]);
+    record.name = string_view(payload + RECORD_HEADER_SIZE, name_length);
+    record.body = string_view(payload + RECORD_HEADER_SIZE + name_length, std::size_t(length - RECORD_HEADER_SIZE - name_length));
+    next_offset = offset + 4 + length;
+    return true;
+}
+
+// Segment holding a record number, null if it has been deleted or not written yet
+MessageLog::Segment* MessageLog::find_segment(uint64_t number) {
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), number,
+        [](uint64_t value, const std::unique_ptr<Segment>& segment) { return value < segment->base; });
+    if (it == segments_.begin()) return nullptr;
+    Segment* segment = (--it)->get();
+    return number < segment->base + segment->records ? segment : nullptr;
+}
+
+// Number of the first record logged at or after `timestamp_ms`
+uint64_t MessageLog::first_record_since(int64_t timestamp_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_record_since(timestamp_ms);
+}
+
+// Number of the first record logged at or after `timestamp_ms`, mutex held
+uint64_t MessageLog::find_record_since(int64_t timestamp_ms) {
+    if (segments_.empty()) return 0;
+
+    // Timestamps only grow, so the answer is in the last segment that starts before the time
+    std::size_t candidate = 0;
+    for (std::size_t i = 0; i < segments_.size(); ++i) {
+        const Segment& segment = *segments_[i];
+        if (!segment.index.empty() && segment.index.front().timestamp_ms < timestamp_ms) {
+            candidate = i;
+        }
+    }
+    Segment& segment = *segments_[candidate];
+    if (segment.index.empty() || segment.index.front().timestamp_ms >= timestamp_ms) {
+        return segment.base;
+    }
+
+    // Jump to the last index entry before the time and scan from there
+    auto entry = std::lower_bound(segment.index.begin(), segment.index.end(), timestamp_ms,
+        [](const IndexEntry& e, int64_t value) { return e.timestamp_ms < value; });
+    --entry;
+    string_view data = map(segment);
+    uint64_t offset = entry->offset;
+    uint64_t number = entry->number;
+    LogRecord record;
+    uint64_t next = 0;
+    while (number < segment.base + segment.records && parse_record(data, offset, record, next)) {
+        if (record.timestamp_ms >= timestamp_ms) {
+            return number;
+        }
+        offset = next;
+        ++number;
+    }
+    return segment.base + segment.records;
+}
+
+// Visits up to `max_records` records starting at `from`, returns the number of the next record
+uint64_t MessageLog::read(uint64_t from, std::size_t max_records, const visitor& visit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return read_records(from, max_records, visit);
+}
+
+// Visits up to `max_records` records starting at `from`, mutex held
+uint64_t MessageLog::read_records(uint64_t from, std::size_t max_records, const visitor& visit) {
+    if (segments_.empty()) return from;
+
+    // Records that were deleted by retention are skipped
+    from = std::max(from, segments_.front()->base);
+    std::size_t visited = 0;
+    while (visited < max_records) {
+        Segment* segment = find_segment(from);
+        if (!segment) break;
+
+        // Start at the closest index entry at or before the record
+        auto entry = std::upper_bound(segment->index.begin(), segment->index.end(), from,
+            [](uint64_t value, const IndexEntry& e) { return value < e.number; });
+        uint64_t offset = 0;
+        uint64_t number = segment->base;
+        if (entry != segment->index.begin()) {
+            --entry;
+            offset = entry->offset;
+            number = entry->number;
+        }
+
+        string_view data = map(*segment);
+        LogRecord record;
+        uint64_t next = 0;
+        uint64_t segment_end = segment->base + segment->records;
+        while (number < segment_end && visited < max_records && parse_record(data, offset, record, next)) {
+            if (number >= from) {
+                record.number = number;
+                visit(record);
+                ++visited;
+                from = number + 1;
+            }
+            offset = next;
+            ++number;
+        }
+        if (number < segment_end && visited < max_records) {
+            // Corrupt data inside a segment, stop rather than loop
+            break;
+        }
+    }
+    return from;
+}
+
+// Turns the time range into a range of record numbers, timestamps grow with them, and visits the hits
+uint64_t MessageLog::search(string_view query, int64_t since_ms, int64_t until_ms, std::size_t max_hits, const visitor& visit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!search_ || segments_.empty()) return 0;
+
+    uint64_t first = since_ms > 0 ? find_record_since(since_ms) : segments_.front()->base;
+    uint64_t last = until_ms > 0 ? find_record_since(until_ms) : segments_.back()->base + segments_.back()->records;
+    SearchResult result = search_->search(query, first, last, max_hits);
+    for (const SearchHit& hit : result.hits) {
+        read_records(hit.number, 1, visit);
+    }
+    return result.matches;
+}
@@ -0,0 +1,136 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include "search_index.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::string;
+using std::string_view;
+
+// A stored message, the views point into the mapped segment and are only valid during the visit
+struct LogRecord {
+    uint64_t number = 0;      // Position of the record in the whole log, starting at 0
+    int64_t timestamp_ms = 0; // Wall clock time the message was logged
+    uint8_t colour_id = 0;
+    string_view name;
+    string_view body;
+};
+
+// Append-only chat history split into fixed-size segment files. Records are appended through a
+// buffered file and read back through memory mappings, so history is never held on the heap.
+// Each segment keeps a sparse index (one entry every INDEX_INTERVAL records) in a side file,
+// which lets a reader jump close to any record number or timestamp without scanning the log.
+//
+// Record layout (little-endian): u32 length of the rest, i64 timestamp ms, u8 colour id,
+// u8 name length, name bytes, body bytes.
+//
+// With search enabled every appended record is also added to a SearchIndex, which is saved to
+// SEARCH_FILE whenever a segment fills up and when the log closes. Opening loads it and indexes
+// only the records appended after it was saved.
+class MessageLog {
+public:
+    // A new segment is started once the current one reaches this size
+    static constexpr uint64_t SEGMENT_SIZE = 16 * 1024 * 1024;
+    // One index entry is written every INDEX_INTERVAL records
+    static constexpr uint64_t INDEX_INTERVAL = 64;
+    // Oldest segments are deleted once there are more than this many
+    static constexpr std::size_t MAX_SEGMENTS = 64;
+    // File in the log directory holding the saved search index
+    static constexpr const char* SEARCH_FILE = "search.idx";
+
+    using visitor = std::function<void(const LogRecord&)>;
+
+    // Constructor to set the directory holding the segment files, nothing is touched until open()
+    explicit MessageLog(const string& directory);
+    ~MessageLog();
+
+    MessageLog(const MessageLog&) = delete;
+    MessageLog& operator=(const MessageLog&) = delete;
+
+    // Keeps a full-text index of the names and bodies logged, call before open()
+    void enable_search();
+
+    // Creates the directory or recovers the existing log, truncating a partly written last record
+    bool open();
+
+    // Appends a message stamped with the current time
+    void append(uint8_t colour_id, string_view name, string_view body);
+
+    // Appends a message with an explicit timestamp
+    void append(int64_t timestamp_ms, uint8_t colour_id, string_view name, string_view body);
+
+    // Number of the next record to be written, equal to the number of records ever appended
+    uint64_t end_record();
+
+    // Number of the oldest record still on disk
+    uint64_t first_record();
+
+    // Number of the first record logged at or after `timestamp_ms`, end_record() if there is none
+    uint64_t first_record_since(int64_t timestamp_ms);
+
+    // Visits up to `max_records` records starting at `from`, returns the number of the next record
+    uint64_t read(uint64_t from, std::size_t max_records, const visitor& visit);
+
+    // Visits the best `max_hits` records containing every word of `query`, best first, and returns how
+    // many records matched. Only records logged at or after `since_ms` and before `until_ms` count,
+    // 0 leaves that end open. Returns 0 if search is not enabled.
+    uint64_t search(string_view query, int64_t since_ms, int64_t until_ms, std::size_t max_hits, const visitor& visit);
+
+    // Pushes buffered appends to the operating system
+    void flush();
+
+    // Current wall clock time in milliseconds, as stored in records
+    static int64_t now_ms();
+
+private:
+    // Sparse index entry: where a record starts in its segment and when it was logged
+    struct IndexEntry {
+        uint64_t number;
+        uint64_t offset;
+        int64_t timestamp_ms;
+    };
+
+    // One segment file, its index and, once read, its mapping
+    struct Segment {
+        uint64_t base = 0;             // Number of the first record in the segment
+        uint64_t records = 0;          // Records in the segment
+        uint64_t size = 0;             // Bytes written to the segment
+        std::vector<IndexEntry> index; // Sparse index
+        std::unique_ptr<boost::interprocess::file_mapping> file;
+        std::unique_ptr<boost::interprocess::mapped_region> region;
+        uint64_t mapped_size = 0;      // Bytes covered by region
+    };
+
+    string segment_path(uint64_t base, const char* extension) const;
+    bool recover(Segment& segment); // Loads the index and validates the records of a segment
+    void start_segment(uint64_t base); // Opens a new active segment for appending
+    void close_active(); // Flushes and closes the active segment's files
+    void enforce_retention(); // Deletes the oldest segments beyond MAX_SEGMENTS
+    string_view map(Segment& segment); // Maps a segment for reading, remapping the active one if it grew
+    Segment* find_segment(uint64_t number); // Segment holding a record number
+    uint64_t find_record_since(int64_t timestamp_ms); // first_record_since with the mutex held
+    uint64_t read_records(uint64_t from, std::size_t max_records, const visitor& visit); // read with the mutex held
+    void save_search_index(); // Writes the search index next to the segments
+    static bool parse_record(string_view data, uint64_t offset, LogRecord& record, uint64_t& next_offset);
+
+    string directory_;
+    std::mutex mutex_;                               // Appends and reads may come from different threads
+    std::vector<std::unique_ptr<Segment>> segments_; // Ordered by base, the last one is active
+    std::FILE* data_file_ = nullptr;                 // Active segment, opened for appending
+    std::FILE* index_file_ = nullptr;                // Active segment's index, opened for appending
+    bool dirty_ = false;                             // Appends not yet flushed
+    string record_;                                  // Reused encode buffer
+    std::unique_ptr<SearchIndex> search_;            // Full-text index, null unless enabled
+    uint64_t search_saved_end_ = 0;                  // Index end when it was last saved
+};
+
+#endif // MESSAGE_LOG_H
@@ -0,0 +1,200 @@
+#include "metrics.h"
+#include <sstream>
+
+// Records one sample in its power-of-two bucket
+void LatencyHistogram::record(std::chrono::steady_clock::duration value) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(value).count();
+    if (ns < 0) ns = 0;
+    uint64_t us = uint64_t(ns) / 1000;
+
+    std::size_t bucket = 0;
+    while (us > 0 && bucket < BUCKETS - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(uint64_t(ns), std::memory_order_relaxed);
+}
+
+// Number of samples recorded
+uint64_t LatencyHistogram::count() const {
+    return count_.load(std::memory_order_relaxed);
+}
+
+// Mean of all samples in microseconds
+double LatencyHistogram::mean_us() const {
+    uint64_t n = count();
+    return n == 0 ? 0.0 : total_ns_.load(std::memory_order_relaxed) / 1000.0 / n;
+}
+
+// Upper bound in microseconds of the bucket holding percentile p
+double LatencyHistogram::percentile_us(double p) const {
+    uint64_t n = count();
+    if (n == 0) return 0.0;
+
+    uint64_t target = uint64_t(p * n);
+    if (target >= n) target = n - 1;
+    uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += buckets_[bucket].load(std::memory_order_relaxed);
+        if (seen > target) {
+            return double(uint64_t(1) << bucket);
+        }
+    }
+    return double(uint64_t(1) << (BUCKETS - 1));
+}
+
+// Seconds on the steady clock
+int64_t RateMeter::current_second() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Counts events in the current second's bucket, resetting a bucket left over from an earlier second
+void RateMeter::record(uint64_t n) {
+    int64_t second = current_second();
+    std::size_t bucket = std::size_t(second) % seconds_.size();
+    int64_t seen = seconds_[bucket].load(std::memory_order_relaxed);
+    if (seen != second && seconds_[bucket].compare_exchange_strong(seen, second, std::memory_order_relaxed)) {
+        counts_[bucket].store(0, std::memory_order_relaxed);
+    }
+    counts_[bucket].fetch_add(n, std::memory_order_relaxed);
+    total_.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Average over the last WINDOW whole seconds, the current second is still filling and left out
+double RateMeter::per_second() const {
+    int64_t second = current_second();
+    uint64_t sum = 0;
+    for (std::size_t i = 0; i < seconds_.size(); ++i) {
+        int64_t seen = seconds_[i].load(std::memory_order_relaxed);
+        if (seen < second && seen >= second - int64_t(WINDOW)) {
+            sum += counts_[i].load(std::memory_order_relaxed);
+        }
+    }
+    return double(sum) / double(WINDOW);
+}
+
+// Events ever recorded
+uint64_t RateMeter::total() const {
+    return total_.load(std::memory_order_relaxed);
+}
+
+// Adds n to a counter
+void PeerStats::add(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Human readable summary
+string PeerStats::report(const string& label) const {
+    std::ostringstream out;
+    out << label << ": messages in " << messages_in << ", out " << messages_out
+        << " | bytes in " << bytes_in << ", out " << bytes_out
+        << " | reads " << read_calls << ", writes " << write_calls
+        << " | queue " << queue_depth << " (max " << queue_depth_max << "), " << queue_bytes << " bytes (max " << queue_bytes_max << ")"
+        << " | errors " << errors << "\n";
+    out << label << ": slow consumer: crossed high watermark " << watermark_crossings
+        << ", messages dropped " << dropped_messages << ", disconnected " << slow_disconnects << "\n";
+    out << label << ": heartbeat: pings " << pings_sent << ", timeouts " << heartbeat_timeouts
+        << " | rtt last " << last_rtt_us << "us, p50 <" << rtt.percentile_us(0.50) << "us"
+        << ", p99 <" << rtt.percentile_us(0.99) << "us, mean " << rtt.mean_us() << "us (" << rtt.count() << ")\n";
+    out << label << ": kernel tls: send " << ktls_send << ", receive " << ktls_receive << ", fallbacks " << ktls_fallbacks << "\n";
+    out << label << ": handshake mean " << handshake.mean_us() << "us (" << handshake.count() << ")"
+        << " | send latency p50 <" << send_latency.percentile_us(0.50) << "us"
+        << ", p99 <" << send_latency.percentile_us(0.99) << "us"
+        << ", mean " << send_latency.mean_us() << "us";
+    return out.str();
+}
+
+// Single line JSON object
+string PeerStats::report_json() const {
+    std::ostringstream out;
+    out << "{\"messages_in\":" << messages_in << ",\"messages_out\":" << messages_out
+        << ",\"bytes_in\":" << bytes_in << ",\"bytes_out\":" << bytes_out
+        << ",\"read_calls\":" << read_calls << ",\"write_calls\":" << write_calls
+        << ",\"errors\":" << errors
+        << ",\"queue_depth\":" << queue_depth << ",\"queue_depth_max\":" << queue_depth_max
+        << ",\"queue_bytes\":" << queue_bytes << ",\"queue_bytes_max\":" << queue_bytes_max
+        << ",\"watermark_crossings\":" << watermark_crossings << ",\"dropped_messages\":" << dropped_messages
+        << ",\"slow_disconnects\":" << slow_disconnects
+        << ",\"pings_sent\":" << pings_sent << ",\"heartbeat_timeouts\":" << heartbeat_timeouts
+        << ",\"ktls_send\":" << ktls_send << ",\"ktls_receive\":" << ktls_receive << ",\"ktls_fallbacks\":" << ktls_fallbacks
+        << ",\"rtt_us\":{\"count\":" << rtt.count() << ",\"last\":" << last_rtt_us << ",\"mean\":" << rtt.mean_us()
+        << ",\"p50\":" << rtt.percentile_us(0.50) << ",\"p99\":" << rtt.percentile_us(0.99) << "}"
+        << ",\"handshake_us\":{\"count\":" << handshake.count() << ",\"mean\":" << handshake.mean_us()
+        << ",\"p50\":" << handshake.percentile_us(0.50) << ",\"p99\":" << handshake.percentile_us(0.99) << "}"
+        << ",\"send_latency_us\":{\"count\":" << send_latency.count() << ",\"mean\":" << send_latency.mean_us()
+        << ",\"p50\":" << send_latency.percentile_us(0.50) << ",\"p99\":" << send_latency.percentile_us(0.99)
+        << ",\"p999\":" << send_latency.percentile_us(0.999) << "}}";
+    return out.str();
+}
+
+// Returns the process-wide metrics
+Metrics& Metrics::global() {
+    static Metrics metrics;
+    return metrics;
+}
+
+// Human readable summary of the totals and session counts
+string Metrics::report() const {
+    std::ostringstream out;
+    out << "sessions: opened " << sessions_opened << ", closed " << sessions_closed
+        << ", active " << (sessions_opened - sessions_closed) << "\n"
+        << "mesh: relayed " << mesh_messages << ", duplicates dropped " << mesh_duplicates << "\n"
+        << "compression: messages " << compressed_messages << ", bytes " << compress_bytes_in << " -> " << compress_bytes_out
+        << ", compress " << compress_ns / 1000 << "us, decompress " << decompress_ns / 1000 << "us\n"
+        << "backpressure: input paused " << input_pauses << " times\n"
+        << totals.report("total");
+    return out.str();
+}
+
+// Single line JSON object with a wall clock timestamp
+string Metrics::report_json() const {
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::ostringstream out;
+    out << "{\"timestamp_ms\":" << now
+        << ",\"sessions_opened\":" << sessions_opened << ",\"sessions_closed\":" << sessions_closed
+        << ",\"mesh_messages\":" << mesh_messages << ",\"mesh_duplicates\":" << mesh_duplicates
+        << ",\"compression\":{\"messages\":" << compressed_messages << ",\"bytes_in\":" << compress_bytes_in
+        << ",\"bytes_out\":" << compress_bytes_out << ",\"compress_ns\":" << compress_ns << ",\"decompress_ns\":" << decompress_ns << "}"
+        << ",\"input_pauses\":" << input_pauses
+        << ",\"totals\":" << totals.report_json() << "}";
+    return out.str();
+}
+
+// Constructor to bind the dump timer to the IO context
+MetricsDumper::MetricsDumper(boost::asio::io_context& io)
+    : timer_(io) {}
+
+// Starts dumping to `path` every `interval`
+bool MetricsDumper::start(const string& path, std::chrono::seconds interval) {
+    stop();
+    file_.open(path, std::ios::app);
+    if (!file_) {
+        return false;
+    }
+    interval_ = interval.count() > 0 ? interval : std::chrono::seconds(1);
+    schedule();
+    return true;
+}
+
+// Stops dumping and closes the file
+void MetricsDumper::stop() {
+    timer_.cancel();
+    if (file_.is_open()) {
+        file_.close();
+    }
+}
+
+// Arms the timer for the next dump
+void MetricsDumper::schedule() {
+    timer_.expires_after(interval_);
+    timer_.async_wait([this](boost::system::error_code ec) {
+        if (ec || !file_.is_open()) {
+            return;
+        }
+        file_ << Metrics::global().report_json() << "\n";
+        file_.flush();
+        schedule();
+        });
+}
@@ -0,0 +1,145 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+using std::string;
+
+// Lock-free latency histogram with power-of-two microsecond buckets: bucket 0 holds values below 1us,
+// bucket i holds values in [2^(i-1), 2^i) us and the last bucket holds everything larger
+class LatencyHistogram {
+public:
+    static constexpr std::size_t BUCKETS = 32;
+
+    // Records one sample
+    void record(std::chrono::steady_clock::duration value);
+
+    // Number of samples recorded
+    uint64_t count() const;
+
+    // Mean of all samples in microseconds
+    double mean_us() const;
+
+    // Upper bound in microseconds of the bucket holding percentile p (0-1)
+    double percentile_us(double p) const;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> total_ns_{ 0 };
+};
+
+// Lock-free event rate over the last WINDOW whole seconds, counted in one bucket per second. Any thread,
+// a few events may be lost when threads race to start a new second, so the rate is approximate.
+class RateMeter {
+public:
+    static constexpr std::size_t WINDOW = 10;
+
+    // Counts n events in the current second
+    void record(uint64_t n = 1);
+
+    // Events per second averaged over the last WINDOW whole seconds
+    double per_second() const;
+
+    // Events ever recorded
+    uint64_t total() const;
+
+private:
+    static int64_t current_second();
+
+    std::array<std::atomic<int64_t>, WINDOW + 1> seconds_{}; // Second each bucket is counting
+    std::array<std::atomic<uint64_t>, WINDOW + 1> counts_{};
+    std::atomic<uint64_t> total_{ 0 };
+};
+
+// Counters for one connection, or summed over all connections. Updated with relaxed atomics from the
+// IO thread and read from any thread.
+struct PeerStats {
+    std::atomic<uint64_t> messages_in{ 0 };
+    std::atomic<uint64_t> messages_out{ 0 };
+    std::atomic<uint64_t> bytes_in{ 0 };
+    std::atomic<uint64_t> bytes_out{ 0 };
+    std::atomic<uint64_t> read_calls{ 0 };
+    std::atomic<uint64_t> write_calls{ 0 };
+    std::atomic<uint64_t> errors{ 0 };
+    std::atomic<uint64_t> queue_depth{ 0 };      // Messages queued or in flight right now
+    std::atomic<uint64_t> queue_depth_max{ 0 };  // Highest queue_depth seen
+    std::atomic<uint64_t> queue_bytes{ 0 };      // Bytes queued or in flight right now
+    std::atomic<uint64_t> queue_bytes_max{ 0 };  // Highest queue_bytes seen
+    std::atomic<uint64_t> watermark_crossings{ 0 }; // Times the queue rose above the high watermark
+    std::atomic<uint64_t> dropped_messages{ 0 }; // Queued messages dropped by the drop_oldest policy
+    std::atomic<uint64_t> slow_disconnects{ 0 }; // Connections closed by the disconnect policy
+    std::atomic<uint64_t> pings_sent{ 0 };       // Heartbeat pings sent
+    std::atomic<uint64_t> heartbeat_timeouts{ 0 }; // Connections closed because the peer stopped answering
+    std::atomic<uint64_t> last_rtt_us{ 0 };      // Round trip time measured by the latest pong
+    std::atomic<uint64_t> ktls_send{ 0 };        // Connections whose writes the kernel encrypts
+    std::atomic<uint64_t> ktls_receive{ 0 };     // Connections whose reads the kernel decrypts
+    std::atomic<uint64_t> ktls_fallbacks{ 0 };   // Kernel TLS handovers refused, the direction stayed in OpenSSL
+    LatencyHistogram handshake;                  // Handshake duration
+    LatencyHistogram send_latency;               // Time from queueing a message to its write completing
+    LatencyHistogram rtt;                        // Round trip time of answered pings
+
+    // Adds n to a counter
+    static void add(std::atomic<uint64_t>& counter, uint64_t n);
+
+    // Human readable summary, one line per group of counters
+    string report(const string& label) const;
+
+    // Single line JSON object
+    string report_json() const;
+};
+
+// Process-wide metrics: totals across every connection, session counts, mesh relay and compression counts
+class Metrics {
+public:
+    // Returns the process-wide metrics
+    static Metrics& global();
+
+    PeerStats totals;                              // Sum over all connections
+    std::atomic<uint64_t> sessions_opened{ 0 };    // Connections that completed a handshake
+    std::atomic<uint64_t> sessions_closed{ 0 };    // Connections that have since closed
+    std::atomic<uint64_t> mesh_messages{ 0 };      // Distinct messages relayed by the mesh
+    std::atomic<uint64_t> mesh_duplicates{ 0 };    // Copies of already relayed messages that were dropped
+    std::atomic<uint64_t> compressed_messages{ 0 }; // Message bodies sent compressed, counted once per encode
+    std::atomic<uint64_t> compress_bytes_in{ 0 };  // Body bytes before compression
+    std::atomic<uint64_t> compress_bytes_out{ 0 }; // Body bytes after compression
+    std::atomic<uint64_t> compress_ns{ 0 };        // Time spent compressing
+    std::atomic<uint64_t> decompress_ns{ 0 };      // Time spent decompressing
+    std::atomic<uint64_t> input_pauses{ 0 };       // Times the host paused input for a congested peer
+
+    // Human readable summary of the totals and session counts
+    string report() const;
+
+    // Single line JSON object with a wall clock timestamp
+    string report_json() const;
+
+private:
+    Metrics() = default;
+};
+
+// Appends Metrics::global() as JSON to a file at a fixed interval, driven by a timer on the IO context
+class MetricsDumper {
+public:
+    explicit MetricsDumper(boost::asio::io_context& io);
+
+    // Starts dumping to `path` every `interval`, replacing any dump already running
+    bool start(const string& path, std::chrono::seconds interval);
+
+    // Stops dumping and closes the file
+    void stop();
+
+private:
+    void schedule(); // Arms the timer for the next dump
+
+    boost::asio::steady_timer timer_;
+    std::ofstream file_;
+    std::chrono::seconds interval_{ 10 };
+};
+
+#endif // METRICS_H
@@ -0,0 +1,306 @@
+#include "microbench.h"
+#include "buffer_pool.h"
+#include "chat_view.h"
+#include "console.h"
+#include "peer.h"
+#include "protocol.h"
+#include "search_index.h"
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using Clock = std::chrono::steady_clock;
+
+// Settings for a microbenchmark run, filled from the command line
+struct MicrobenchOptions {
+    vector<std::size_t> sizes{ 16, 128, 1024, 8192 }; // Message body sizes, every size-dependent benchmark runs once per size
+    double min_time = 0.2;                            // Seconds each measurement must last at least
+    string output_file;                               // Optional JSON output path, stdout is always written
+};
+
+// One measured benchmark
+struct MicroResult {
+    string name;
+    std::size_t size = 0;     // Body size, 0 for benchmarks that do not depend on it
+    uint64_t iterations = 0;
+    double ns_per_op = 0.0;
+    double allocations_per_op = 0.0;
+};
+
+// Calls made before timing so pools, caches and buffers have grown to their working size
+const uint64_t WARMUP_ITERATIONS = 1000;
+// Upper bound on a measurement, for operations too cheap for the clock to see
+const uint64_t MAX_ITERATIONS = uint64_t(1) << 32;
+// Frames in the buffer the parsers walk through, so the next frame is not always in the same place
+const int PARSE_FRAMES = 64;
+// Sender name used by every benchmark
+const string_view BENCH_NAME = "alice";
+const uint8_t BENCH_COLOUR = 3;
+// Terminal height the full-screen view is rendered for
+const int VIEW_ROWS = 50;
+
+// Words the search index bodies are made of, and how many different bodies it cycles through
+const string_view SEARCH_WORDS[] = { "the", "meeting", "is", "at", "noon", "deploy", "build", "failed", "again", "lunch",
+    "coffee", "review", "merge", "branch", "release", "tomorrow" };
+const int SEARCH_BODIES = 16;
+
+// Results are added here so the compiler cannot drop the work being timed
+static volatile uint64_t sink = 0;
+
+// Prints the microbenchmark usage
+static void print_usage() {
+    std::cerr << "Usage: EchoChat --microbench [--sizes BYTES[,BYTES...]] [--min-time SECONDS] [--output FILE]\n";
+}
+
+// Parses the options that follow --microbench
+static bool parse_options(int argc, char* argv[], MicrobenchOptions& options) {
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        string value = argv[++i];
+
+        try {
+            if (arg == "--sizes") {
+                options.sizes.clear();
+                std::stringstream ss(value);
+                string item;
+                while (std::getline(ss, item, ',')) {
+                    std::size_t size = 0;
+                    auto result = std::from_chars(item.data(), item.data() + item.size(), size);
+                    if (result.ec != std::errc() || size == 0 || size > MAX_FRAME_PAYLOAD / 2) return false;
+                    options.sizes.push_back(size);
+                }
+                if (options.sizes.empty()) return false;
+            }
+            else if (arg == "--min-time") {
+                options.min_time = std::stod(value);
+            }
+            else if (arg == "--output") {
+                options.output_file = value;
+            }
+            else {
+                return false;
+            }
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    return options.min_time > 0;
+}
+
+// Builds a message body of `size` printable bytes
+static string make_body(std::size_t size) {
+    string body;
+    body.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        body.push_back(char('a' + i % 26));
+    }
+    return body;
+}
+
+// Times `op` after a warm-up, doubling the number of calls until a run lasts at least the minimum time
+template <typename Op>
+static MicroResult measure(const string& name, std::size_t size, const MicrobenchOptions& options, Op&& op) {
+    for (uint64_t i = 0; i < WARMUP_ITERATIONS; ++i) {
+        op();
+    }
+
+    MicroResult result;
+    result.name = name;
+    result.size = size;
+    for (uint64_t iterations = 1;; iterations *= 2) {
+        uint64_t allocations_before = thread_allocation_count();
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            op();
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        uint64_t allocations = thread_allocation_count() - allocations_before;
+        if (elapsed >= options.min_time || iterations >= MAX_ITERATIONS) {
+            result.iterations = iterations;
+            result.ns_per_op = elapsed * 1e9 / double(iterations);
+            result.allocations_per_op = double(allocations) / double(iterations);
+            return result;
+        }
+    }
+}
+
+// Times parsing one frame at a time from a buffer of PARSE_FRAMES encoded frames, as the read loop does
+template <typename Parser>
+static MicroResult measure_parse(const string& name, const string& frames, std::size_t size, const MicrobenchOptions& options, Parser parse) {
+    string_view buffer(frames);
+    std::size_t offset = 0;
+    return measure(name, size, options, [&]() {
+        MessageView message;
+        std::size_t consumed = 0;
+        if (parse(buffer.substr(offset), message, consumed) != ParseResult::ok) {
+            throw std::runtime_error(name + ": frame did not parse");
+        }
+        offset += consumed;
+        if (offset == buffer.size()) {
+            offset = 0;
+        }
+        sink = sink + message.body.size();
+        });
+}
+
+// Builds a body of about `size` bytes of space separated words, `seed` picks where the words start
+static string make_words(std::size_t size, std::size_t seed) {
+    const std::size_t count = sizeof(SEARCH_WORDS) / sizeof(SEARCH_WORDS[0]);
+    string body;
+    body.reserve(size + 16);
+    for (std::size_t i = seed; body.size() < size; i += 1 + seed % 3) {
+        body.append(SEARCH_WORDS[i % count]).push_back(' ');
+    }
+    body.resize(size);
+    return body;
+}
+
+// Benchmarks that depend on the message size
+static void run_sized(std::size_t size, const MicrobenchOptions& options, vector<MicroResult>& results) {
+    string body = make_body(size);
+
+    // Parsing a received text line and binary frame in place
+    string text_frames;
+    string binary_frames;
+    for (int i = 0; i < PARSE_FRAMES; ++i) {
+        append_text_frame(text_frames, BENCH_COLOUR, BENCH_NAME, body);
+        append_binary_frame(binary_frames, FrameType::chat, BENCH_COLOUR, BENCH_NAME, body);
+    }
+    results.push_back(measure_parse("parse_text", text_frames, size, options, parse_text_frame));
+    results.push_back(measure_parse("parse_binary", binary_frames, size, options, parse_binary_frame));
+
+    // Building an outbound message as send_message does and encoding it for one peer
+    results.push_back(measure("message_text", size, options, [&]() {
+        auto message = OutboundMessage::create(FrameType::chat, BENCH_COLOUR, BENCH_NAME, body);
+        sink = sink + message->encoded(WireFormat::text).size();
+        }));
+    results.push_back(measure("message_binary", size, options, [&]() {
+        auto message = OutboundMessage::create(FrameType::chat, BENCH_COLOUR, BENCH_NAME, body);
+        sink = sink + message->encoded(WireFormat::binary).size();
+        }));
+
+    // Formatting a received message for the terminal, the coloured name comes from the cache
+    PrefixCache prefixes;
+    string out;
+    results.push_back(measure("format_message", size, options, [&]() {
+        out.clear();
+        format_message(out, prefixes, BENCH_NAME, BENCH_COLOUR, body);
+        sink = sink + out.size();
+        }));
+    // Adding a received message to the full-screen view's scrollback, once the ring is full
+    ViewSettings settings;
+    ChatView view(settings);
+    results.push_back(measure("view_add_message", size, options, [&]() {
+        view.add_message(BENCH_NAME, BENCH_COLOUR, body);
+        }));
+
+    // Indexing a logged message for /search, once its words all have posting lists
+    vector<string> bodies;
+    for (int i = 0; i < SEARCH_BODIES; ++i) {
+        bodies.push_back(make_words(size, std::size_t(i)));
+    }
+    SearchIndex index;
+    uint64_t number = 0;
+    results.push_back(measure("search_index_add", size, options, [&]() {
+        index.add(number, BENCH_NAME, bodies[number % bodies.size()]);
+        ++number;
+        }));
+    sink = sink + index.posting_bytes();
+}
+
+// Benchmarks that do not depend on the message size
+static void run_unsized(const MicrobenchOptions& options, vector<MicroResult>& results) {
+    vector<string> names;
+    vector<Color> colours;
+    // Every colour the user can pick, ids past the table come back as white
+    for (uint8_t id = 1; colour_id_from_name(colour_name(id)) == id; ++id) {
+        names.emplace_back(colour_name(id));
+        colours.push_back(colour_from_id(id));
+    }
+    std::size_t next = 0;
+    results.push_back(measure("string_to_colour", 0, options, [&]() {
+        sink = sink + (Peer::string_to_colour(names[next++ % names.size()]) == Color(Color::White));
+        }));
+    results.push_back(measure("colour_to_string", 0, options, [&]() {
+        sink = sink + Peer::colour_to_string(colours[next++ % colours.size()]).size();
+        }));
+
+    // Drawing the prompt, with the name cached as it is after the first prompt
+    PrefixCache prefixes;
+    string out;
+    results.push_back(measure("format_prompt", 0, options, [&]() {
+        out.clear();
+        format_prompt(out, prefixes, BENCH_NAME, BENCH_COLOUR);
+        sink = sink + out.size();
+        }));
+    // Building one frame of the full-screen view over a full scrollback, the most any flood can cost per redraw
+    ViewSettings settings;
+    ChatView view(settings);
+    string body(80, 'x');
+    for (std::size_t i = 0; i < settings.scrollback; ++i) {
+        view.add_message(BENCH_NAME, BENCH_COLOUR, body);
+    }
+    results.push_back(measure("view_frame", 0, options, [&]() {
+        sink = sink + (view.render(VIEW_ROWS) != nullptr);
+        }));
+    // Rendering a name with FTXUI, what every cache miss costs
+    results.push_back(measure("render_name", 0, options, [&]() {
+        sink = sink + render_in_colour(BENCH_NAME, BENCH_COLOUR).size();
+        }));
+}
+
+// Runs the CPU microbenchmarks
+int run_microbenchmarks(int argc, char* argv[]) {
+    MicrobenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        vector<MicroResult> results;
+        run_unsized(options, results);
+        for (std::size_t size : options.sizes) {
+            run_sized(size, options, results);
+        }
+
+        std::ostringstream report;
+        report << "{\"benchmark\":\"echochat-micro\",\"min_time_s\":" << options.min_time << ",\"runs\":[";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            const MicroResult& result = results[i];
+            report << (i > 0 ? "," : "")
+                << "{\"name\":\"" << result.name << "\""
+                << ",\"size\":" << result.size
+                << ",\"iterations\":" << result.iterations
+                << ",\"ns_per_op\":" << result.ns_per_op
+                << ",\"allocations_per_op\":";
+            if (ALLOCATIONS_COUNTED) {
+                report << result.allocations_per_op;
+            } else {
+                report << "null";
+            }
+            report << "}";
+        }
+        report << "]}";
+
+        std::cout << report.str() << std::endl;
+        if (!options.output_file.empty()) {
+            std::ofstream out(options.output_file);
+            out << report.str() << "\n";
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Microbenchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+// Runs the CPU microbenchmarks (main.exe --microbench [options]) and returns the exit code. Each
+// benchmark times one piece of the work done per message, such as parsing a frame or rendering a
+// name, in a tight loop on the calling thread, without sockets or terminal output, and reports
+// nanoseconds and heap allocations per operation as JSON.
+int run_microbenchmarks(int argc, char* argv[]);
+
+#endif // MICROBENCH_H
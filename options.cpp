@@ -0,0 +1,205 @@
+#include "options.h"
+#include "protocol.h"
+#include <charconv>
+#include <fstream>
+#include <iostream>
+
+// Prints the command line usage
+void print_chat_usage() {
+    std::cerr << "Usage: EchoChat [--name NAME] [--colour red|green|blue|yellow|cyan|magenta] [--mode host|client]\n"
+        << "                [--ip ADDRESS] [--port " << PORT_MIN << "-" << PORT_MAX << "] [--config FILE]\n"
+        << "                [--slow-consumer pause_input|drop_oldest|disconnect] [--queue-high BYTES] [--queue-low BYTES]\n"
+        << "                [--threads N (0 for one per core)] [--capture FILE]\n"
+        << "                [--ping-interval SECONDS (0 to disable)] [--ping-timeout SECONDS]\n"
+        << "                [--ui fullscreen|lines] [--fps N] [--scrollback LINES] [--ktls on|off]\n"
+        << "                [--max-download BYTES]\n"
+        << "       EchoChat --bench [options]\n"
+        << "       EchoChat --microbench [options]\n"
+        << "Settings not given are asked for. Piped input is sent as fast as the connection allows.\n";
+}
+
+// Parses a whole decimal number, rejecting trailing characters
+template <typename T>
+static bool parse_number(const string& text, T& value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// Applies one setting, `key` is the option name without the leading dashes
+static bool apply_option(const string& key, const string& value, ChatOptions& options, string& error) {
+    if (key == "name") {
+        if (value.empty()) {
+            error = "name must not be empty";
+            return false;
+        }
+        options.name = value;
+    }
+    else if (key == "colour" || key == "color") {
+        options.colour_id = colour_id_from_name(value);
+        // White is the fallback for unknown names, it is not one of the choices
+        if (options.colour_id == 0) {
+            error = "unknown colour '" + value + "'";
+            return false;
+        }
+    }
+    else if (key == "mode") {
+        if (value != "host" && value != "client") {
+            error = "mode must be host or client";
+            return false;
+        }
+        options.is_host = value == "host";
+    }
+    else if (key == "ip") {
+        options.ip = value;
+    }
+    else if (key == "port") {
+        int port = 0;
+        if (!parse_number(value, port) || port < PORT_MIN || port > PORT_MAX) {
+            error = "port must be between " + std::to_string(PORT_MIN) + " and " + std::to_string(PORT_MAX);
+            return false;
+        }
+        options.port = port;
+    }
+    else if (key == "slow-consumer") {
+        if (value == "pause_input") options.backpressure.policy = SlowConsumerPolicy::pause_input;
+        else if (value == "drop_oldest") options.backpressure.policy = SlowConsumerPolicy::drop_oldest;
+        else if (value == "disconnect") options.backpressure.policy = SlowConsumerPolicy::disconnect;
+        else {
+            error = "slow-consumer must be pause_input, drop_oldest or disconnect";
+            return false;
+        }
+    }
+    else if (key == "queue-high" || key == "queue-low") {
+        std::size_t bytes = 0;
+        if (!parse_number(value, bytes) || bytes == 0) {
+            error = key + " must be a positive number of bytes";
+            return false;
+        }
+        (key == "queue-high" ? options.backpressure.high_watermark : options.backpressure.low_watermark) = bytes;
+    }
+    else if (key == "threads") {
+        if (!parse_number(value, options.threads) || options.threads > MAX_IO_THREADS) {
+            error = "threads must be between 0 and " + std::to_string(MAX_IO_THREADS);
+            return false;
+        }
+    }
+    else if (key == "ping-interval" || key == "ping-timeout") {
+        unsigned seconds = 0;
+        if (!parse_number(value, seconds) || seconds > MAX_HEARTBEAT_SECONDS || (seconds == 0 && key == "ping-timeout")) {
+            error = key + " must be between " + (key == "ping-timeout" ? "1" : "0") + " and " + std::to_string(MAX_HEARTBEAT_SECONDS) + " seconds";
+            return false;
+        }
+        (key == "ping-interval" ? options.heartbeat.interval : options.heartbeat.timeout) = std::chrono::seconds(seconds);
+    }
+    else if (key == "ui") {
+        if (value != "fullscreen" && value != "lines") {
+            error = "ui must be fullscreen or lines";
+            return false;
+        }
+        options.view.fullscreen = value == "fullscreen";
+    }
+    else if (key == "fps") {
+        if (!parse_number(value, options.view.fps) || options.view.fps == 0 || options.view.fps > MAX_FPS) {
+            error = "fps must be between 1 and " + std::to_string(MAX_FPS);
+            return false;
+        }
+    }
+    else if (key == "scrollback") {
+        if (!parse_number(value, options.view.scrollback) || options.view.scrollback < MIN_SCROLLBACK || options.view.scrollback > MAX_SCROLLBACK) {
+            error = "scrollback must be between " + std::to_string(MIN_SCROLLBACK) + " and " + std::to_string(MAX_SCROLLBACK) + " lines";
+            return false;
+        }
+    }
+    else if (key == "ktls") {
+        if (value != "on" && value != "off") {
+            error = "ktls must be on or off";
+            return false;
+        }
+        options.ktls = value == "on";
+    }
+    else if (key == "max-download") {
+        if (!parse_number(value, options.max_download) || options.max_download == 0) {
+            error = "max-download must be a positive number of bytes";
+            return false;
+        }
+    }
+    else if (key == "capture") {
+        options.capture = value;
+    }
+    else if (key == "config") {
+        return load_config_file(value, options, error);
+    }
+    else {
+        error = "unknown option '" + key + "'";
+        return false;
+    }
+    return true;
+}
+
+// Fills `options` from the command line
+bool parse_chat_options(int argc, char* argv[], ChatOptions& options, string& error) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.size() < 3 || arg.compare(0, 2, "--") != 0) {
+            error = "unexpected argument '" + arg + "'";
+            return false;
+        }
+        if (i + 1 >= argc) {
+            error = arg + " needs a value";
+            return false;
+        }
+        if (!apply_option(arg.substr(2), argv[++i], options, error)) {
+            return false;
+        }
+    }
+
+    if (options.backpressure.low_watermark >= options.backpressure.high_watermark) {
+        error = "queue-low must be below queue-high";
+        return false;
+    }
+    if (options.heartbeat.interval.count() > 0 && options.heartbeat.timeout <= options.heartbeat.interval) {
+        error = "ping-timeout must be longer than ping-interval";
+        return false;
+    }
+    return true;
+}
+
+// Trims spaces and tabs from both ends
+static string trim(const string& text) {
+    std::size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == string::npos) {
+        return string();
+    }
+    return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+// Reads `key = value` lines from a config file
+bool load_config_file(const string& path, ChatOptions& options, string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "could not open config file " + path;
+        return false;
+    }
+
+    string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        line = trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::size_t equals = line.find('=');
+        string key = trim(line.substr(0, equals));
+        if (equals == string::npos || key == "config") {
+            error = path + ":" + std::to_string(line_number) + ": expected key = value";
+            return false;
+        }
+        if (!apply_option(key, trim(line.substr(equals + 1)), options, error)) {
+            error = path + ":" + std::to_string(line_number) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "chat_view.h"
+#include "peer.h"
+#include <optional>
+#include <string>
+
+using std::string;
+
+// Range of ports the chat may use
+const int PORT_MIN = 8000;
+const int PORT_MAX = 9000;
+// Most IO threads a host may run
+const unsigned MAX_IO_THREADS = 256;
+// Longest ping interval or timeout accepted
+const unsigned MAX_HEARTBEAT_SECONDS = 3600;
+// Bounds on the full-screen view's frame rate and scrollback
+const unsigned MAX_FPS = 240;
+const std::size_t MIN_SCROLLBACK = 100;
+const std::size_t MAX_SCROLLBACK = 1000000;
+
+// Startup settings given on the command line or in a config file. Anything left unset is asked for
+// with the interactive prompts, so `EchoChat --name alice --colour red --mode host --ip 127.0.0.1 --port 8080`
+// starts without asking anything.
+struct ChatOptions {
+    string name;                       // Username, empty to ask
+    uint8_t colour_id = 0;             // Wire colour id, 0 to ask
+    std::optional<bool> is_host;       // Host or client, unset to ask
+    std::optional<string> ip;          // Address to listen on or host to connect to, unset to ask
+    int port = 0;                      // Chat port, 0 to ask
+    BackpressureLimits backpressure;   // Outbound queue limits for the host's sessions
+    HeartbeatSettings heartbeat;       // Ping interval and dead peer timeout of every connection
+    unsigned threads = 1;              // IO threads the host spreads its sessions over, 0 for one per core
+    string capture;                    // File the traffic is recorded to for --bench --replay, empty for none
+    ViewSettings view;                 // Full-screen view or printed lines, scrollback and frame rate
+    bool ktls = false;                 // Hand record encryption to the kernel where it can
+    uint64_t max_download = DEFAULT_MAX_DOWNLOAD; // Largest file accepted from a peer
+};
+
+// Prints the command line usage
+void print_chat_usage();
+
+// Fills `options` from the command line, a --config file is read where it appears so later options
+// override it. Returns false with `error` set on an unknown option or a bad value.
+bool parse_chat_options(int argc, char* argv[], ChatOptions& options, string& error);
+
+// Reads `key = value` lines from a config file, keys are the long option names without the dashes.
+// Blank lines and lines starting with # are ignored.
+bool load_config_file(const string& path, ChatOptions& options, string& error);
+
+#endif // OPTIONS_H
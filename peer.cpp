@@ -1,172 +1,1004 @@
 #include "peer.h"
-#include <iostream>
-#include <ftxui/dom/elements.hpp>
-#include <ftxui/screen/screen.hpp>
+#include "compression.h"
+#include "console.h"
+#include "metrics.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <span>
 
-// Constructor to initialize SSL socket, connection status, user name, and name colour
-Peer::Peer(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, std::atomic<bool>& connected, const string& user_name, Color user_colour)
-    : socket_(io, ssl_context), is_connected_(connected), name(user_name), colour_(user_colour) {}
+// Constructor to initialize SSL socket, user name, and name colour
+Peer::Peer(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const string& user_name, Color user_colour)
+    : socket_(io, ssl_context), read_buffer_(READ_BUFFER_SIZE), is_connected_(false), is_closed_(false), name(user_name), colour_(user_colour),
+    heartbeat_timer_(io),
+    transfers_([this](std::shared_ptr<const OutboundMessage> frame) { queue_frame(std::move(frame)); }) {}
+
+// Executor of the io_context the peer runs on
+boost::asio::io_context::executor_type Peer::get_executor() {
+    return socket_.get_executor();
+}
 
 // Returns a reference to the SSL socket
-boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& Peer::socket() {
+boost::asio::ssl::stream<peer_socket>& Peer::socket() {
     return socket_;
 }
 
+// Returns true once the SSL handshake has completed and until the connection drops
+bool Peer::is_connected() const {
+    return is_connected_;
+}
+
+// Time taken by the completed SSL handshake, zero until it has finished
+std::chrono::steady_clock::duration Peer::handshake_time() const {
+    return std::chrono::steady_clock::duration(handshake_ticks_.load());
+}
+
+// True if the completed handshake resumed an earlier session
+bool Peer::session_resumed() const {
+    return session_resumed_;
+}
+
+// Stores client sessions in the cache so later connections to the same host can resume
+void Peer::set_session_cache(SessionCache* cache, const string& key) {
+    session_cache_ = cache;
+    session_key_ = key;
+}
+
+// Sets the callback invoked with each received message
+void Peer::set_message_handler(message_handler handler) {
+    on_message_ = std::move(handler);
+}
+
+// Sets the callback invoked when the connection is lost
+void Peer::set_close_handler(close_handler handler) {
+    on_close_ = std::move(handler);
+}
+
+// Sets the callback invoked once the handshake has completed
+void Peer::set_connect_handler(connect_handler handler) {
+    on_connect_ = std::move(handler);
+}
+
+// Sets the watermarks and the policy applied when they are crossed
+void Peer::set_backpressure(const BackpressureLimits& limits) {
+    limits_ = limits;
+}
+
+// Sets the callback invoked when the peer becomes congested or catches up
+void Peer::set_pressure_handler(pressure_handler handler) {
+    on_pressure_ = std::move(handler);
+}
+
+// Stops issuing reads on the IO thread, the remote side then blocks once the socket buffers fill
+void Peer::pause_reading() {
+    boost::asio::dispatch(socket_.get_executor(), [self = shared_from_this()]() {
+        self->reading_paused_ = true;
+        });
+}
+
+// Issues the read skipped while paused
+void Peer::resume_reading() {
+    boost::asio::dispatch(socket_.get_executor(), [self = shared_from_this()]() {
+        self->reading_paused_ = false;
+        if (self->read_stopped_) {
+            self->read_stopped_ = false;
+            self->start_read();
+        }
+        });
+}
+
+// Sets the ping interval and dead peer timeout
+void Peer::set_heartbeat(const HeartbeatSettings& settings) {
+    heartbeat_ = settings;
+}
+
+// Sets the wire format offered to the remote peer after the handshake
+void Peer::set_preferred_format(WireFormat format) {
+    preferred_format_ = format;
+}
+
+// Enables or disables compression for large messages
+void Peer::set_compression(bool enabled) {
+    compression_enabled_ = enabled;
+}
+
+// Enables or disables handing record encryption to the kernel
+void Peer::set_ktls(bool enabled) {
+    ktls_enabled_ = enabled;
+}
+
+// Sets the largest file the remote peer may send
+void Peer::set_max_download(uint64_t bytes) {
+    transfers_.set_max_incoming_size(bytes);
+}
+
+// Sets the callback the host uses to track room subscriptions
+void Peer::set_room_handler(room_handler handler) {
+    on_room_ = std::move(handler);
+}
+
+// Sets the log that received and sent chat messages are appended to
+void Peer::set_message_log(MessageLog* log) {
+    message_log_ = log;
+}
+
+// Sets the capture frames are recorded to, the connection is numbered now and described on its first frame
+void Peer::set_capture(CaptureWriter* capture) {
+    capture_ = capture;
+    capture_connection_ = capture ? capture->next_connection() : 0;
+}
+
+// Per-connection counters, also summed into Metrics::global()
+const PeerStats& Peer::stats() const {
+    return stats_;
+}
+
+// Adds n to a counter on this peer and to the process-wide total
+void Peer::count(std::atomic<uint64_t> PeerStats::* counter, uint64_t n) {
+    PeerStats::add(stats_.*counter, n);
+    PeerStats::add(Metrics::global().totals.*counter, n);
+}
+
+// Adjusts the queued message and byte gauges on this peer and the total, tracking their maximums
+void Peer::adjust_queue_depth(int64_t delta, int64_t bytes) {
+    queued_bytes_ += std::size_t(bytes);
+    for (PeerStats* stats : { &stats_, &Metrics::global().totals }) {
+        uint64_t depth = stats->queue_depth.fetch_add(uint64_t(delta), std::memory_order_relaxed) + uint64_t(delta);
+        uint64_t max = stats->queue_depth_max.load(std::memory_order_relaxed);
+        while (depth > max && !stats->queue_depth_max.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {
+        }
+        uint64_t queued = stats->queue_bytes.fetch_add(uint64_t(bytes), std::memory_order_relaxed) + uint64_t(bytes);
+        uint64_t queued_max = stats->queue_bytes_max.load(std::memory_order_relaxed);
+        while (queued > queued_max && !stats->queue_bytes_max.compare_exchange_weak(queued_max, queued, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+// Applies the slow consumer policy once more than the high watermark is queued
+void Peer::check_high_watermark() {
+    if (queued_bytes_ <= limits_.high_watermark) {
+        return;
+    }
+    if (!congested_) {
+        congested_ = true;
+        dropped_while_congested_ = 0;
+        count(&PeerStats::watermark_crossings, 1);
+        Console::instance().print_line("Peer " + remote_label() + " is not keeping up, " + std::to_string(queued_bytes_) + " bytes queued.");
+        if (on_pressure_) {
+            on_pressure_(shared_from_this(), true);
+        }
+    }
+
+    if (limits_.policy == SlowConsumerPolicy::drop_oldest) {
+        drop_oldest_messages();
+    }
+    else if (limits_.policy == SlowConsumerPolicy::disconnect && is_connected_) {
+        count(&PeerStats::slow_disconnects, 1);
+        Console::instance().print_line("Disconnecting slow peer " + remote_label() + ".");
+        shutdown();
+        handle_close();
+        // A write in flight fails and discards the queue itself
+        if (!write_in_progress_) {
+            discard_queued_frames();
+        }
+    }
+}
+
+// Reports a congested peer whose queue has drained to the low watermark
+void Peer::check_low_watermark() {
+    if (!congested_ || queued_bytes_ > limits_.low_watermark) {
+        return;
+    }
+    congested_ = false;
+    string dropped = dropped_while_congested_ > 0 ? ", " + std::to_string(dropped_while_congested_) + " messages dropped" : "";
+    Console::instance().print_line("Peer " + remote_label() + " has caught up" + dropped + ".");
+    if (on_pressure_) {
+        on_pressure_(shared_from_this(), false);
+    }
+}
+
+// Drops queued chat messages, oldest first, until the low watermark is reached. Control frames, file
+// data and history requests are kept as the connection depends on them, and so are frames being written.
+void Peer::drop_oldest_messages() {
+    uint64_t dropped = 0;
+    int64_t dropped_bytes = 0;
+    for (auto it = write_queue_.begin(); it != write_queue_.end() && queued_bytes_ - std::size_t(dropped_bytes) > limits_.low_watermark;) {
+        FrameType type = it->message->type();
+        bool droppable = !it->message->is_raw() && (type == FrameType::chat || type == FrameType::gossip || type == FrameType::history);
+        if (droppable) {
+            dropped_bytes += int64_t(it->bytes.size());
+            ++dropped;
+            it = write_queue_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    adjust_queue_depth(-int64_t(dropped), -dropped_bytes);
+    dropped_while_congested_ += dropped;
+    count(&PeerStats::dropped_messages, dropped);
+}
+
+// Releases every queued frame once the connection is unusable
+void Peer::discard_queued_frames() {
+    int64_t queued_bytes = 0;
+    for (const auto& frame : write_queue_) {
+        queued_bytes += int64_t(frame.bytes.size());
+        keep_unsent(frame);
+    }
+    adjust_queue_depth(-int64_t(write_queue_.size()), -queued_bytes);
+    write_queue_.clear();
+}
+
+// Keeps the user's own chat messages, control frames and requests are sent anew by the next connection
+void Peer::keep_unsent(const QueuedFrame& frame) {
+    if (keep_unsent_ && !frame.message->is_raw() && frame.message->type() == FrameType::chat) {
+        unsent_.push_back(frame.message);
+    }
+}
+
+// Keeps unwritten chat frames for the client to send again
+void Peer::set_keep_unsent(bool enabled) {
+    keep_unsent_ = enabled;
+}
+
+// Collects what is still queued behind what failed earlier, and stops collecting
+std::vector<std::shared_ptr<const OutboundMessage>> Peer::take_unsent_messages() {
+    // A write still in flight will fail, its frames go first as they were queued first
+    std::vector<std::shared_ptr<const OutboundMessage>> unsent;
+    for (const auto& frame : writing_) {
+        keep_unsent(frame);
+    }
+    discard_queued_frames();
+    // Room messages waiting for the binary format
+    for (const auto& request : pending_requests_) {
+        keep_unsent(QueuedFrame{ request, string_view(), std::chrono::steady_clock::now() });
+    }
+    keep_unsent_ = false;
+    unsent.swap(unsent_);
+    return unsent;
+}
+
+// Reads the address while the socket is certainly open, later readers must not touch the socket as it
+// belongs to the IO thread and may be closing
+void Peer::set_remote_label() {
+    boost::system::error_code ec;
+    auto endpoint = socket_.lowest_layer().remote_endpoint(ec);
+    remote_label_ = ec ? string("(disconnected)") : endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+}
+
+// Remote address and port for log lines and statistics
+const string& Peer::remote_label() const {
+    return remote_label_;
+}
+
+// Records a chat frame in the capture, file transfer frames are left out as they would swamp it. IO thread only.
+void Peer::capture_frame(CaptureKind kind, FrameType type, uint8_t colour_id, string_view name, string_view body) {
+    if (!capture_ || (type != FrameType::chat && type != FrameType::gossip && type != FrameType::history)) {
+        return;
+    }
+    if (!capture_opened_) {
+        capture_opened_ = true;
+        capture_->record_open(capture_connection_, remote_label());
+    }
+    capture_->record(kind, capture_connection_, type, colour_id, name, body);
+}
+
+// Marks the peer disconnected and notifies the close handler exactly once
+void Peer::handle_close() {
+    if (is_connected_.exchange(false)) {
+        PeerStats::add(Metrics::global().sessions_closed, 1);
+    }
+    if (!is_closed_.exchange(true)) {
+        // Abandon transfers on the IO thread, downloads keep their part file for resuming
+        boost::asio::post(socket_.get_executor(), [self = shared_from_this()]() {
+            self->transfers_.close();
+            // Release the peer now rather than at the next heartbeat check
+            self->heartbeat_timer_.cancel();
+            });
+        if (on_close_) {
+            on_close_(shared_from_this());
+        }
+    }
+}
+
 // Initiates an SSL handshake (either host or client mode) for secure communication
 void Peer::start_handshake(boost::asio::ssl::stream_base::handshake_type type) {
-    std::cout << "Starting handshake..." << std::endl;
+    Console::instance().print_line("Starting handshake...");
+    handshake_start_ = std::chrono::steady_clock::now();
+    if (remote_label_.empty()) {
+        set_remote_label();
+    }
+
+    // Chat messages are small, send them immediately instead of waiting for Nagle's algorithm
+    boost::system::error_code option_ec;
+    socket_.lowest_layer().set_option(tcp::no_delay(true), option_ec);
+    // Peers that do not answer pings are still dropped eventually by the operating system
+    socket_.lowest_layer().set_option(boost::asio::socket_base::keep_alive(true), option_ec);
+
+    // Offer a stored session so the host can skip the full handshake
+    if (type == boost::asio::ssl::stream_base::client && session_cache_) {
+        session_cache_->prepare(socket_.native_handle(), &session_key_);
+    }
+    // The kernel needs the traffic secrets and record counts, OpenSSL only reports them while it works
+    if (ktls_enabled_) {
+        ktls_track(socket_.native_handle(), &ktls_);
+    }
 	// Start the asynchronous handshake operation
     socket_.async_handshake(type, [self = shared_from_this()](boost::system::error_code ec) {
         if (!ec) {
 			// Handshake successful, start reading messages
-            std::cout << "Handshake successful." << std::endl;
+            self->handshake_ticks_ = (std::chrono::steady_clock::now() - self->handshake_start_).count();
+            self->session_resumed_ = SSL_session_reused(self->socket_.native_handle()) == 1;
+            self->stats_.handshake.record(self->handshake_time());
+            Metrics::global().totals.handshake.record(self->handshake_time());
+            PeerStats::add(Metrics::global().sessions_opened, 1);
+            Console::instance().print_line(self->session_resumed_ ? "Handshake successful (session resumed)." : "Handshake successful.");
             self->is_connected_ = true;
+            // Nothing has been written since the handshake, the kernel can take over sending right away
+            if (self->ktls_enabled_) {
+                self->start_ktls_send();
+            }
+            // Offer the binary format, the connection stays on text lines until the peer accepts
+            if (self->preferred_format_ == WireFormat::binary) {
+                string offer = string(HELLO_LINE) + "\n";
+                // Compressed frames are binary, so compression is only offered alongside it
+                if (self->compression_enabled_) {
+                    offer.append(COMPRESS_LINE).append("\n");
+                }
+                // Pings are binary frames, so they are only sent once the switch has happened
+                offer.append(HEARTBEAT_LINE).append("\n");
+                // Every peer can pause for the remote side's receive handover, whether or not it uses the kernel
+                offer.append(KTLS_LINE).append("\n");
+                self->queue_frame(OutboundMessage::raw(offer));
+            }
             self->start_read();
+            if (self->heartbeat_.interval.count() > 0) {
+                self->last_heard_ = std::chrono::steady_clock::now();
+                self->schedule_heartbeat();
+            }
+            if (self->on_connect_) {
+                self->on_connect_(self);
+            }
         }
         else {
 			// Handshake failed, set connection status to false
-            std::cout << "Handshake failed: " << ec.message() << std::endl;
-            self->is_connected_ = false;
+            self->count(&PeerStats::errors, 1);
+            Console::instance().print_line("Handshake failed: " + ec.message());
+            self->handle_close();
         }
         });
 }
 
 // Asynchronous read operation to receive messages from the peer
 void Peer::start_read() {
-	// Start an asynchronous read operation to read until a newline character is encountered
-    async_read_until(socket_, buffer_, "\n", [self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
+    if (reading_paused_) {
+        read_stopped_ = true;
+        return;
+    }
+
+    // Move any partial frame to the front so the read gets a contiguous free tail
+    if (read_begin_ == read_end_) {
+        read_begin_ = read_end_ = 0;
+    }
+    else if (read_buffer_.size() - read_end_ < MIN_READ_SPACE) {
+        std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+        read_end_ -= read_begin_;
+        read_begin_ = 0;
+    }
+    // Grow only when a single frame is larger than the buffer
+    if (read_buffer_.size() - read_end_ < MIN_READ_SPACE) {
+        read_buffer_.resize(read_buffer_.size() * 2);
+    }
+
+    auto free_space = boost::asio::buffer(read_buffer_.data() + read_end_, read_buffer_.size() - read_end_);
+    auto handler = make_pooled_handler(read_handler_memory_, [self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
         if (!ec) {
-			// Extract the message from the buffer
-            std::istream is(&self->buffer_);
-            string message;
-            std::getline(is, message);
-
-            if (!message.empty()) {
-                // Extract colour and message from received string
-                size_t separator = message.find('|');
-                if (separator != string::npos) {
-                    string colour_str = message.substr(0, separator);
-                    string text_message = message.substr(separator + 1);
-
-                    Color message_colour = Peer::string_to_colour(colour_str);
-
-                    // Find the colon after the name to separate the username and message
-                    size_t name_end = text_message.find(':');
-                    if (name_end != string::npos) {
-                        // Extract the user's name and the actual message
-                        string user_name = text_message.substr(0, name_end + 1); // Include the colon
-                        string user_message = text_message.substr(name_end + 1);
-
-                        // Render the name in colour and message in default colour
-                        ftxui::Screen name_screen(user_name.size(), 1);
-                        auto rendered_name = ftxui::text(user_name) | ftxui::color(message_colour);
-                        Render(name_screen, rendered_name);
-
-                        // Print the coloured name and uncoloured message
-                        std::cout << "\33[2K\r" << name_screen.ToString() << user_message << std::endl;
-                    }
-                    else {
-                        // In case we don't find the colon, print the whole message in default format
-                        std::cout << "\33[2K\r" << text_message << std::endl;
-                    }
+            self->count(&PeerStats::read_calls, 1);
+            self->count(&PeerStats::bytes_in, length);
+            self->read_end_ += length;
+            if (!self->process_read_buffer()) {
+                self->count(&PeerStats::errors, 1);
+                Console::instance().print_line("Protocol error, closing connection.");
+                self->shutdown();
+                self->handle_close();
+                return;
+            }
+            if (self->ktls_switch_pending_) {
+                self->finish_ktls_handover();
+            }
+            // Show everything this read delivered with a single prompt redraw and flush
+            if (self->prompt_dirty_) {
+                self->prompt_dirty_ = false;
+                self->display_prompt();
+                // Hand the logged messages to the operating system along with the console output
+                if (self->message_log_) {
+                    self->message_log_->flush();
                 }
-                else {
-					// In case we don't find the separator, print the whole message in default format
-                    std::cout << "\33[2K\r" << message << std::endl;
+            }
+            self->start_read();
+        }
+        else {
+            if (ec == boost::asio::error::eof || ec == boost::asio::ssl::error::stream_truncated) {
+                // An orderly disconnect, keep the session resumable
+                SSL_set_shutdown(self->socket_.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+                Console::instance().print_line("Peer disconnected.");
+            }
+            else if (ec != boost::asio::error::operation_aborted) {
+                self->count(&PeerStats::errors, 1);
+                Console::instance().print_line("Error reading message: " + ec.message());
+            }
+            self->handle_close();
+        }
+        });
+    // Once the kernel decrypts, the TCP socket delivers plaintext
+    if (ktls_receive_) {
+        socket_.next_layer().async_read_some(free_space, std::move(handler));
+    }
+    else {
+        socket_.async_read_some(free_space, std::move(handler));
+    }
+}
+
+// Parses every complete frame in the receive buffer without copying it
+bool Peer::process_read_buffer() {
+    while (read_begin_ < read_end_) {
+        string_view pending(read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+        MessageView message;
+        std::size_t consumed = 0;
+
+        ParseResult result = read_format_ == WireFormat::binary
+            ? parse_binary_frame(pending, message, consumed)
+            : parse_text_frame(pending, message, consumed);
+        if (result == ParseResult::incomplete) return true;
+        if (result == ParseResult::invalid) return false;
+
+        // Negotiation lines only appear in text format and never carry a colour
+        if (read_format_ == WireFormat::text && message.name.empty() && !message.body.empty() && message.body.front() == '#') {
+            handle_control(message.body);
+        }
+        else {
+            // Inflate compressed bodies into a buffer owned by the peer, the view is repointed at it
+            if (message.compressed) {
+                if (!decompress_body(message.body, inflate_buffer_, MAX_FRAME_PAYLOAD)) {
+                    return false;
                 }
-				// Display the prompt for new input
-                self->display_prompt();
+                message.body = inflate_buffer_;
+                message.compressed = false;
             }
+            handle_message(message);
+        }
+        read_begin_ += consumed;
+    }
+    return true;
+}
 
-			// Consume the read data and start reading again
-            self->buffer_.consume(length);
-            self->start_read();
+// Handles a wire format negotiation line
+void Peer::handle_control(string_view line) {
+    if (line == HELLO_LINE) {
+        // The peer understands binary frames, announce the switch and use binary from here on
+        if (preferred_format_ == WireFormat::binary && write_format_ == WireFormat::text) {
+            queue_frame(OutboundMessage::raw(string(SWITCH_LINE) + "\n"));
+            write_format_ = WireFormat::binary;
+            // The peer can now answer the requests made before the switch
+            for (auto& request : pending_requests_) {
+                queue_frame(std::move(request));
+            }
+            pending_requests_.clear();
+        }
+    }
+    else if (line == SWITCH_LINE) {
+        // Every frame after this line is binary
+        read_format_ = WireFormat::binary;
+    }
+    else if (line == COMPRESS_LINE) {
+        // The peer can inflate, large binary frames to it are compressed from here on
+        compress_writes_ = compression_enabled_;
+    }
+    else if (line == HEARTBEAT_LINE) {
+        // The peer answers pings, its silence can be trusted as a sign the connection is dead
+        remote_heartbeat_ = true;
+    }
+    else if (line == KTLS_LINE) {
+        // The peer will stop writing on request, the receive side can follow the send side to the kernel
+        if (ktls_send_ && write_format_ == WireFormat::binary) {
+            ktls_pause_sent_ = true;
+            queue_frame(OutboundMessage::create(FrameType::ktls_pause, 0, string_view(), string_view()));
+        }
+        else {
+            ktls_forget(ktls_, false);
+        }
+    }
+}
+
+// Displays a received message and hands it to the relay callback
+void Peer::handle_message(const MessageView& message) {
+    if (message.type == FrameType::ping) {
+        queue_frame(OutboundMessage::create(FrameType::pong, 0, string_view(), message.body));
+        return;
+    }
+    if (message.type == FrameType::pong) {
+        handle_pong(message.body);
+        return;
+    }
+    if (message.type == FrameType::history_request) {
+        handle_history_request(message.body);
+        return;
+    }
+    if (message.type == FrameType::ktls_pause) {
+        // Both sides asking at once would leave each waiting for the other, the host answers second
+        if (ktls_pause_sent_ && SSL_is_server(socket_.native_handle()) == 1) {
+            ktls_pause_deferred_ = true;
         }
         else {
-            std::cout << "Error reading message: " << ec.message() << std::endl;
+            queue_frame(OutboundMessage::create(FrameType::ktls_paused, 0, string_view(), string_view()));
+        }
+        return;
+    }
+    if (message.type == FrameType::ktls_paused) {
+        ktls_switch_pending_ = true;
+        return;
+    }
+    if (message.type == FrameType::ktls_resume) {
+        writes_held_ = false;
+        if (!write_in_progress_) {
+            if (has_pending_writes()) {
+                start_write();
+            }
+            else {
+                send_history_batch();
+            }
+        }
+        return;
+    }
+    if (message.type == FrameType::join_room || message.type == FrameType::leave_room) {
+        if (on_room_) {
+            on_room_(shared_from_this(), message.type == FrameType::join_room, message.body);
+        }
+        return;
+    }
+    if (message.type >= FrameType::file_offer && message.type <= FrameType::file_cancel) {
+        transfers_.handle(message);
+        // An acknowledgement may have opened a sender's window
+        if (!write_in_progress_ && has_pending_writes()) {
+            start_write();
+        }
+        return;
+    }
+    // Replayed history is already in the sender's log and is neither logged again nor relayed
+    bool live = message.type == FrameType::chat || message.type == FrameType::gossip;
+    // Any other type comes from a newer or misbehaving peer and is ignored rather than shown as chat
+    if (!live && message.type != FrameType::history) {
+        return;
+    }
+    if (message.name.empty() && message.body.empty()) {
+        return;
+    }
+
+    count(&PeerStats::messages_in, 1);
+    capture_frame(CaptureKind::inbound, message.type, message.colour_id, message.name, message.body);
+    // The relay sees a message first so copies arriving over a second mesh link are never shown
+    if (live && on_message_ && !on_message_(shared_from_this(), message)) {
+        return;
+    }
+    display_message(message);
+    if (live && message_log_) {
+        message_log_->append(message.colour_id, message.name, message.body);
+    }
+}
+
+// Records the round trip time of a ping, the token is the steady clock tick count it was sent at
+void Peer::handle_pong(string_view token) {
+    std::chrono::steady_clock::rep sent = 0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), sent);
+    auto now = std::chrono::steady_clock::now();
+    if (result.ec != std::errc() || sent > now.time_since_epoch().count()) {
+        return;
+    }
+    auto rtt = now - std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(sent));
+    uint64_t rtt_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(rtt).count());
+    stats_.rtt.record(rtt);
+    Metrics::global().totals.rtt.record(rtt);
+    stats_.last_rtt_us.store(rtt_us, std::memory_order_relaxed);
+    Metrics::global().totals.last_rtt_us.store(rtt_us, std::memory_order_relaxed);
+}
+
+// Arms the heartbeat timer for the next check, IO thread only
+void Peer::schedule_heartbeat() {
+    heartbeat_timer_.expires_after(heartbeat_.interval);
+    heartbeat_timer_.async_wait(make_pooled_handler(heartbeat_handler_memory_, [self = shared_from_this()](boost::system::error_code ec) {
+        if (!ec) {
+            self->check_heartbeat();
+        }
+        }));
+}
+
+// Runs every heartbeat interval. Arriving data is noticed through bytes_in, so the read path does no
+// extra work and a peer's quiet time is known to within one interval.
+void Peer::check_heartbeat() {
+    if (!is_connected_) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    uint64_t bytes_in = stats_.bytes_in.load(std::memory_order_relaxed);
+    // While reading is paused the peer's data waits in the socket, that is not silence
+    if (bytes_in != heartbeat_bytes_in_ || reading_paused_) {
+        heartbeat_bytes_in_ = bytes_in;
+        last_heard_ = now;
+    }
+
+    // Peers that never announced heartbeat support may just be idle, they are left to TCP keepalive
+    if (remote_heartbeat_ && write_format_ == WireFormat::binary) {
+        auto quiet = now - last_heard_;
+        if (quiet >= heartbeat_.timeout) {
+            count(&PeerStats::heartbeat_timeouts, 1);
+            Console::instance().print_line("No response from " + remote_label() + " for "
+                + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(quiet).count()) + "s, closing connection.");
+            close_socket();
+            handle_close();
+            return;
+        }
+        if (quiet >= heartbeat_.interval || ++checks_since_ping_ >= BUSY_PING_CHECKS) {
+            checks_since_ping_ = 0;
+            count(&PeerStats::pings_sent, 1);
+            queue_frame(OutboundMessage::create(FrameType::ping, 0, string_view(), std::to_string(now.time_since_epoch().count())));
+        }
+    }
+    schedule_heartbeat();
+}
+
+// Gives the kernel the sending direction, nothing is written through OpenSSL afterwards
+void Peer::start_ktls_send() {
+    string error;
+    bool started = ktls_start(int(socket_.lowest_layer().native_handle()), socket_.native_handle(), ktls_, true, error);
+    // The kernel has its own copy of the keys, or writes stay with OpenSSL for good
+    ktls_forget(ktls_, true);
+    if (started) {
+        ktls_send_ = true;
+        count(&PeerStats::ktls_send, 1);
+        return;
+    }
+    // Reading is only handed over after sending, so its secret will not be needed either
+    ktls_forget(ktls_, false);
+    count(&PeerStats::ktls_fallbacks, 1);
+    Console::instance().print_line("Kernel TLS not used, " + error + ".");
+}
+
+// Runs after the read that delivered ktls_paused was parsed. The remote peer writes nothing more until
+// it sees ktls_resume, so every record it sent has been decrypted once OpenSSL holds no more input,
+// and the kernel can carry on from the next one.
+void Peer::finish_ktls_handover() {
+    ktls_switch_pending_ = false;
+    ktls_pause_sent_ = false;
+    SSL* ssl = socket_.native_handle();
+    string error = "data was still buffered";
+    if (read_begin_ == read_end_ && SSL_pending(ssl) == 0 && BIO_ctrl_pending(SSL_get_rbio(ssl)) == 0
+        && ktls_start(int(socket_.lowest_layer().native_handle()), ssl, ktls_, false, error)) {
+        ktls_receive_ = true;
+        count(&PeerStats::ktls_receive, 1);
+    }
+    else {
+        count(&PeerStats::ktls_fallbacks, 1);
+        Console::instance().print_line("Kernel TLS not used for reading, " + error + ".");
+    }
+    ktls_forget(ktls_, false);
+    queue_frame(OutboundMessage::create(FrameType::ktls_resume, 0, string_view(), string_view()));
+    // The remote peer asked first, it is answered now that this side no longer waits on it
+    if (ktls_pause_deferred_) {
+        ktls_pause_deferred_ = false;
+        queue_frame(OutboundMessage::create(FrameType::ktls_paused, 0, string_view(), string_view()));
+    }
+}
+
+// Starts replaying the log to the remote peer, replacing any replay still in progress
+void Peer::handle_history_request(string_view spec) {
+    if (!message_log_) {
+        return;
+    }
+
+    uint64_t end = message_log_->end_record();
+    uint64_t from = end;
+    uint64_t value = 0;
+    auto parse_value = [&value](string_view digits) {
+        return std::from_chars(digits.data(), digits.data() + digits.size(), value).ec == std::errc();
+    };
+    if (spec.substr(0, 5) == "last=" && parse_value(spec.substr(5))) {
+        from = end - std::min(value, end);
+    }
+    else if (spec.substr(0, 6) == "since=" && parse_value(spec.substr(6))) {
+        from = message_log_->first_record_since(int64_t(value));
+    }
+
+    history_next_ = std::max(from, message_log_->first_record());
+    history_end_ = end;
+    if (!write_in_progress_) {
+        send_history_batch();
+    }
+}
+
+// Queues the next batch of a replay straight from the mapped log, the rest follows once it is written
+void Peer::send_history_batch() {
+    if (!message_log_ || history_next_ >= history_end_) {
+        return;
+    }
+
+    std::size_t limit = std::size_t(std::min<uint64_t>(HISTORY_BATCH, history_end_ - history_next_));
+    uint64_t next = message_log_->read(history_next_, limit, [this](const LogRecord& record) {
+        // A record too long for a frame would make the client drop the connection, skip it
+        if (record.body.size() > MAX_MESSAGE_BODY) {
+            return;
         }
+        queue_frame(OutboundMessage::create(FrameType::history, record.colour_id, record.name, record.body));
         });
+    // Stop if the log could not be read rather than asking for the same records forever
+    history_next_ = next > history_next_ ? next : history_end_;
+}
+
+// Buffers a received message with the sender's name in their colour, the prompt redraw flushes it
+void Peer::display_message(const MessageView& message) {
+    Console::instance().write_message(message.name, message.colour_id, message.body, message.room);
+    prompt_dirty_ = true;
 }
 
 // Sends a message asynchronously to the connected peer
-void Peer::send_message(const string& message) {
+void Peer::send_message(const string& message, string_view room) {
+    send_messages(std::span<const string>(&message, 1), room);
+}
+
+// Sends several messages in order, logging all of them before a single flush
+void Peer::send_messages(std::span<const string> messages, string_view room) {
     if (!is_connected_) {
 		// If not connected, display an error message
-        std::cout << "Error: Not connected to peer yet." << std::endl;
+        Console::instance().print_line("Error: Not connected to peer yet.");
+        return;
+    }
+
+    for (const string& message : messages) {
+        if (message.size() > MAX_MESSAGE_BODY) {
+            Console::instance().print_line(oversized_message_error(message.size()));
+            continue;
+        }
+        // Construct the message with the user's name and colour and queue it for writing
+        auto outbound = OutboundMessage::create(FrameType::chat, colour_to_id(colour_), name, message, MessageId(), 0, room);
+        if (message_log_) {
+            message_log_->append(outbound->colour_id(), outbound->name(), outbound->body());
+        }
+        deliver(std::move(outbound));
+    }
+    if (message_log_) {
+        message_log_->flush();
+    }
+}
+
+// Queues a message, the caller may share the same message between many peers
+void Peer::deliver(std::shared_ptr<const OutboundMessage> message) {
+    if (!is_connected_) {
+        return;
+    }
+
+    // Queue from the IO thread so the socket and queue are only ever touched by one thread
+    boost::asio::post(socket_.get_executor(), make_pooled_handler([self = shared_from_this(), message = std::move(message)]() mutable {
+        self->queue_frame(std::move(message));
+        }));
+}
+
+// Starts offering a file once on the IO thread, chunks go out as the receiver's window allows
+void Peer::send_file(const FileOffer& offer) {
+    boost::asio::post(socket_.get_executor(), [self = shared_from_this(), offer]() {
+        if (!self->is_connected_ || self->write_format_ != WireFormat::binary) {
+            Console::instance().print_line("Error: The peer does not support file transfer.");
+            return;
+        }
+        self->transfers_.offer(offer);
+        });
+}
+
+// Asks the remote peer to replay its log once the binary format is in use
+void Peer::request_history(const string& spec) {
+    queue_request(OutboundMessage::create(FrameType::history_request, 0, string_view(), spec));
+}
+
+// Subscribes to a room on the remote host once the binary format is in use
+void Peer::join_room(const string& room) {
+    queue_request(OutboundMessage::create(FrameType::join_room, 0, string_view(), room));
+}
+
+// Unsubscribes from a room on the remote host
+void Peer::leave_room(const string& room) {
+    queue_request(OutboundMessage::create(FrameType::leave_room, 0, string_view(), room));
+}
+
+// Queues a binary-only request on the IO thread, holding it until the format switch if need be
+void Peer::queue_request(std::shared_ptr<const OutboundMessage> request) {
+    boost::asio::post(socket_.get_executor(), [self = shared_from_this(), request = std::move(request)]() mutable {
+        if (self->write_format_ == WireFormat::binary) {
+            self->queue_frame(std::move(request));
+        }
+        else {
+            self->pending_requests_.push_back(std::move(request));
+        }
+        });
+}
+
+// Encodes a message in the current write format and queues it, IO thread only
+void Peer::queue_frame(std::shared_ptr<const OutboundMessage> message) {
+    // The connection may have closed while the message was posted
+    if (!is_connected_) {
+        keep_unsent(QueuedFrame{ std::move(message), string_view(), std::chrono::steady_clock::now() });
+        return;
+    }
+    // The text format cannot carry a room, hold the message until the switch to binary
+    if (!message->room().empty() && write_format_ == WireFormat::text && preferred_format_ == WireFormat::binary) {
+        pending_requests_.push_back(std::move(message));
+        return;
+    }
+    string_view bytes = message->encoded(write_format_, compress_writes_);
+    // Binary-only frames have no text encoding and are dropped for text peers
+    if (bytes.empty()) {
+        return;
+    }
+    if (!message->is_raw()) {
+        capture_frame(CaptureKind::outbound, message->type(), message->colour_id(), message->name(), message->body());
+    }
+    write_queue_.push_back(QueuedFrame{ std::move(message), bytes, std::chrono::steady_clock::now() });
+    adjust_queue_depth(1, int64_t(bytes.size()));
+    check_high_watermark();
+    // The disconnect policy may have closed the connection
+    if (!is_connected_) {
+        return;
+    }
+    // Only one write may be in flight on the SSL stream, later frames wait for the next flush
+    if (!write_in_progress_) {
+        start_write();
+    }
+}
+
+// True if messages or file chunks are waiting to be written
+bool Peer::has_pending_writes() const {
+    return !write_queue_.empty() || transfers_.has_chunk_ready();
+}
+
+// Writes every queued frame (up to the batch limits) in one gather write
+void Peer::start_write() {
+    // The remote peer is moving its receive side to the kernel and must see nothing after ktls_paused
+    if (writes_held_) {
+        write_in_progress_ = false;
+        return;
+    }
+    write_in_progress_ = true;
+
+    // Move the queued frames into the in-flight batch, keeping them alive until the write completes
+    std::size_t batch_bytes = 0;
+    while (!writes_held_ && !write_queue_.empty() && writing_.size() < MAX_WRITE_BATCH && batch_bytes < MAX_WRITE_BATCH_BYTES) {
+        batch_bytes += write_queue_.front().bytes.size();
+        writes_held_ = write_queue_.front().message->type() == FrameType::ktls_paused;
+        writing_.push_back(std::move(write_queue_.front()));
+        write_queue_.pop_front();
+    }
+
+    // File data fills in behind the chat, one chunk per write so a message typed during a transfer
+    // waits for at most one chunk
+    if (!writes_held_ && writing_.size() < MAX_WRITE_BATCH && batch_bytes < MAX_WRITE_BATCH_BYTES) {
+        if (auto chunk = transfers_.next_chunk()) {
+            string_view bytes = chunk->encoded(write_format_, compress_writes_);
+            writing_.push_back(QueuedFrame{ std::move(chunk), bytes, std::chrono::steady_clock::now() });
+            adjust_queue_depth(1, int64_t(bytes.size()));
+        }
+    }
+    if (writing_.empty()) {
+        write_in_progress_ = false;
         return;
     }
 
-	// Construct the message with the user's name and colour
-    auto msg = std::make_shared<string>(Peer::colour_to_string(colour_) + "|" + name + ": " + message + "\n");
-    async_write(socket_, boost::asio::buffer(*msg), [msg, this](boost::system::error_code ec, std::size_t /*length*/) {
+    // The SSL stream linearises small buffers, so a burst goes out as few records as possible
+    write_buffers_.clear();
+    for (const auto& frame : writing_) {
+        write_buffers_.emplace_back(frame.bytes.data(), frame.bytes.size());
+    }
+
+    count(&PeerStats::write_calls, 1);
+    // Pass a view of the gather list, async_write would copy a vector into every write operation
+    std::span<const boost::asio::const_buffer> buffers(write_buffers_);
+    auto handler = make_pooled_handler(write_handler_memory_, [self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
+        // Record how long each message waited between being queued and reaching the socket
+        auto now = std::chrono::steady_clock::now();
+        int64_t written_bytes = 0;
+        for (const auto& frame : self->writing_) {
+            self->stats_.send_latency.record(now - frame.queued_at);
+            Metrics::global().totals.send_latency.record(now - frame.queued_at);
+            written_bytes += int64_t(frame.bytes.size());
+        }
+        self->count(&PeerStats::bytes_out, length);
+        self->count(&PeerStats::messages_out, self->writing_.size());
+        self->adjust_queue_depth(-int64_t(self->writing_.size()), -written_bytes);
+        if (ec) {
+            // A failed write may have sent any part of the batch, keep all of it rather than lose some
+            for (const auto& frame : self->writing_) {
+                self->keep_unsent(frame);
+            }
+        }
+        self->writing_.clear();
         if (ec) {
-            std::cout << "Error sending message: " << ec.message() << std::endl;
+            if (ec != boost::asio::error::operation_aborted) {
+                self->count(&PeerStats::errors, 1);
+                Console::instance().print_line("Error sending message: " + ec.message());
+            }
+            // Drop anything still queued, the connection is unusable
+            self->discard_queued_frames();
+            self->write_in_progress_ = false;
+            return;
+        }
+
+        self->check_low_watermark();
+
+        // Flush whatever was queued while this write was in flight
+        if (self->has_pending_writes()) {
+            self->start_write();
         }
         else {
-            display_prompt();
+            self->write_in_progress_ = false;
+            // Continue a replay only once the previous batch is on the wire
+            self->send_history_batch();
         }
         });
+    // Once the kernel encrypts, plaintext goes straight to the TCP socket
+    if (ktls_send_) {
+        async_write(socket_.next_layer(), buffers, std::move(handler));
+    }
+    else {
+        async_write(socket_, buffers, std::move(handler));
+    }
 }
 
 // Clears the line and displays a prompt with the user's name for new input
 void Peer::display_prompt() {
-    // The width is the length of the name
-    int name_width = name.size();  
-    // Create a screen to render the name
-	ftxui::Screen name_screen(name_width, 1); 
-    // Render the name in colour
-	auto prompt = ftxui::text(name) | ftxui::color(colour_); 
-    // Render the name on the screen
-	Render(name_screen, prompt); 
-    // Clear the line and display the prompt
-	std::cout << "\33[2K\r" << name_screen.ToString() << ": " << std::flush;
-}
-
-// Gracefully shuts down the connection, closing the socket if open
+    Console::instance().print_prompt(name, colour_to_id(colour_));
+}
+
+// Gracefully shuts down the connection on the peer's IO thread
 void Peer::shutdown() {
+    boost::asio::dispatch(socket_.get_executor(), [self = shared_from_this()]() {
+        self->close_socket();
+        });
+}
+
+// Closes the socket if open, IO thread only
+void Peer::close_socket() {
+    heartbeat_timer_.cancel();
 	// Close the socket and shutdown the connection
     boost::system::error_code ec;
 
+	// Mark the SSL session as cleanly closed so it stays resumable, no close_notify is exchanged
+    SSL_set_shutdown(socket_.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+
 	// Shutdown the socket
     if (socket_.lowest_layer().is_open()) {
 		// Shutdown the socket to disable further sends and receives
         socket_.lowest_layer().shutdown(tcp::socket::shutdown_both, ec);
         if (ec) {
-            std::cout << "Shutdown error: " << ec.message() << std::endl;
+            Console::instance().print_line("Shutdown error: " + ec.message());
         }
 
 		// Close the socket
         socket_.lowest_layer().close(ec);
         if (ec) {
-            std::cout << "Close error: " << ec.message() << std::endl;
+            Console::instance().print_line("Close error: " + ec.message());
         }
         else {
-            std::cout << "Connection closed successfully." << std::endl;
+            Console::instance().print_line("Connection closed successfully.");
         }
     }
     else {
-        std::cout << "Socket already closed." << std::endl;
+        Console::instance().print_line("Socket already closed.");
     }
 }
 
 // Utility function to convert a colour string to FTXUI Colour
 Color Peer::string_to_colour(const string& colour_str) {
-    if (colour_str == "red") return Color::Red;
-    if (colour_str == "green") return Color::Green;
-    if (colour_str == "blue") return Color::Blue;
-    if (colour_str == "yellow") return Color::Yellow;
-    if (colour_str == "cyan") return Color::Cyan;
-    if (colour_str == "magenta") return Color::Magenta;
-    return Color::White;
+    return colour_from_id(colour_id_from_name(colour_str));
 }
 
 // Utility function to convert FTXUI Colour to a string
 string Peer::colour_to_string(Color colour) {
-    if (colour == Color::Red) return "red";
-    if (colour == Color::Green) return "green";
-    if (colour == Color::Blue) return "blue";
-    if (colour == Color::Yellow) return "yellow";
-    if (colour == Color::Cyan) return "cyan";
-    if (colour == Color::Magenta) return "magenta";
-    return "white";
+    return string(colour_name(colour_to_id(colour)));
 }
@@ -1,11 +1,24 @@
 #ifndef PEER_H
 #define PEER_H
 
+#include "buffer_pool.h"
+#include "capture.h"
+#include "file_transfer.h"
+#include "ktls.h"
+#include "message_log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "session_cache.h"
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <span>
 #include <string>
+#include <vector>
 #include <ftxui/screen/color.hpp>
 
 using boost::asio::ip::tcp;
@@ -13,25 +26,170 @@ using boost::asio::ssl::stream;
 using std::string;
 using namespace ftxui;
 
-// Class representing a peer-to-peer connection with SSL encryption
+// TCP socket bound to the io_context's own executor type. With the default any_io_executor every
+// completion is wrapped in a type-erased function on the heap, which would defeat handler allocation.
+using peer_socket = boost::asio::basic_stream_socket<tcp, boost::asio::io_context::executor_type>;
+
+// What a peer does once more than its high watermark of outbound bytes is queued
+enum class SlowConsumerPolicy : uint8_t {
+    pause_input,  // The owner stops reading its connections until the queue drains to the low watermark
+    drop_oldest,  // Queued chat messages are dropped, oldest first, down to the low watermark
+    disconnect,   // The connection is closed
+};
+
+// Bounds on the outbound bytes queued for one peer, messages being written count until the write completes
+struct BackpressureLimits {
+    std::size_t high_watermark = 1024 * 1024;  // Queued bytes at which the policy applies
+    std::size_t low_watermark = 256 * 1024;    // Queued bytes at which the peer has caught up again
+    SlowConsumerPolicy policy = SlowConsumerPolicy::drop_oldest;
+};
+
+// Keepalive timing. A peer that announced heartbeat support is pinged once nothing has been received
+// from it for `interval` and closed once nothing has been received for `timeout`. Busy connections
+// are pinged every few intervals as well so their round trip time stays current.
+struct HeartbeatSettings {
+    std::chrono::seconds interval{ 15 };  // Quiet time before a ping, 0 disables pings and timeouts
+    std::chrono::seconds timeout{ 45 };   // Quiet time after which the connection is treated as dead
+};
+
+// Class representing a peer-to-peer connection with SSL encryption. A peer belongs to one io_context run
+// by a single thread, its IO thread below. Public methods may be called from any thread unless noted.
 class Peer : public std::enable_shared_from_this<Peer> {
 public:
-    // Constructor to initialize SSL socket, connection status, user name, and colour
-    Peer(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, std::atomic<bool>& connected, const string& user_name, Color user_color);
+    // Limits on how many queued messages are coalesced into a single write
+    static constexpr std::size_t MAX_WRITE_BATCH = 64;
+    static constexpr std::size_t MAX_WRITE_BATCH_BYTES = 64 * 1024;
+    // Initial receive buffer size and the minimum free space offered to each read
+    static constexpr std::size_t READ_BUFFER_SIZE = 16 * 1024;
+    static constexpr std::size_t MIN_READ_SPACE = 4 * 1024;
+    // Logged messages queued per step when answering a history request, the next step waits for the writes
+    static constexpr std::size_t HISTORY_BATCH = 256;
+    // Heartbeat checks between pings on a connection that is never quiet long enough to be pinged
+    static constexpr unsigned BUSY_PING_CHECKS = 4;
+
+    // Called with each received live message so it can be relayed, the views are only valid during the call.
+    // Returning false marks the message as a duplicate, it is then neither displayed nor logged.
+    using message_handler = std::function<bool(const std::shared_ptr<Peer>&, const MessageView&)>;
+    // Called once when the SSL handshake completes
+    using connect_handler = std::function<void(const std::shared_ptr<Peer>&)>;
+    // Called once when the connection fails or is closed by the remote side
+    using close_handler = std::function<void(const std::shared_ptr<Peer>&)>;
+    // Called when the remote peer joins (true) or leaves (false) a room, the view is only valid during the call
+    using room_handler = std::function<void(const std::shared_ptr<Peer>&, bool join, string_view room)>;
+    // Called when the queued bytes rise above the high watermark (true) and fall to the low watermark (false)
+    using pressure_handler = std::function<void(const std::shared_ptr<Peer>&, bool congested)>;
+
+    // Constructor to initialize SSL socket, user name, and colour
+    Peer(boost::asio::io_context& io, boost::asio::ssl::context& ssl_context, const string& user_name, Color user_color);
+
+    // Executor of the io_context the peer's handlers run on
+    boost::asio::io_context::executor_type get_executor();
 
     // Returns a reference to the SSL socket
-    stream<tcp::socket>& socket();
+    stream<peer_socket>& socket();
+
+    // Returns true once the SSL handshake has completed and until the connection drops
+    bool is_connected() const;
+
+    // Time taken by the completed SSL handshake, zero until it has finished
+    std::chrono::steady_clock::duration handshake_time() const;
+
+    // True if the completed handshake resumed an earlier session
+    bool session_resumed() const;
+
+    // Per-connection counters, also summed into Metrics::global()
+    const PeerStats& stats() const;
+
+    // Remembers the remote address once the socket is connected or accepted. Call before the peer is
+    // shared with other threads, start_handshake does so if it has not been done.
+    void set_remote_label();
+
+    // Remote address and port saved by set_remote_label, safe to read from any thread afterwards
+    const string& remote_label() const;
+
+    // Stores client sessions in `cache` under `key` (host:port) so later connections can resume
+    void set_session_cache(SessionCache* cache, const string& key);
+
+    // Sets the callbacks used by the host to relay messages and track disconnects
+    void set_message_handler(message_handler handler);
+    void set_close_handler(close_handler handler);
+
+    // Sets the callback used by the host to track which rooms the remote peer is in
+    void set_room_handler(room_handler handler);
+
+    // Sets the callback used by the client to learn when the connection is ready
+    void set_connect_handler(connect_handler handler);
+
+    // Sets the watermarks and slow consumer policy, and the callback the host uses to pause input
+    void set_backpressure(const BackpressureLimits& limits);
+    void set_pressure_handler(pressure_handler handler);
+
+    // Stops and restarts reading from the connection. A read already in progress completes, the next
+    // one waits for resume_reading.
+    void pause_reading();
+    void resume_reading();
+
+    // Sets the ping interval and dead peer timeout, call before the connection starts
+    void set_heartbeat(const HeartbeatSettings& settings);
+
+    // Sets the wire format offered after the handshake, text keeps the original line format
+    void set_preferred_format(WireFormat format);
+
+    // Enables or disables offering and using compression for large messages, on by default
+    void set_compression(bool enabled);
+
+    // Hands record encryption to the kernel after the handshake where it can (see ktls.h), off by
+    // default. The context must have had enable_ktls called on it. Call before the connection starts.
+    void set_ktls(bool enabled);
+
+    // Refuses offered files larger than `bytes` (DEFAULT_MAX_DOWNLOAD by default)
+    void set_max_download(uint64_t bytes);
+
+    // Logs received and sent chat messages to `log` and answers the remote peer's history requests from it
+    void set_message_log(MessageLog* log);
+
+    // Records the chat frames received and queued on this connection to `capture`, call before the
+    // connection starts
+    void set_capture(CaptureWriter* capture);
 
     // Initiates an SSL handshake (either host or client mode) for secure communication
     void start_handshake(boost::asio::ssl::stream_base::handshake_type type);
 
-    // Sends a message asynchronously to the connected peer
-    void send_message(const string& message);
+    // Sends a message asynchronously to the connected peer, to `room` or the lobby
+    void send_message(const string& message, string_view room = LOBBY);
+
+    // Sends several messages in order, the message log is flushed once for all of them
+    void send_messages(std::span<const string> messages, string_view room = LOBBY);
+
+    // Queues a message for the peer, the message may be shared between many peers
+    void deliver(std::shared_ptr<const OutboundMessage> message);
+
+    // Streams a prepared file to the remote peer in chunks interleaved with chat, needs the binary format
+    void send_file(const FileOffer& offer);
+
+    // Asks the remote peer to replay its log, `spec` is "last=N" or "since=<unix ms>". The request
+    // is held until the binary format has been negotiated as text peers cannot answer it.
+    void request_history(const string& spec);
+
+    // Subscribes to or unsubscribes from a room on the remote host, held like request_history until
+    // the binary format is in use. Any thread.
+    void join_room(const string& room);
+    void leave_room(const string& room);
 
     // Clears the line and displays a prompt with the user's name for new input
     void display_prompt();
 
-    // Gracefully shuts down the connection, closing the socket if open
+    // Keeps the chat messages this side queued but could not write once the connection fails, so the
+    // client can send them again after reconnecting. Call before the connection starts.
+    void set_keep_unsent(bool enabled);
+
+    // Chat messages queued on this connection that were not fully written, oldest first, and stops
+    // keeping them. Messages the operating system accepted before the failure was noticed are not
+    // among them. IO thread only, once the socket has been closed.
+    std::vector<std::shared_ptr<const OutboundMessage>> take_unsent_messages();
+
+    // Gracefully shuts down the connection, closing the socket if open. Runs at once on the peer's
+    // IO thread and is posted to it from anywhere else.
     void shutdown();
 
     // Utility functions to convert between string and colour
@@ -39,13 +197,104 @@ public:
     static string colour_to_string(Color color);
 
 private:
+    // A queued message together with the encoding chosen when it was queued
+    struct QueuedFrame {
+        std::shared_ptr<const OutboundMessage> message;
+        string_view bytes;  // Encoding chosen for this peer, owned by the message
+        std::chrono::steady_clock::time_point queued_at;
+    };
+
     void start_read(); // Starts asynchronous reading of messages
+    bool process_read_buffer(); // Parses every complete frame in the receive buffer, false on a protocol error
+    void handle_control(string_view line); // Handles a wire format negotiation line
+    void handle_message(const MessageView& message); // Displays and relays a received message
+    void handle_history_request(string_view spec); // Starts replaying the log to the remote peer
+    void handle_pong(string_view token); // Records the round trip time of an answered ping
+    void schedule_heartbeat(); // Arms the heartbeat timer for the next check
+    void check_heartbeat(); // Pings a quiet peer and closes one that has stopped answering
+    void start_ktls_send(); // Moves the sending direction to the kernel once the handshake is done
+    void finish_ktls_handover(); // Moves the receiving direction to the kernel once the remote peer has paused
+    void send_history_batch(); // Queues the next HISTORY_BATCH logged messages of a replay
+    void queue_request(std::shared_ptr<const OutboundMessage> request); // Queues a binary-only request once the format allows
+    void display_message(const MessageView& message); // Buffers a received message with the name in colour
+    void queue_frame(std::shared_ptr<const OutboundMessage> message); // Queues a frame, IO thread only
+    void start_write(); // Writes all queued messages in a single gather write
+    bool has_pending_writes() const; // True if messages or file chunks are waiting to be written
+    void handle_close(); // Marks the peer disconnected and notifies the close handler once
+    void count(std::atomic<uint64_t> PeerStats::* counter, uint64_t n); // Adds to a counter here and in the totals
+    void adjust_queue_depth(int64_t delta, int64_t bytes); // Updates the queued message and byte gauges here and in the totals
+    void check_high_watermark(); // Applies the slow consumer policy if too many bytes are queued
+    void check_low_watermark(); // Reports a congested peer that has caught up
+    void drop_oldest_messages(); // Drops queued chat messages down to the low watermark
+    void discard_queued_frames(); // Releases every queued frame once the connection is unusable
+    void keep_unsent(const QueuedFrame& frame); // Holds on to an unwritten chat frame if unsent messages are kept
+    void close_socket(); // Closes the socket, IO thread only
+    void capture_frame(CaptureKind kind, FrameType type, uint8_t colour_id, string_view name, string_view body); // Records a frame if capturing
 
-    stream<tcp::socket> socket_;       // SSL socket for secure communication
-    boost::asio::streambuf buffer_;    // Buffer to store incoming data
-    std::atomic<bool>& is_connected_;  // Tracks connection state
+    stream<peer_socket> socket_;       // SSL socket for secure communication
+    std::vector<char, PoolAllocator<char>> read_buffer_; // Receive buffer, frames are parsed in place
+    HandlerMemory read_handler_memory_;  // Reused by every read's completion handler
+    HandlerMemory write_handler_memory_; // Reused by every write's completion handler
+    HandlerMemory heartbeat_handler_memory_; // Reused by every heartbeat timer wait
+    std::size_t read_begin_ = 0;       // Start of unparsed data in read_buffer_
+    std::size_t read_end_ = 0;         // End of received data in read_buffer_
+    std::atomic<bool> is_connected_;   // Tracks connection state
+    std::atomic<bool> is_closed_;      // Set once the close handler has been called
+    std::chrono::steady_clock::time_point handshake_start_;     // When start_handshake was called
+    std::atomic<std::chrono::steady_clock::rep> handshake_ticks_{ 0 }; // Handshake duration in steady_clock ticks
+    std::atomic<bool> session_resumed_{ false }; // Set when the handshake resumed a session
+    SessionCache* session_cache_ = nullptr;  // Client session store, null on the host side
+    string session_key_;               // Key sessions are stored under in session_cache_
     string name;                       // Username of the user
     Color colour_;                      // Colour of the user for display purposes
+    WireFormat preferred_format_ = WireFormat::binary; // Format offered to the remote peer
+    WireFormat read_format_ = WireFormat::text;        // Format of incoming frames, IO thread only
+    WireFormat write_format_ = WireFormat::text;       // Format of outgoing frames, IO thread only
+    bool compression_enabled_ = true;  // Offer compression and compress for peers that offer it
+    HeartbeatSettings heartbeat_;      // Ping interval and dead peer timeout
+    boost::asio::steady_timer heartbeat_timer_; // Fires every heartbeat interval while connected
+    bool remote_heartbeat_ = false;    // The remote peer answers pings, IO thread only
+    uint64_t heartbeat_bytes_in_ = 0;  // bytes_in at the previous check
+    std::chrono::steady_clock::time_point last_heard_; // When data last arrived, as seen by the checks
+    unsigned checks_since_ping_ = 0;   // Heartbeat checks since the last ping was sent
+    bool compress_writes_ = false;     // The remote peer can inflate compressed frames, IO thread only
+    bool ktls_enabled_ = false;        // Try to hand the connection to the kernel
+    KtlsState ktls_;                   // Secrets and record counts collected from OpenSSL
+    bool ktls_send_ = false;           // The kernel encrypts writes, IO thread only
+    bool ktls_receive_ = false;        // The kernel decrypts reads, IO thread only
+    bool ktls_pause_sent_ = false;     // Waiting for ktls_paused, IO thread only
+    bool ktls_pause_deferred_ = false; // A ktls_pause to answer once our own handover is done
+    bool ktls_switch_pending_ = false; // ktls_paused arrived, switch once the read is parsed
+    bool writes_held_ = false;         // ktls_paused was written, nothing follows until ktls_resume
+    string inflate_buffer_;            // Holds the body of the last compressed frame received
+    std::deque<QueuedFrame, PoolAllocator<QueuedFrame>> write_queue_; // Messages waiting for the current write to finish
+    std::vector<QueuedFrame> writing_;                      // Messages owned by the write in flight
+    std::vector<boost::asio::const_buffer> write_buffers_;  // Gather list for the write in flight
+    bool keep_unsent_ = false;         // Collect chat frames that could not be written, IO thread only
+    std::vector<std::shared_ptr<const OutboundMessage>> unsent_; // Chat frames lost with the connection, oldest first
+    bool prompt_dirty_ = false;        // Set when messages were printed since the last prompt redraw
+    bool write_in_progress_ = false;   // True while an async_write is outstanding, IO thread only
+    BackpressureLimits limits_;        // Watermarks and slow consumer policy
+    std::size_t queued_bytes_ = 0;     // Bytes queued or being written, IO thread only
+    bool congested_ = false;           // Above the high watermark and not yet back to the low one
+    uint64_t dropped_while_congested_ = 0; // Messages dropped since the peer became congested
+    bool reading_paused_ = false;      // Set by pause_reading, IO thread only
+    bool read_stopped_ = false;        // A read was skipped because reading is paused
+    MessageLog* message_log_ = nullptr; // Chat history, null if messages are not logged
+    uint64_t history_next_ = 0;        // Next record of a replay in progress, IO thread only
+    uint64_t history_end_ = 0;         // Record the replay in progress stops at
+    std::vector<std::shared_ptr<const OutboundMessage>> pending_requests_; // Requests and room messages waiting for the binary format, IO thread only
+    CaptureWriter* capture_ = nullptr; // Traffic capture, null if not capturing
+    uint64_t capture_connection_ = 0;  // Number of this connection in the capture
+    string remote_label_;              // Remote address:port, written once before the peer is shared
+    bool capture_opened_ = false;      // The open record has been written, IO thread only
+    FileTransfers transfers_;          // Files being sent or received, IO thread only
+    PeerStats stats_;                  // Counters for this connection
+    message_handler on_message_;       // Relay callback, empty for a plain client
+    close_handler on_close_;           // Disconnect callback
+    connect_handler on_connect_;       // Readiness callback, empty for the host
+    pressure_handler on_pressure_;     // Watermark callback, empty for a plain client
+    room_handler on_room_;             // Subscription callback, empty for a plain client
 };
 
 #endif // PEER_H
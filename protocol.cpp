@@ -0,0 +1,270 @@
+#include "protocol.h"
+#include "compression.h"
+#include <cctype>
+
+// Colour table indexed by the wire colour id, white is the fallback for unknown colours
+struct ColourEntry {
+    string_view name;
+    Color colour;
+};
+
+static const ColourEntry COLOURS[] = {
+    { "white", Color::White },
+    { "red", Color::Red },
+    { "green", Color::Green },
+    { "blue", Color::Blue },
+    { "yellow", Color::Yellow },
+    { "cyan", Color::Cyan },
+    { "magenta", Color::Magenta },
+};
+
+static const uint8_t COLOUR_COUNT = sizeof(COLOURS) / sizeof(COLOURS[0]);
+
+// Maps an FTXUI colour to its wire id
+uint8_t colour_to_id(Color colour) {
+    for (uint8_t id = 1; id < COLOUR_COUNT; ++id) {
+        if (COLOURS[id].colour == colour) return id;
+    }
+    return 0;
+}
+
+// Maps a wire id back to an FTXUI colour
+Color colour_from_id(uint8_t id) {
+    return id < COLOUR_COUNT ? COLOURS[id].colour : Color(Color::White);
+}
+
+// Returns the text-format name for a colour id
+string_view colour_name(uint8_t id) {
+    return id < COLOUR_COUNT ? COLOURS[id].name : COLOURS[0].name;
+}
+
+// Maps a text-format colour name to its id, unknown names map to white
+uint8_t colour_id_from_name(string_view name) {
+    for (uint8_t id = 1; id < COLOUR_COUNT; ++id) {
+        if (COLOURS[id].name == name) return id;
+    }
+    return 0;
+}
+
+// A peer drops the connection on a frame over MAX_FRAME_PAYLOAD, so a longer message is refused here
+string oversized_message_error(std::size_t size) {
+    return "Error: Message of " + std::to_string(size) + " bytes not sent, the limit is " + std::to_string(MAX_MESSAGE_BODY) + " bytes.";
+}
+
+// Room names are kept to characters that need no quoting in commands or logs
+bool is_valid_room_name(string_view room) {
+    if (room.empty() || room.size() > MAX_ROOM_LENGTH) {
+        return false;
+    }
+    for (char c : room) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses a single text line in place: colour|name: text\n
+ParseResult parse_text_frame(string_view buffer, MessageView& message, std::size_t& consumed) {
+    std::size_t newline = buffer.find('\n');
+    if (newline == string_view::npos) {
+        return buffer.size() > MAX_FRAME_PAYLOAD ? ParseResult::invalid : ParseResult::incomplete;
+    }
+
+    string_view line = buffer.substr(0, newline);
+    consumed = newline + 1;
+
+    message.type = FrameType::chat;
+    message.colour_id = 0;
+    message.name = string_view();
+    message.body = line;
+
+    // Lines without a colour separator are shown as they are
+    std::size_t separator = line.find('|');
+    if (separator == string_view::npos) {
+        return ParseResult::ok;
+    }
+
+    message.colour_id = colour_id_from_name(line.substr(0, separator));
+    string_view text_message = line.substr(separator + 1);
+    message.body = text_message;
+
+    // Split the name from the message at the first colon
+    std::size_t name_end = text_message.find(':');
+    if (name_end != string_view::npos) {
+        message.name = text_message.substr(0, name_end);
+        message.body = text_message.substr(name_end + 1);
+        // The sender puts a single space after the colon
+        if (!message.body.empty() && message.body.front() == ' ') {
+            message.body.remove_prefix(1);
+        }
+    }
+    return ParseResult::ok;
+}
+
+// Reads a big-endian u32 from the start of a buffer
+static uint32_t read_u32(const char* data) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+}
+
+// Reads a big-endian u64 from the start of a buffer
+static uint64_t read_u64(const char* data) {
+    return (uint64_t(read_u32(data)) << 32) | read_u32(data + 4);
+}
+
+// Appends a big-endian u64
+static void append_u64(string& out, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back(char(value >> shift));
+    }
+}
+
+// Parses a single length-prefixed binary frame in place
+ParseResult parse_binary_frame(string_view buffer, MessageView& message, std::size_t& consumed) {
+    if (buffer.size() < FRAME_LENGTH_SIZE) {
+        return ParseResult::incomplete;
+    }
+
+    uint32_t payload_length = read_u32(buffer.data());
+    if (payload_length < FRAME_HEADER_SIZE || payload_length > MAX_FRAME_PAYLOAD) {
+        return ParseResult::invalid;
+    }
+    if (buffer.size() < FRAME_LENGTH_SIZE + payload_length) {
+        return ParseResult::incomplete;
+    }
+
+    string_view payload = buffer.substr(FRAME_LENGTH_SIZE, payload_length);
+    uint8_t version = uint8_t(payload[0]);
+    uint8_t name_length = uint8_t(payload[3]);
+    if (version != WIRE_VERSION || FRAME_HEADER_SIZE + name_length > payload.size()) {
+        return ParseResult::invalid;
+    }
+
+    uint8_t flags = uint8_t(payload[1]);
+    message.type = FrameType(flags & ~(FRAME_COMPRESSED | FRAME_ROOM));
+    message.compressed = (flags & FRAME_COMPRESSED) != 0;
+    message.colour_id = uint8_t(payload[2]);
+    message.room = string_view();
+    std::size_t name_offset = FRAME_HEADER_SIZE;
+    if (message.type == FrameType::gossip) {
+        if (FRAME_HEADER_SIZE + GOSSIP_HEADER_SIZE + name_length > payload.size()) {
+            return ParseResult::invalid;
+        }
+        message.id.origin = read_u64(payload.data() + FRAME_HEADER_SIZE);
+        message.id.sequence = read_u64(payload.data() + FRAME_HEADER_SIZE + 8);
+        message.hops = uint8_t(payload[FRAME_HEADER_SIZE + 16]);
+        name_offset += GOSSIP_HEADER_SIZE;
+    }
+    if (flags & FRAME_ROOM) {
+        std::size_t room_length = name_offset < payload.size() ? uint8_t(payload[name_offset]) : 0;
+        if (room_length == 0 || name_offset + 1 + room_length + name_length > payload.size()) {
+            return ParseResult::invalid;
+        }
+        message.room = payload.substr(name_offset + 1, room_length);
+        name_offset += 1 + room_length;
+    }
+    message.name = payload.substr(name_offset, name_length);
+    message.body = payload.substr(name_offset + name_length);
+    consumed = FRAME_LENGTH_SIZE + payload_length;
+    return ParseResult::ok;
+}
+
+// Appends a text line: colour|name: text\n
+void append_text_frame(string& out, uint8_t colour_id, string_view name, string_view body) {
+    string_view colour = colour_name(colour_id);
+    out.reserve(out.size() + colour.size() + name.size() + body.size() + 4);
+    out.append(colour).append(1, '|').append(name).append(": ").append(body).append(1, '\n');
+}
+
+// Appends a length-prefixed binary frame
+void append_binary_frame(string& out, FrameType type, uint8_t colour_id, string_view name, string_view body,
+    const MessageId& id, uint8_t hops, bool compressed, string_view room) {
+    if (name.size() > MAX_NAME_LENGTH) {
+        name = name.substr(0, MAX_NAME_LENGTH);
+    }
+    if (room.size() > MAX_ROOM_LENGTH) {
+        room = room.substr(0, MAX_ROOM_LENGTH);
+    }
+
+    std::size_t id_size = type == FrameType::gossip ? GOSSIP_HEADER_SIZE : 0;
+    std::size_t room_size = room.empty() ? 0 : 1 + room.size();
+    uint32_t payload_length = uint32_t(FRAME_HEADER_SIZE + id_size + room_size + name.size() + body.size());
+    out.reserve(out.size() + FRAME_LENGTH_SIZE + payload_length);
+    out.push_back(char(payload_length >> 24));
+    out.push_back(char(payload_length >> 16));
+    out.push_back(char(payload_length >> 8));
+    out.push_back(char(payload_length));
+    out.push_back(char(WIRE_VERSION));
+    out.push_back(char(uint8_t(type) | (compressed ? FRAME_COMPRESSED : 0) | (room.empty() ? 0 : FRAME_ROOM)));
+    out.push_back(char(colour_id));
+    out.push_back(char(name.size()));
+    if (type == FrameType::gossip) {
+        append_u64(out, id.origin);
+        append_u64(out, id.sequence);
+        out.push_back(char(hops));
+    }
+    if (!room.empty()) {
+        out.push_back(char(room.size()));
+        out.append(room);
+    }
+    out.append(name).append(body);
+}
+
+// Constructor for a chat message, the id and hops are only written for gossip frames
+OutboundMessage::OutboundMessage(FrameType type, uint8_t colour_id, string_view name, string_view body, const MessageId& id, uint8_t hops,
+    string_view room)
+    : type_(type), colour_id_(colour_id), name_(name), body_(body), room_(room), id_(id), hops_(hops) {}
+
+// Creates a shared message, the object and its reference count share one pool block
+std::shared_ptr<const OutboundMessage> OutboundMessage::create(FrameType type, uint8_t colour_id, string_view name, string_view body,
+    const MessageId& id, uint8_t hops, string_view room) {
+    return std::allocate_shared<const OutboundMessage>(PoolAllocator<OutboundMessage>(), type, colour_id, name, body, id, hops, room);
+}
+
+// Wraps bytes that are written verbatim whatever the wire format
+std::shared_ptr<const OutboundMessage> OutboundMessage::raw(string_view bytes) {
+    auto message = std::allocate_shared<OutboundMessage>(PoolAllocator<OutboundMessage>(), FrameType::chat, 0, string_view(), bytes);
+    message->is_raw_ = true;
+    return message;
+}
+
+// Returns the encoded frame for the given format, encoding it on first use
+string_view OutboundMessage::encoded(WireFormat format, bool compressed) const {
+    if (is_raw_) {
+        return body_;
+    }
+
+    // Frames are built in reused per-thread buffers and copied once into a pool block of the right size
+    static thread_local string scratch;
+    static thread_local string deflated;
+
+    if (compressed && format == WireFormat::binary) {
+        // Small bodies and bodies that do not shrink fall back to the plain binary frame
+        std::call_once(encode_once_[2], [this]() {
+            deflated.clear();
+            if (compress_body(body_, deflated)) {
+                scratch.clear();
+                append_binary_frame(scratch, type_, colour_id_, name_, deflated, id_, hops_, true, room_);
+                encoded_[2].assign(scratch.data(), scratch.size());
+            }
+            });
+        if (!encoded_[2].empty()) {
+            return encoded_[2];
+        }
+    }
+
+    std::size_t index = static_cast<std::size_t>(format);
+    std::call_once(encode_once_[index], [this, format, index]() {
+        scratch.clear();
+        if (format == WireFormat::binary) {
+            append_binary_frame(scratch, type_, colour_id_, name_, body_, id_, hops_, false, room_);
+        }
+        else if (type_ == FrameType::chat || type_ == FrameType::history || type_ == FrameType::gossip) {
+            // Replayed history and gossip reach text peers as ordinary chat lines
+            append_text_frame(scratch, colour_id_, name_, body_);
+        }
+        encoded_[index].assign(scratch.data(), scratch.size());
+        });
+    return encoded_[index];
+}
@@ -0,0 +1,174 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "buffer_pool.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <ftxui/screen/color.hpp>
+
+using std::string;
+using std::string_view;
+using namespace ftxui;
+
+// Wire formats a connection can use, text is the original colour|name: text\n line format
+enum class WireFormat : uint8_t {
+    text = 0,
+    binary = 1,
+};
+
+// Frame types carried in the binary format, text lines are always chat messages
+enum class FrameType : uint8_t {
+    chat = 1,
+    history = 2,          // A message replayed from the sender's log, shown but not logged again
+    history_request = 3,  // Asks for logged messages, body is "last=N" or "since=<unix ms>"
+    gossip = 4,           // A chat message relayed across the mesh, carries a message id and hop limit
+    file_offer = 5,       // File transfer frames, see file_transfer.h
+    file_accept = 6,
+    file_chunk = 7,
+    file_ack = 8,
+    file_end = 9,
+    file_cancel = 10,
+    join_room = 11,       // Subscribes the sender to the room named in the body, ALL_ROOMS for every room
+    leave_room = 12,      // Unsubscribes the sender from the room named in the body
+    ping = 13,            // Asks for a pong, the body is an opaque token
+    pong = 14,            // Answers a ping with the same body
+    ktls_pause = 15,      // Asks the peer to stop writing so the receive side can move to the kernel, see ktls.h
+    ktls_paused = 16,     // Last frame written until ktls_resume arrives
+    ktls_resume = 17,     // The receive side has moved, or stayed, writing may continue
+};
+
+// Set in the type byte of a binary frame whose body is compressed, see compression.h
+const uint8_t FRAME_COMPRESSED = 0x80;
+// Set in the type byte of a binary frame sent to a room other than the lobby
+const uint8_t FRAME_ROOM = 0x40;
+
+// Version byte written in every binary frame
+const uint8_t WIRE_VERSION = 1;
+
+// Binary frame layout: u32 big-endian payload length, then the payload:
+// u8 version, u8 type, u8 colour id, u8 name length, name bytes, body bytes
+const std::size_t FRAME_LENGTH_SIZE = 4;
+const std::size_t FRAME_HEADER_SIZE = 4;
+// Largest payload accepted from a peer, anything bigger is treated as a protocol error
+const std::size_t MAX_FRAME_PAYLOAD = 1024 * 1024;
+// Names are length-prefixed with a single byte
+const std::size_t MAX_NAME_LENGTH = 255;
+// Gossip frames carry u64 origin node, u64 sequence and u8 hops left between the header and the name
+const std::size_t GOSSIP_HEADER_SIZE = 8 + 8 + 1;
+// Frames with FRAME_ROOM carry u8 room length and the room name next, before the name
+const std::size_t MAX_ROOM_LENGTH = 64;
+// Longest message body that fits a frame of any type with the longest room tag and name
+const std::size_t MAX_MESSAGE_BODY = MAX_FRAME_PAYLOAD - FRAME_HEADER_SIZE - GOSSIP_HEADER_SIZE - 1 - MAX_ROOM_LENGTH - MAX_NAME_LENGTH;
+// Room every session starts in, messages without a room tag belong to it
+const string_view LOBBY = "";
+// Joined by mesh links, which carry the messages of every room
+const string_view ALL_ROOMS = "*";
+// Links a message may cross in total, counting the first one out of the node it entered the mesh at
+const uint8_t MAX_HOPS = 8;
+
+// Control lines exchanged in text format to negotiate the binary format
+const string_view HELLO_LINE = "#hello wire=1";
+const string_view SWITCH_LINE = "#switch binary";
+// Sent alongside the hello by peers that answer ping frames
+const string_view HEARTBEAT_LINE = "#heartbeat";
+
+// Identifies a message across the mesh: the node it entered at and that node's sequence number
+struct MessageId {
+    uint64_t origin = 0;
+    uint64_t sequence = 0;
+
+    bool operator==(const MessageId& other) const { return origin == other.origin && sequence == other.sequence; }
+};
+
+// A parsed message, the views point into the receive buffer and are only valid until it is consumed
+struct MessageView {
+    FrameType type = FrameType::chat;
+    uint8_t colour_id = 0;
+    string_view name;   // Sender name without the trailing colon, empty if the line had none
+    string_view body;   // Message text
+    string_view room;   // Room the message was sent to, empty for the lobby
+    MessageId id;       // Set for gossip frames only
+    uint8_t hops = 0;   // Links a gossip frame may still cross
+    bool compressed = false; // Body is still compressed and has to be inflated before use
+};
+
+// Outcome of trying to parse one frame from the front of a buffer
+enum class ParseResult {
+    ok,          // A frame was parsed and `consumed` bytes can be dropped
+    incomplete,  // More bytes are needed
+    invalid,     // The stream is corrupt and the connection should be dropped
+};
+
+// Compact colour ids used on the wire, index into the colour table
+uint8_t colour_to_id(Color colour);
+Color colour_from_id(uint8_t id);
+string_view colour_name(uint8_t id);
+uint8_t colour_id_from_name(string_view name);
+
+// True if `room` can be joined by a user: 1 to MAX_ROOM_LENGTH letters, digits, '-' or '_'
+bool is_valid_room_name(string_view room);
+
+// Console error for a message longer than MAX_MESSAGE_BODY, which is not sent
+string oversized_message_error(std::size_t size);
+
+// Parses a single text line (colour|name: text\n) in place
+ParseResult parse_text_frame(string_view buffer, MessageView& message, std::size_t& consumed);
+
+// Parses a single length-prefixed binary frame in place
+ParseResult parse_binary_frame(string_view buffer, MessageView& message, std::size_t& consumed);
+
+// Appends an encoded frame to `out`
+void append_text_frame(string& out, uint8_t colour_id, string_view name, string_view body);
+void append_binary_frame(string& out, FrameType type, uint8_t colour_id, string_view name, string_view body,
+    const MessageId& id = MessageId(), uint8_t hops = 0, bool compressed = false, string_view room = string_view());
+
+// A message ready to be written to one or more peers. It is encoded at most once per wire format
+// and the encoded bytes are shared by every recipient using that format. The message, its reference
+// count and its encodings all live in BufferPool blocks, so the hot path makes no heap allocation.
+class OutboundMessage {
+public:
+    // Constructor for a chat message, the id and hops are only written for gossip frames
+    OutboundMessage(FrameType type, uint8_t colour_id, string_view name, string_view body,
+        const MessageId& id = MessageId(), uint8_t hops = 0, string_view room = string_view());
+
+    // Creates a shared message in one pool block, use instead of make_shared
+    static std::shared_ptr<const OutboundMessage> create(FrameType type, uint8_t colour_id, string_view name, string_view body,
+        const MessageId& id = MessageId(), uint8_t hops = 0, string_view room = string_view());
+
+    // Wraps bytes that are written verbatim whatever the wire format, used for control lines
+    static std::shared_ptr<const OutboundMessage> raw(string_view bytes);
+
+    // Returns the encoded frame for the given format, encoding it on first use. Frames that only
+    // exist in the binary format encode to an empty string in text format and are not sent.
+    // `compressed` asks for a compressed binary frame, large bodies are compressed once and the
+    // result is shared by every peer that negotiated compression. The view lives as long as the message.
+    string_view encoded(WireFormat format, bool compressed = false) const;
+
+    FrameType type() const { return type_; }
+    uint8_t colour_id() const { return colour_id_; }
+    string_view name() const { return name_; }
+    string_view body() const { return body_; }
+    string_view room() const { return room_; }
+    const MessageId& id() const { return id_; }
+    uint8_t hops() const { return hops_; }
+    bool is_raw() const { return is_raw_; }
+
+private:
+    FrameType type_ = FrameType::chat;
+    uint8_t colour_id_ = 0;
+    PooledString name_;
+    PooledString body_;
+    PooledString room_;
+    MessageId id_;
+    uint8_t hops_ = 0;
+    bool is_raw_ = false;
+    mutable std::array<std::once_flag, 3> encode_once_;  // One flag per encoding
+    mutable std::array<PooledString, 3> encoded_;       // Cached encodings: text, binary, compressed binary
+};
+
+#endif // PROTOCOL_H
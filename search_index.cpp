@@ -0,0 +1,425 @@
+#include "search_index.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <queue>
+
+namespace fs = std::filesystem;
+
+// Identifies a saved index
+const char SEARCH_MAGIC[4] = { 'E', 'S', 'R', 'X' };
+const uint8_t SEARCH_VERSION = 1;
+// Saturation of repeated words in one message, as in BM25
+const double REPEAT_SATURATION = 1.2;
+// Extra weight of a word found in the sender's name
+const double NAME_WEIGHT = 1.0;
+// Highest count of a word in one message that is stored
+const uint64_t MAX_WORD_COUNT = 127;
+
+// Little-endian base 128 helpers, as in the capture format
+static void put_varint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(uint8_t(value) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static bool get_varint(string_view data, std::size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+        uint8_t byte = uint8_t(data[offset++]);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Letters, digits and the bytes of multibyte UTF-8 characters make up words
+static bool is_word_byte(char c) {
+    uint8_t byte = uint8_t(c);
+    return byte >= 0x80 || (byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z');
+}
+
+// Starts at the first posting of the list
+SearchIndex::Cursor::Cursor(const PostingList& list)
+    : list_(list) {
+    if (list_.count > 0) {
+        uint64_t delta = 0;
+        valid_ = get_varint(list_.data, offset_, delta) && get_varint(list_.data, offset_, value_);
+        number_ = delta;
+    }
+}
+
+// Moves to the following posting
+void SearchIndex::Cursor::next() {
+    uint64_t delta = 0;
+    valid_ = ++position_ < list_.count && get_varint(list_.data, offset_, delta) && get_varint(list_.data, offset_, value_);
+    number_ += delta;
+}
+
+// Moves to the first posting at or after `target`, jumping to the last skip entry before it when
+// that is past the current block
+void SearchIndex::Cursor::seek(uint64_t target) {
+    if (!valid_ || number_ >= target) {
+        return;
+    }
+    // A target inside the current block is reached faster by stepping, as when two dense lists meet
+    std::size_t next_block = position_ / SKIP_INTERVAL + 1;
+    if (next_block >= list_.skips.size() || list_.skips[next_block].number > target) {
+        while (valid_ && number_ < target) {
+            next();
+        }
+        return;
+    }
+    // The last skip at or before the target lies past the current block
+    auto skip = std::upper_bound(list_.skips.begin() + std::ptrdiff_t(next_block), list_.skips.end(), target,
+        [](uint64_t value, const Skip& entry) { return value < entry.number; }) - 1;
+    // The delta stored at a skip is relative to a posting that is jumped over, the skip has the number
+    uint64_t delta = 0;
+    offset_ = std::size_t(skip->offset);
+    position_ = std::size_t(skip - list_.skips.begin()) * SKIP_INTERVAL;
+    valid_ = get_varint(list_.data, offset_, delta) && get_varint(list_.data, offset_, value_);
+    number_ = skip->number;
+    while (valid_ && number_ < target) {
+        next();
+    }
+}
+
+// Splits text into lowercase words cut to MAX_TERM_LENGTH bytes. Words are appended to `scratch`,
+// the caller reserves room for all the text it tokenizes so the views stay valid.
+void SearchIndex::tokenize(string_view text, string& scratch, std::vector<string_view>& words) {
+    std::size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !is_word_byte(text[i])) {
+            ++i;
+        }
+        std::size_t start = scratch.size();
+        std::size_t length = 0;
+        for (; i < text.size() && is_word_byte(text[i]); ++i) {
+            if (length < MAX_TERM_LENGTH) {
+                char c = text[i];
+                scratch.push_back(c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c);
+                ++length;
+            }
+        }
+        if (length > 0) {
+            words.push_back(string_view(scratch.data() + start, length));
+        }
+    }
+}
+
+// Encodes a posting at the end of a list, with a skip entry at the start of every block
+void SearchIndex::append_posting(PostingList& list, uint64_t number, uint64_t value) {
+    if (list.count % SKIP_INTERVAL == 0) {
+        list.skips.push_back(Skip{ number, list.data.size() });
+    }
+    put_varint(list.data, number - (list.count > 0 ? list.last : 0));
+    put_varint(list.data, value);
+    list.last = number;
+    ++list.count;
+}
+
+// Adds a record. Its words are counted once each, so a posting holds how often the word appears in
+// the body and whether it is part of the name. Only new words and growing lists allocate.
+void SearchIndex::add(uint64_t number, string_view name, string_view body) {
+    if (number < end_) {
+        return;
+    }
+    if (end_ == first_) {
+        first_ = number;
+    }
+    end_ = number + 1;
+
+    scratch_.clear();
+    scratch_.reserve(name.size() + body.size());
+    words_.clear();
+    tokenize(name, scratch_, words_);
+    std::size_t name_words = words_.size();
+    tokenize(body, scratch_, words_);
+
+    counts_.clear();
+    for (std::size_t i = 0; i < words_.size(); ++i) {
+        counts_.emplace_back(words_[i], i < name_words ? 1 : 2);
+    }
+    std::sort(counts_.begin(), counts_.end());
+
+    std::size_t i = 0;
+    while (i < counts_.size()) {
+        string_view word = counts_[i].first;
+        uint64_t in_name = 0;
+        uint64_t in_body = 0;
+        for (; i < counts_.size() && counts_[i].first == word; ++i) {
+            in_name |= counts_[i].second & 1;
+            in_body += counts_[i].second >> 1;
+        }
+        auto it = terms_.find(word);
+        if (it == terms_.end()) {
+            it = terms_.emplace(string(word), PostingList()).first;
+        }
+        std::size_t before = it->second.data.size();
+        append_posting(it->second, number, std::min(in_body, MAX_WORD_COUNT) << 1 | in_name);
+        posting_bytes_ += it->second.data.size() - before;
+        ++postings_;
+    }
+}
+
+// Walks the posting lists of every word together, rarest first. The rarest list drives the walk and
+// the others seek to its records, so the work follows the rarest word rather than the commonest.
+SearchResult SearchIndex::search(string_view query, uint64_t first, uint64_t last, std::size_t max_hits) const {
+    SearchResult result;
+    string scratch;
+    scratch.reserve(query.size());
+    std::vector<string_view> words;
+    tokenize(query, scratch, words);
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    if (words.size() > MAX_QUERY_TERMS) {
+        words.resize(MAX_QUERY_TERMS);
+    }
+    if (words.empty() || max_hits == 0) {
+        return result;
+    }
+
+    // A word found in few messages says more about a message than one found in most
+    struct Term {
+        const PostingList* list;
+        double weight;
+    };
+    std::vector<Term> terms;
+    double documents = double(end_ - first_);
+    for (string_view word : words) {
+        auto it = terms_.find(word);
+        if (it == terms_.end()) {
+            return result;
+        }
+        double frequency = double(it->second.count);
+        terms.push_back(Term{ &it->second, std::log(1.0 + (documents - frequency + 0.5) / (frequency + 0.5)) });
+    }
+    std::sort(terms.begin(), terms.end(), [](const Term& a, const Term& b) { return a.list->count < b.list->count; });
+
+    std::vector<Cursor> cursors;
+    cursors.reserve(terms.size());
+    for (const Term& term : terms) {
+        cursors.emplace_back(*term.list);
+    }
+
+    // Keeps the best max_hits with the worst of them on top, a newer record beats an older one on ties
+    auto better = [](const SearchHit& a, const SearchHit& b) {
+        return a.score != b.score ? a.score > b.score : a.number > b.number;
+    };
+    std::priority_queue<SearchHit, std::vector<SearchHit>, decltype(better)> best(better);
+
+    Cursor& lead = cursors.front();
+    lead.seek(first);
+    bool exhausted = false;
+    while (!exhausted && lead.valid() && lead.number() < last) {
+        uint64_t candidate = lead.number();
+        bool matched = true;
+        for (std::size_t i = 1; i < cursors.size(); ++i) {
+            cursors[i].seek(candidate);
+            if (!cursors[i].valid()) {
+                exhausted = true;
+                matched = false;
+                break;
+            }
+            if (cursors[i].number() != candidate) {
+                lead.seek(cursors[i].number());
+                matched = false;
+                break;
+            }
+        }
+        if (!matched) {
+            continue;
+        }
+
+        ++result.matches;
+        SearchHit hit{ candidate, 0.0 };
+        for (std::size_t i = 0; i < cursors.size(); ++i) {
+            double count = double(cursors[i].value() >> 1);
+            double in_name = (cursors[i].value() & 1) ? NAME_WEIGHT : 0.0;
+            hit.score += terms[i].weight * (count * (REPEAT_SATURATION + 1.0) / (count + REPEAT_SATURATION) + in_name);
+        }
+        if (best.size() < max_hits) {
+            best.push(hit);
+        }
+        else if (better(hit, best.top())) {
+            best.pop();
+            best.push(hit);
+        }
+        lead.next();
+    }
+
+    // The queue gives up the worst hit first
+    result.hits.resize(best.size());
+    for (std::size_t i = best.size(); i > 0; --i) {
+        result.hits[i - 1] = best.top();
+        best.pop();
+    }
+    return result;
+}
+
+// Re-encodes the lists that still start before `number`, lists left empty are removed
+void SearchIndex::drop_before(uint64_t number) {
+    if (number <= first_) {
+        return;
+    }
+    first_ = std::min(number, end_);
+    postings_ = 0;
+    posting_bytes_ = 0;
+    for (auto it = terms_.begin(); it != terms_.end();) {
+        PostingList& list = it->second;
+        if (list.last < number) {
+            it = terms_.erase(it);
+            continue;
+        }
+        if (list.skips.front().number < number) {
+            PostingList kept;
+            Cursor cursor(list);
+            for (cursor.seek(number); cursor.valid(); cursor.next()) {
+                append_posting(kept, cursor.number(), cursor.value());
+            }
+            list = std::move(kept);
+        }
+        postings_ += list.count;
+        posting_bytes_ += list.data.size();
+        ++it;
+    }
+}
+
+// Removes every posting
+void SearchIndex::clear() {
+    terms_.clear();
+    first_ = end_ = 0;
+    postings_ = posting_bytes_ = 0;
+}
+
+// Number of the next record to be added
+uint64_t SearchIndex::end() const {
+    return end_;
+}
+
+// Distinct terms held
+std::size_t SearchIndex::terms() const {
+    return terms_.size();
+}
+
+// Postings held
+uint64_t SearchIndex::postings() const {
+    return postings_;
+}
+
+// Bytes of encoded postings held
+uint64_t SearchIndex::posting_bytes() const {
+    return posting_bytes_;
+}
+
+// Writes the magic, version, covered record range and every list; skips are rebuilt on loading
+bool SearchIndex::save(const string& path) const {
+    string temporary = path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    string header(SEARCH_MAGIC, sizeof(SEARCH_MAGIC));
+    header.push_back(char(SEARCH_VERSION));
+    put_varint(header, first_);
+    put_varint(header, end_);
+    put_varint(header, terms_.size());
+    bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+
+    string entry;
+    for (const auto& [term, list] : terms_) {
+        entry.clear();
+        put_varint(entry, term.size());
+        entry.append(term);
+        put_varint(entry, list.count);
+        put_varint(entry, list.data.size());
+        ok = ok && std::fwrite(entry.data(), 1, entry.size(), file) == entry.size()
+            && std::fwrite(list.data.data(), 1, list.data.size(), file) == list.data.size();
+    }
+    ok = std::fclose(file) == 0 && ok;
+
+    std::error_code ec;
+    if (ok) {
+        fs::rename(temporary, path, ec);
+    }
+    if (!ok || ec) {
+        fs::remove(temporary, ec);
+        return false;
+    }
+    return true;
+}
+
+// Reads a saved index, every list is decoded once to check it and rebuild its skips
+bool SearchIndex::load(const string& path) {
+    clear();
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    string data;
+    char chunk[64 * 1024];
+    std::size_t length = 0;
+    while ((length = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, length);
+    }
+    std::fclose(file);
+
+    if (data.size() < sizeof(SEARCH_MAGIC) + 1 || std::memcmp(data.data(), SEARCH_MAGIC, sizeof(SEARCH_MAGIC)) != 0
+        || uint8_t(data[sizeof(SEARCH_MAGIC)]) != SEARCH_VERSION) {
+        return false;
+    }
+    std::size_t offset = sizeof(SEARCH_MAGIC) + 1;
+    uint64_t term_count = 0;
+    bool ok = get_varint(data, offset, first_) && get_varint(data, offset, end_) && get_varint(data, offset, term_count) && first_ <= end_;
+    terms_.reserve(std::size_t(std::min<uint64_t>(term_count, data.size())));
+    for (uint64_t i = 0; ok && i < term_count; ++i) {
+        uint64_t term_length = 0;
+        uint64_t count = 0;
+        uint64_t data_length = 0;
+        ok = get_varint(data, offset, term_length) && term_length <= data.size() - offset;
+        string term = ok ? data.substr(offset, std::size_t(term_length)) : string();
+        offset += ok ? std::size_t(term_length) : 0;
+        ok = ok && get_varint(data, offset, count) && get_varint(data, offset, data_length) && data_length <= data.size() - offset;
+        if (!ok) {
+            break;
+        }
+        PostingList& list = terms_[term];
+        list.data = data.substr(offset, std::size_t(data_length));
+        list.count = count;
+        offset += std::size_t(data_length);
+        ok = count > 0 && rebuild_skips(list) && list.last < end_;
+        postings_ += list.count;
+        posting_bytes_ += list.data.size();
+    }
+    if (!ok || offset != data.size()) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+// Decodes a whole list, recording a skip every SKIP_INTERVAL postings and its last record number.
+// False if the list does not hold `count` postings in increasing record order.
+bool SearchIndex::rebuild_skips(PostingList& list) {
+    list.skips.clear();
+    std::size_t offset = 0;
+    uint64_t number = 0;
+    for (uint64_t i = 0; i < list.count; ++i) {
+        std::size_t start = offset;
+        uint64_t delta = 0;
+        uint64_t value = 0;
+        if (!get_varint(list.data, offset, delta) || !get_varint(list.data, offset, value) || (i > 0 && delta == 0)) {
+            return false;
+        }
+        number += delta;
+        if (i % SKIP_INTERVAL == 0) {
+            list.skips.push_back(Skip{ number, start });
+        }
+    }
+    list.last = number;
+    return offset == list.data.size();
+}
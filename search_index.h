@@ -0,0 +1,129 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+using std::string_view;
+
+// A record matching a search, best first
+struct SearchHit {
+    uint64_t number = 0;  // Record number in the message log
+    double score = 0.0;
+};
+
+// Outcome of a search: the best hits and how many records matched in all
+struct SearchResult {
+    std::vector<SearchHit> hits;
+    uint64_t matches = 0;
+};
+
+// Inverted index over the sender names and bodies of logged messages. Each term maps to a posting
+// list of the record numbers containing it, delta encoded as varints with the term's count in the
+// record, so a posting usually takes two bytes. Every SKIP_INTERVAL postings a skip entry records
+// where a record number starts, which lets a search jump through long lists the way the log's
+// sparse index lets a reader jump through a segment.
+//
+// Record numbers only grow and so do their timestamps, so a time range becomes a range of record
+// numbers and is applied while walking the lists. Not thread safe, the message log serialises use.
+class SearchIndex {
+public:
+    // One skip entry is kept every SKIP_INTERVAL postings of a term
+    static constexpr uint64_t SKIP_INTERVAL = 128;
+    // Longer words are cut to this many bytes
+    static constexpr std::size_t MAX_TERM_LENGTH = 32;
+    // Query words beyond this many are ignored
+    static constexpr std::size_t MAX_QUERY_TERMS = 8;
+
+    // Adds a record, numbers must be added in increasing order
+    void add(uint64_t number, string_view name, string_view body);
+
+    // Records containing every word of `query` with numbers in [first, last), best `max_hits` first.
+    // Rarer words and words in the sender's name count for more, ties go to the newer record.
+    SearchResult search(string_view query, uint64_t first, uint64_t last, std::size_t max_hits) const;
+
+    // Forgets postings of records before `number`, used once the log has deleted them
+    void drop_before(uint64_t number);
+
+    // Removes every posting
+    void clear();
+
+    // Number of the next record to be added, the index covers the records before it
+    uint64_t end() const;
+
+    // Distinct terms, postings and posting bytes held
+    std::size_t terms() const;
+    uint64_t postings() const;
+    uint64_t posting_bytes() const;
+
+    // Writes the index to `path` through a temporary file, so a crash leaves the previous one intact
+    bool save(const string& path) const;
+
+    // Replaces the index with the one saved at `path`, false if it is missing or damaged
+    bool load(const string& path);
+
+    // Splits `text` into lowercase words of letters and digits, bytes of multibyte UTF-8 characters
+    // count as letters. The words are appended to `scratch` and viewed there, so reserve room for all
+    // the text tokenized into it first.
+    static void tokenize(string_view text, string& scratch, std::vector<string_view>& words);
+
+private:
+    // Record number and offset of every SKIP_INTERVAL-th posting of a list
+    struct Skip {
+        uint64_t number;
+        uint64_t offset;
+    };
+
+    // Postings of one term: varint record number delta, varint (count in body << 1 | in name)
+    struct PostingList {
+        string data;
+        std::vector<Skip> skips;
+        uint64_t last = 0;   // Record number of the last posting
+        uint64_t count = 0;  // Postings in data
+    };
+
+    // Walks one posting list in record order, jumping ahead through the skips
+    class Cursor {
+    public:
+        explicit Cursor(const PostingList& list);
+        bool valid() const { return valid_; }
+        uint64_t number() const { return number_; }
+        uint64_t value() const { return value_; }
+        void next();                 // Moves to the following posting
+        void seek(uint64_t target);  // Moves to the first posting at or after `target`
+
+    private:
+        const PostingList& list_;
+        std::size_t offset_ = 0;     // Start of the posting after the current one
+        std::size_t position_ = 0;   // Index of the current posting
+        uint64_t number_ = 0;
+        uint64_t value_ = 0;
+        bool valid_ = false;
+    };
+
+    // Hashes std::string and string_view alike so lookups by view allocate nothing
+    struct TermHash {
+        using is_transparent = void;
+        std::size_t operator()(string_view term) const { return std::hash<string_view>()(term); }
+    };
+
+    void append_posting(PostingList& list, uint64_t number, uint64_t value); // Encodes a posting at the end of a list
+    static bool rebuild_skips(PostingList& list); // Recomputes the skips and last number of a loaded list
+
+    std::unordered_map<string, PostingList, TermHash, std::equal_to<>> terms_;
+    uint64_t first_ = 0;               // Oldest record number still indexed
+    uint64_t end_ = 0;                 // Next record number expected
+    uint64_t postings_ = 0;            // Postings in all lists
+    uint64_t posting_bytes_ = 0;       // Encoded size of all lists
+    string scratch_;                   // Lowercased text of the record being added
+    std::vector<string_view> words_;   // Words of the record being added
+    std::vector<std::pair<string_view, uint64_t>> counts_; // Distinct words of the record and their values
+};
+
+#endif // SEARCH_INDEX_H
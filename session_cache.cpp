@@ -0,0 +1,64 @@
+#include "session_cache.h"
+
+// Releases every stored session
+SessionCache::~SessionCache() {
+    for (auto& entry : sessions_) {
+        SSL_SESSION_free(entry.second);
+    }
+}
+
+// SSL ex_data slot holding a pointer to the connection's cache key
+int SessionCache::key_index() {
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// SSL_CTX ex_data slot holding a pointer to the cache
+int SessionCache::cache_index() {
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// Installs the new-session callback, sessions are kept here rather than in OpenSSL's internal store
+void SessionCache::attach(boost::asio::ssl::context& ssl_context) {
+    SSL_CTX* ctx = ssl_context.native_handle();
+    SSL_CTX_set_ex_data(ctx, cache_index(), this);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &SessionCache::on_new_session);
+}
+
+// Tags the connection with its key and offers the stored session for that key
+bool SessionCache::prepare(SSL* ssl, const string* key) {
+    SSL_set_ex_data(ssl, key_index(), const_cast<string*>(key));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(*key);
+    if (it == sessions_.end()) {
+        return false;
+    }
+    return SSL_set_session(ssl, it->second) == 1;
+}
+
+// Number of hosts with a stored session
+std::size_t SessionCache::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sessions_.size();
+}
+
+// Called by OpenSSL whenever the server issues a session (TLS 1.3 tickets arrive after the handshake)
+int SessionCache::on_new_session(SSL* ssl, SSL_SESSION* session) {
+    auto* cache = static_cast<SessionCache*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), cache_index()));
+    auto* key = static_cast<const string*>(SSL_get_ex_data(ssl, key_index()));
+    if (!cache || !key) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    SSL_SESSION*& slot = cache->sessions_[*key];
+    if (slot) {
+        SSL_SESSION_free(slot);
+    }
+    // Returning 1 keeps the reference OpenSSL passed in
+    slot = session;
+    return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <boost/asio/ssl.hpp>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <openssl/ssl.h>
+
+using std::string;
+
+// Client-side store of TLS sessions keyed by the host they were negotiated with, so a
+// reconnect to the same host can resume instead of paying for a full handshake
+class SessionCache {
+public:
+    SessionCache() = default;
+    SessionCache(const SessionCache&) = delete;
+    SessionCache& operator=(const SessionCache&) = delete;
+    ~SessionCache();
+
+    // Installs the new-session callback on a client context, the cache must outlive the context
+    void attach(boost::asio::ssl::context& ssl_context);
+
+    // Tags a connection with the key its sessions are stored under and offers a stored session
+    // for resumption, returns true if one was offered. The key must outlive the connection.
+    bool prepare(SSL* ssl, const string* key);
+
+    // Number of hosts with a stored session
+    std::size_t size();
+
+private:
+    static int on_new_session(SSL* ssl, SSL_SESSION* session); // OpenSSL new-session callback
+    static int key_index(); // SSL ex_data slot holding the connection's key
+    static int cache_index(); // SSL_CTX ex_data slot holding the cache
+
+    std::mutex mutex_;                                   // Callbacks run on the IO thread
+    std::unordered_map<string, SSL_SESSION*> sessions_;  // Latest session per host, holds a reference
+};
+
+#endif // SESSION_CACHE_H